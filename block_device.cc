@@ -0,0 +1,85 @@
+#include "block_device.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+
+BlockDevice::BlockDevice(int fd, uint16_t *memory,
+                         std::atomic<uint32_t> *events)
+    : fd_(fd), memory_(memory), events_(events) {
+  thread_ = std::thread(&BlockDevice::Worker, this);
+}
+
+BlockDevice::~BlockDevice() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wakeup_.notify_one();
+  thread_.join();
+  close(fd_);
+}
+
+std::unique_ptr<BlockDevice> BlockDevice::Open(const std::string &filename,
+                                               uint16_t *memory,
+                                               std::atomic<uint32_t> *events) {
+  int fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  return std::make_unique<BlockDevice>(fd, memory, events);
+}
+
+void BlockDevice::Start(uint16_t command, uint16_t block, uint16_t address) {
+  if (!(Status() & kReady)) {
+    return;  // busy; the command is dropped
+  }
+  if ((command != kDiskRead && command != kDiskWrite) ||
+      address + kDiskBlockWords > kMMIOBase) {
+    status_.store(kReady | kError, std::memory_order_relaxed);
+    return;
+  }
+  status_.store(0, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    request_ = {command, block, address};
+    pending_ = true;
+  }
+  wakeup_.notify_one();
+}
+
+void BlockDevice::Worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wakeup_.wait(lock, [this] { return pending_ || stopping_; });
+    if (stopping_) {
+      return;
+    }
+    Request request = request_;
+    pending_ = false;
+    lock.unlock();
+    bool ok = Transfer(request);
+    status_.store(kReady | kDone | (ok ? 0 : kError),
+                  std::memory_order_release);
+    events_->fetch_or(kDiskEvent, std::memory_order_relaxed);
+    lock.lock();
+  }
+}
+
+bool BlockDevice::Transfer(const Request &request) {
+  constexpr ssize_t kBytes = kDiskBlockWords * sizeof(uint16_t);
+  off_t offset = static_cast<off_t>(request.block) * kBytes;
+  uint16_t *words = memory_ + request.address;
+  if (request.command == kDiskRead) {
+    if (pread(fd_, words, kBytes, offset) != kBytes) {
+      return false;
+    }
+    std::transform(words, words + kDiskBlockWords, words, Swap16);
+    return true;
+  }
+  std::array<uint16_t, kDiskBlockWords> buffer;
+  std::transform(words, words + kDiskBlockWords, buffer.begin(), Swap16);
+  return pwrite(fd_, buffer.data(), kBytes, offset) == kBytes;
+}
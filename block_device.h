@@ -0,0 +1,83 @@
+#ifndef LC3_BLOCK_DEVICE_H_
+#define LC3_BLOCK_DEVICE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "isa.h"
+
+// Bits of Simulator::events_, the one word tested at block boundaries.
+enum Event {
+  kKeyboardEvent = 1 << 0,  // keyboard interrupts are enabled; poll the host
+  kDiskEvent = 1 << 1,      // the disk finished a transfer
+  kStopEvent = 1 << 2,      // Simulator::RequestStop() was called
+  kInputEvent = 1 << 3      // a KBSR read found the console would block
+};
+
+constexpr size_t kDiskBlockWords = 256;
+
+// A block device backed by a disk image of 512-byte blocks of big-endian
+// words. Transfers run on a host I/O thread that reads and writes guest
+// memory directly, so the guest keeps executing while they are in flight;
+// like real DMA, the guest must leave the buffer alone until DKSR reports
+// completion.
+class BlockDevice {
+ public:
+  BlockDevice(int fd, uint16_t *memory, std::atomic<uint32_t> *events);
+  ~BlockDevice();
+
+  BlockDevice(const BlockDevice &) = delete;
+  BlockDevice &operator=(BlockDevice &) = delete;
+
+  static std::unique_ptr<BlockDevice> Open(const std::string &filename,
+                                           uint16_t *memory,
+                                           std::atomic<uint32_t> *events);
+
+  // Ready, done and error bits; acquire so that a guest which sees the
+  // transfer finish also sees the transferred words.
+  uint16_t Status() const { return status_.load(std::memory_order_acquire); }
+
+  // Clears the done bit and returns the status from before, in one step, so
+  // that a completion stored in between cannot be cleared unseen.
+  uint16_t Acknowledge() {
+    return status_.fetch_and(~kDone, std::memory_order_acq_rel);
+  }
+
+  void Start(uint16_t command, uint16_t block, uint16_t address);
+
+  // Points later transfers at another guest memory. A transfer must not be
+  // in flight.
+  void SetMemory(uint16_t *memory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    memory_ = memory;
+  }
+
+ private:
+  struct Request {
+    uint16_t command;
+    uint16_t block;
+    uint16_t address;
+  };
+
+  void Worker();
+  bool Transfer(const Request &request);
+
+  int fd_;
+  uint16_t *memory_;
+  std::atomic<uint32_t> *events_;
+  std::atomic<uint16_t> status_{kReady};
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  Request request_;
+  bool pending_ = false;
+  bool stopping_ = false;
+};
+
+#endif  // LC3_BLOCK_DEVICE_H_
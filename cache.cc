@@ -0,0 +1,267 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+namespace {
+
+bool IsPowerOfTwo(uint32_t x) { return x && !(x & (x - 1)); }
+
+std::string Hex(uint16_t address) {
+  char text[8];
+  std::snprintf(text, sizeof(text), "x%04X", address);
+  return text;
+}
+
+const char *ReplacementName(Replacement replacement) {
+  switch (replacement) {
+    case Replacement::kLRU:
+      return "lru";
+    case Replacement::kFIFO:
+      return "fifo";
+    case Replacement::kRandom:
+      return "random";
+  }
+  return "";
+}
+
+}  // namespace
+
+bool ParseCacheSpec(const std::string &spec, CacheLevel *level,
+                    CacheConfig *config) {
+  std::vector<std::string> fields;
+  std::istringstream in(spec);
+  for (std::string field; std::getline(in, field, ':');) {
+    fields.push_back(field);
+  }
+  if (fields.size() < 4) {
+    return false;
+  }
+  if (fields[0] == "l1i") {
+    *level = CacheLevel::kL1I;
+  } else if (fields[0] == "l1d") {
+    *level = CacheLevel::kL1D;
+  } else if (fields[0] == "l2") {
+    *level = CacheLevel::kL2;
+  } else {
+    return false;
+  }
+  uint32_t *numbers[] = {&config->size, &config->ways, &config->line};
+  for (int i = 0; i < 3; ++i) {
+    char *end;
+    unsigned long value = std::strtoul(fields[i + 1].c_str(), &end, 10);
+    if (fields[i + 1].empty() || *end != '\0' || !IsPowerOfTwo(value) ||
+        value > kMemorySize) {
+      return false;
+    }
+    *numbers[i] = static_cast<uint32_t>(value);
+  }
+  if (config->ways * config->line > config->size) {
+    return false;
+  }
+  config->replacement = Replacement::kLRU;
+  config->write_back = true;
+  for (size_t i = 4; i < fields.size(); ++i) {
+    if (fields[i] == "lru") {
+      config->replacement = Replacement::kLRU;
+    } else if (fields[i] == "fifo") {
+      config->replacement = Replacement::kFIFO;
+    } else if (fields[i] == "random") {
+      config->replacement = Replacement::kRandom;
+    } else if (fields[i] == "wb") {
+      config->write_back = true;
+    } else if (fields[i] == "wt") {
+      config->write_back = false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+Cache::Cache(const CacheConfig &config)
+    : config_(config),
+      offset_bits_(__builtin_ctz(config.line)),
+      set_mask_(config.size / config.line / config.ways - 1),
+      entries_(config.size / config.line) {}
+
+bool Cache::Lookup(uint32_t line, bool write, int32_t *writeback) {
+  last_line_ = line;
+  uint32_t ways = config_.ways;
+  uint32_t *set = &entries_[(line & set_mask_) * ways];
+  for (uint32_t i = 0; i < ways; ++i) {
+    uint32_t entry = set[i];
+    if ((entry & (kValid | kLineMask)) == (kValid | line)) {
+      if (write && config_.write_back) {
+        entry |= kDirty;
+      }
+      if (config_.replacement == Replacement::kLRU) {
+        std::copy_backward(set, set + i, set + i + 1);
+        i = 0;
+      }
+      set[i] = entry;
+      last_entry_ = &set[i];
+      return true;
+    }
+  }
+
+  if (write) {
+    ++write_misses;
+  } else {
+    ++read_misses;
+  }
+  if (write && !config_.write_back) {
+    last_line_ = kNoLine;
+    return false;
+  }
+  // fills move every way down one, so empty ways are always last
+  uint32_t victim = ways - 1;
+  if (config_.replacement == Replacement::kRandom && (set[victim] & kValid)) {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 17;
+    random_ ^= random_ << 5;
+    victim = random_ & (ways - 1);
+  }
+  if ((set[victim] & (kValid | kDirty)) == (kValid | kDirty)) {
+    ++writebacks;
+    *writeback = (set[victim] & kLineMask) << offset_bits_;
+  }
+  std::copy_backward(set, set + victim, set + victim + 1);
+  set[0] = kValid | line | (write ? kDirty : 0);
+  last_entry_ = &set[0];
+  return false;
+}
+
+CacheSimulator::CacheSimulator()
+    : misses_(kMemorySize), data_accesses_(kMemorySize) {}
+
+void CacheSimulator::Configure(CacheLevel level, const CacheConfig &config) {
+  std::unique_ptr<Cache> cache(new Cache(config));
+  switch (level) {
+    case CacheLevel::kL1I:
+      l1i_ = std::move(cache);
+      break;
+    case CacheLevel::kL1D:
+      l1d_ = std::move(cache);
+      break;
+    case CacheLevel::kL2:
+      l2_ = std::move(cache);
+      break;
+  }
+}
+
+void CacheSimulator::Flush() {
+  for (size_t i = 0; i < queued_; ++i) {
+    const Access &access = queue_[i];
+    if (access.kind == kFetch) {
+      int32_t writeback = -1;  // instruction caches are never dirty
+      if (!l1i_ || !l1i_->Access(access.address, false, &writeback)) {
+        misses_[access.pc].l1i += l1i_ != nullptr;
+        AccessL2(access.pc, access.address, false);
+      }
+      continue;
+    }
+    ++data_accesses_[access.pc];
+    bool write = access.kind == kWrite;
+    if (!l1d_) {
+      AccessL2(access.pc, access.address, write);
+      continue;
+    }
+    int32_t writeback = -1;
+    bool hit = l1d_->Access(access.address, write, &writeback);
+    if (writeback >= 0) {
+      AccessL2(access.pc, writeback, true);
+    }
+    if (write && !l1d_->config().write_back) {
+      AccessL2(access.pc, access.address, true);
+    } else if (!hit) {
+      AccessL2(access.pc, access.address, false);  // the fill
+    }
+    misses_[access.pc].l1d += !hit;
+  }
+  queued_ = 0;
+}
+
+void CacheSimulator::AccessL2(uint16_t pc, uint16_t address, bool write) {
+  if (!l2_) {
+    ++(write ? memory_writes_ : memory_reads_);
+    return;
+  }
+  int32_t writeback = -1;
+  bool hit = l2_->Access(address, write, &writeback);
+  misses_[pc].l2 += !hit;
+  if (writeback >= 0) {
+    ++memory_writes_;
+  }
+  if (write && !l2_->config().write_back) {
+    ++memory_writes_;
+  } else if (!hit) {
+    ++memory_reads_;
+  }
+}
+
+void CacheSimulator::WriteReport(std::ostream &out,
+                                 const SymbolTable &symbols) {
+  constexpr size_t kTop = 20;
+  Flush();
+  char line[160];
+  std::snprintf(line, sizeof(line), "%-4s %30s %12s %8s %12s %8s %10s\n",
+                "", "config", "reads", "miss", "writes", "miss",
+                "writebacks");
+  out << line;
+  auto level = [&](const char *name, const Cache *cache) {
+    if (!cache) {
+      return;
+    }
+    const CacheConfig &c = cache->config();
+    char config[40];
+    std::snprintf(config, sizeof(config), "%uw %u-way %uw-line %s %s",
+                  c.size, c.ways, c.line, ReplacementName(c.replacement),
+                  c.write_back ? "wb" : "wt");
+    auto rate = [](uint64_t misses, uint64_t n) {
+      return n ? 100.0 * misses / n : 0.0;
+    };
+    std::snprintf(line, sizeof(line),
+                  "%-4s %30s %12llu %7.2f%% %12llu %7.2f%% %10llu\n", name,
+                  config, static_cast<unsigned long long>(cache->reads),
+                  rate(cache->read_misses, cache->reads),
+                  static_cast<unsigned long long>(cache->writes),
+                  rate(cache->write_misses, cache->writes),
+                  static_cast<unsigned long long>(cache->writebacks));
+    out << line;
+  };
+  level("L1I", l1i_.get());
+  level("L1D", l1d_.get());
+  level("L2", l2_.get());
+  out << "memory: " << memory_reads_ << " reads, " << memory_writes_
+      << " writes\n";
+
+  std::vector<std::pair<uint64_t, uint16_t>> worst;
+  for (size_t pc = 0; pc < kMemorySize; ++pc) {
+    const Misses &m = misses_[pc];
+    if (uint64_t n = m.l1i + m.l1d + m.l2) {
+      worst.emplace_back(n, pc);
+    }
+  }
+  std::sort(worst.rbegin(), worst.rend());
+  if (worst.empty()) {
+    return;
+  }
+  out << "instructions with the most misses:\n";
+  std::snprintf(line, sizeof(line), "%12s %12s %12s %12s\t%s\n",
+                "L1I misses", "L1D misses", "L2 misses", "data accesses",
+                "pc");
+  out << line;
+  for (size_t i = 0; i < worst.size() && i < kTop; ++i) {
+    uint16_t pc = worst[i].second;
+    const Misses &m = misses_[pc];
+    std::snprintf(line, sizeof(line), "%12llu %12llu %12llu %12llu\t",
+                  static_cast<unsigned long long>(m.l1i),
+                  static_cast<unsigned long long>(m.l1d),
+                  static_cast<unsigned long long>(m.l2),
+                  static_cast<unsigned long long>(data_accesses_[pc]));
+    out << line << Hex(pc) << "\t" << symbols.Locate(pc) << "\n";
+  }
+}
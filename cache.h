@@ -0,0 +1,177 @@
+#ifndef LC3_CACHE_H_
+#define LC3_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "isa.h"
+#include "observer.h"
+#include "profiler.h"
+
+// A model of a guest cache hierarchy for performance coursework: split
+// L1 instruction and data caches backed by a unified L2, any of which may
+// be left out. It only counts hits and misses; guest timing is unchanged.
+// Sizes are in 16-bit words, as LC-3 addresses are.
+
+enum class Replacement { kLRU, kFIFO, kRandom };
+
+struct CacheConfig {
+  uint32_t size;  // words; a power of two
+  uint32_t ways;  // a power of two that divides size / line
+  uint32_t line;  // words; a power of two
+  Replacement replacement = Replacement::kLRU;
+  // Write-back caches allocate on a write miss and write dirty lines back
+  // when they are evicted; write-through caches pass every write on and do
+  // not allocate on a write miss.
+  bool write_back = true;
+};
+
+enum class CacheLevel { kL1I, kL1D, kL2 };
+
+// Parses "LEVEL:SIZE:WAYS:LINE[:POLICY]...", where LEVEL is l1i, l1d or
+// l2, and each POLICY is lru, fifo, random, wb (write-back) or wt
+// (write-through). Returns false if spec is malformed or inconsistent.
+bool ParseCacheSpec(const std::string &spec, CacheLevel *level,
+                    CacheConfig *config);
+
+// One set-associative cache. Each way's entry packs the line number (the
+// address without the offset bits) with valid and dirty bits into one word,
+// and each set keeps its ways in replacement order: most recently used (or
+// for FIFO, most recently filled) first.
+class Cache {
+ public:
+  explicit Cache(const CacheConfig &config);
+
+  // Looks up the line holding address and returns whether it was there. A
+  // miss fills the line unless it is a write to a write-through cache; if
+  // that evicts a dirty line, the address of its first word is stored in
+  // *writeback, which is otherwise left alone.
+  bool Access(uint16_t address, bool write, int32_t *writeback) {
+    uint32_t line = address >> offset_bits_;
+    if (write) {
+      ++writes;
+    } else {
+      ++reads;
+    }
+    if (line == last_line_) {
+      if (write && config_.write_back) {
+        *last_entry_ |= kDirty;
+      }
+      return true;
+    }
+    return Lookup(line, write, writeback);
+  }
+
+  const CacheConfig &config() const { return config_; }
+
+  uint64_t reads = 0;
+  uint64_t read_misses = 0;
+  uint64_t writes = 0;
+  uint64_t write_misses = 0;
+  uint64_t writebacks = 0;  // dirty lines evicted
+
+ private:
+  static constexpr uint32_t kValid = 1 << 16;
+  static constexpr uint32_t kDirty = 1 << 17;
+  static constexpr uint32_t kLineMask = 0xFFFF;
+  static constexpr uint32_t kNoLine = ~0u;
+
+  bool Lookup(uint32_t line, bool write, int32_t *writeback);
+
+  CacheConfig config_;
+  int offset_bits_;
+  uint32_t set_mask_;
+  std::vector<uint32_t> entries_;  // ways entries per set
+  uint32_t random_ = 0x9E3779B9;   // xorshift state for kRandom
+  // The line of the last access, if it is cached, and its entry. Nothing
+  // can have evicted it since, so a repeat access, as in straight-line
+  // code, needs no lookup.
+  uint32_t last_line_ = kNoLine;
+  uint32_t *last_entry_ = nullptr;
+};
+
+// An observer (see observer.h) that feeds every instruction fetch, load and
+// store to a cache hierarchy, and counts misses by the PC of the
+// instruction responsible. Accesses are queued and run through the model
+// in batches, which keeps the model's code and tables out of the
+// interpreter loop's way. Device registers (xFE00 and up) are uncached;
+// accesses made by native trap routines are not seen.
+class CacheSimulator : public NullObserver {
+ public:
+  CacheSimulator();
+
+  CacheSimulator(const CacheSimulator &) = delete;
+  CacheSimulator &operator=(CacheSimulator &) = delete;
+
+  // Adds or replaces a level; call before running.
+  void Configure(CacheLevel level, const CacheConfig &config);
+
+  void Execute(uint16_t pc, uint16_t) {
+    pc_ = pc;
+    Queue(kFetch, pc);
+  }
+
+  void Load(uint16_t address, uint16_t) {
+    if (address < kMMIOBase) {
+      Queue(kRead, address);
+    }
+  }
+
+  void Store(uint16_t address, uint16_t) {
+    if (address < kMMIOBase) {
+      Queue(kWrite, address);
+    }
+  }
+
+  // Runs the queued accesses through the model.
+  void Flush();
+
+  // Writes each level's hit and miss counts, then the instructions with
+  // the most misses. Flushes first.
+  void WriteReport(std::ostream &out, const SymbolTable &symbols);
+
+ private:
+  static constexpr size_t kBatchSize = 1 << 12;
+
+  enum Kind : uint8_t { kFetch, kRead, kWrite };
+
+  struct Access {
+    uint16_t pc;
+    uint16_t address;
+    Kind kind;
+  };
+
+  // Misses caused by one instruction.
+  struct Misses {
+    uint64_t l1i;
+    uint64_t l1d;
+    uint64_t l2;
+  };
+
+  void Queue(Kind kind, uint16_t address) {
+    queue_[queued_++] = {pc_, address, kind};
+    if (queued_ == kBatchSize) {
+      Flush();
+    }
+  }
+
+  // Passes an L1 miss or write-through, or a write-back, on to L2.
+  void AccessL2(uint16_t pc, uint16_t address, bool write);
+
+  std::unique_ptr<Cache> l1i_;
+  std::unique_ptr<Cache> l1d_;
+  std::unique_ptr<Cache> l2_;
+  uint64_t memory_reads_ = 0;   // misses in the last level
+  uint64_t memory_writes_ = 0;  // write-throughs and write-backs past it
+
+  uint16_t pc_ = 0;
+  Access queue_[kBatchSize];
+  size_t queued_ = 0;
+  std::vector<Misses> misses_;  // by PC
+  std::vector<uint64_t> data_accesses_;  // by PC
+};
+
+#endif  // LC3_CACHE_H_
@@ -0,0 +1,220 @@
+#!/bin/bash
+# Runs one batch manifest through the scalar interpreter and through the
+# lockstep engine and fails if any job's status or instruction count
+# differs. Jobs with an expected output also check the console output.
+# Then checks that an interrupted sharded run resumes to the same results,
+# checks the fork server's responses, records traces of known programs and
+# checks what lc3trace reports.
+# Usage: check.sh [LC3SIM [LC3TRACE]]
+set -eu
+
+lc3sim=${1:-./lc3sim}
+lc3trace=${2:-./lc3trace}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Writes an image: the origin, then the words, all big-endian hex.
+image() {
+  local file=$dir/$1
+  shift
+  : > "$file"
+  for word in "$@"; do
+    printf "\\x${word:0:2}\\x${word:2:2}" >> "$file"
+  done
+}
+
+# ten ADD R0, R0, #1 and a HALT, with no control transfer before the HALT
+image straight.obj 3000 1021 1021 1021 1021 1021 1021 1021 1021 1021 1021 \
+  F025
+# LD R1, N; LOOP ADD R1, R1, #-1; BRp LOOP; HALT; N .FILL 100
+image loop.obj 3000 2203 127F 03FE F025 0064
+# LEA R0, HI; PUTS; HALT; HI .STRINGZ "hi"
+image hello.obj 3000 E002 F022 F025 0068 0069 0000
+# LEA R7, SUB; JSRR R7; HALT; SUB RET
+image jsrr.obj 3000 EE02 41C0 F025 C1C0
+# LOOP GETC; ADD R1, R0, #1; BRz DONE; OUT; BR LOOP; DONE HALT
+image echo.obj 3000 F020 1221 0402 F021 0FFB F025
+# LD R0, S; PUTS (or PUTSP); HALT; S .FILL xFFF0, with a string that
+# runs off the top of memory and ends at x0001
+image puts.obj 3000 2002 F022 F025 FFF0
+image putsp.obj 3000 2002 F024 F025 FFF0
+image top.obj FFF0 0041 0041 0041 0041 0041 0041 0041 0041 0041 0041 \
+  0041 0041 0041 0041 0041 0041
+image bottom.obj 0000 0042 0000
+# every word of memory x4141, so PUTS and PUTSP from x0000 find no end
+{ printf '\x00\x00'; head -c 131072 /dev/zero | tr '\0' A; } > "$dir/fill.obj"
+image nul.obj 3000 F022 F025
+image nulp.obj 3000 F024 F025
+
+printf 'hiHALT\n' > "$dir/hello.out"
+printf 'echo me' > "$dir/echo.in"
+printf 'echo meHALT\n' > "$dir/echo.out"
+printf 'AAAAAAAAAAAAAAAABHALT\n' > "$dir/wrap.out"
+
+cat > "$dir/manifest" <<EOF
+$dir/straight.obj - - 5
+$dir/straight.obj - - 10
+$dir/straight.obj - - 11
+$dir/straight.obj - -
+$dir/loop.obj - - 50
+$dir/loop.obj - - 201
+$dir/loop.obj - - 202
+$dir/loop.obj - - 203
+$dir/loop.obj - -
+$dir/hello.obj - - 1
+$dir/hello.obj - - 2
+$dir/hello.obj - - 3
+$dir/hello.obj - $dir/hello.out
+$dir/jsrr.obj - -
+$dir/echo.obj $dir/echo.in $dir/echo.out
+$dir/echo.obj $dir/echo.in $dir/echo.out 20
+$dir/puts.obj,$dir/top.obj,$dir/bottom.obj - $dir/wrap.out
+$dir/putsp.obj,$dir/top.obj,$dir/bottom.obj - $dir/wrap.out
+$dir/fill.obj,$dir/nul.obj - -
+$dir/fill.obj,$dir/nulp.obj - -
+EOF
+
+# the exit codes only say whether every job passed
+"$lc3sim" -b "$dir/manifest" | cut -f1-3 > "$dir/scalar" || true
+"$lc3sim" -b "$dir/manifest" -l | cut -f1-3 > "$dir/lockstep" || true
+if ! diff -u "$dir/scalar" "$dir/lockstep"; then
+  echo "check: the lockstep engine disagrees with the interpreter" >&2
+  exit 1
+fi
+if [ "$(wc -l < "$dir/scalar")" -ne "$(grep -c . "$dir/manifest")" ]; then
+  echo "check: missing results" >&2
+  exit 1
+fi
+if grep -qw fail "$dir/scalar"; then
+  echo "check: wrong output" >&2
+  exit 1
+fi
+# malformed limits are rejected rather than read as no limit
+for limit in 10k -5 "5 6"; do
+  echo "$dir/straight.obj - - $limit" > "$dir/bad"
+  if "$lc3sim" -b "$dir/bad" > /dev/null 2>&1 || [ $? -ne 2 ]; then
+    echo "check: accepted the limit '$limit'" >&2
+    exit 1
+  fi
+done
+
+# JSRR jumps to BaseR, and JSRR R7 reads R7 before overwriting it: the
+# call returns to the HALT after four instructions in both engines, where
+# adding BaseR to the PC would run off into zeroed memory
+printf 'HALT\n' > "$dir/jsrr.out"
+echo "$dir/jsrr.obj - $dir/jsrr.out 10" > "$dir/jsrr"
+for engine in "" -l; do
+  result=$("$lc3sim" -b "$dir/jsrr" $engine | cut -f2-3) || true
+  if [ "$result" != "$(printf 'pass\t4')" ]; then
+    echo "check: JSRR R7 did not call and return${engine:+ with $engine}" >&2
+    exit 1
+  fi
+done
+
+# only the two unterminated strings fault
+if [ "$(grep -cw error "$dir/scalar")" -ne 2 ]; then
+  echo "check: unexpected errors" >&2
+  exit 1
+fi
+
+# Sharded batch: a run killed part way through and resumed must give the
+# results of an uninterrupted single-process run. The two spins take long
+# enough that the kill finds them running.
+image spin.obj 3000 0FFF
+{
+  cat "$dir/manifest"
+  echo "$dir/spin.obj - - 40000000"
+  echo "$dir/spin.obj - - 40000001"
+} > "$dir/sharded"
+"$lc3sim" -b "$dir/sharded" -j 2 | cut -f1-3 > "$dir/single" || true
+setsid "$lc3sim" -b "$dir/sharded" -P 2 -j 2 -R "$dir/records" \
+  > /dev/null 2>&1 &
+sleep 0.2
+kill -KILL -- -$! 2> /dev/null || true
+wait $! 2> /dev/null || true
+"$lc3sim" -b "$dir/sharded" -P 2 -j 2 -R "$dir/records" --resume |
+  cut -f1-3 > "$dir/resumed" || true
+if ! diff -u "$dir/single" "$dir/resumed" >&2; then
+  echo "check: a resumed sharded run disagrees with a single run" >&2
+  exit 1
+fi
+
+# Writes VALUE as N little-endian bytes, as the servers' host byte order
+# is on the machines this runs on.
+le() {
+  local n=$1 value=$2 i
+  for ((i = 0; i < n; i++)); do
+    printf "\\x$(printf %02x $((value & 255)))"
+    value=$((value >> 8))
+  done
+}
+
+# Prints the instructions, status and output size in the fork-server
+# response at byte OFFSET of FILE.
+fork_response() {
+  tail -c +$(($2 + 1)) "$1" | head -c 16 | od -A n -t u4 |
+    awk '{ print $1 + $2 * 4294967296, $3, $4 }'
+}
+
+# Fork server: a run to HALT, a run cut short by its limit, then a request
+# with reserved set, which is answered with an error before the server exits.
+{
+  le 8 0; le 4 0; le 4 0
+  le 8 50; le 4 0; le 4 0
+  le 8 0; le 4 0; le 4 1
+} > "$dir/fork.in"
+status=0
+"$lc3sim" -F "$dir/loop.obj" < "$dir/fork.in" > "$dir/fork.out" || status=$?
+if [ $status -ne 2 ] ||
+    [ "$(fork_response "$dir/fork.out" 0)" != "202 0 5" ] ||
+    [ "$(tail -c +17 "$dir/fork.out" | head -c 5)" != HALT ] ||
+    [ "$(fork_response "$dir/fork.out" 21 | cut -d' ' -f2-)" != "1 0" ] ||
+    [ "$(fork_response "$dir/fork.out" 37)" != "0 3 0" ] ||
+    [ "$(wc -c < "$dir/fork.out")" -ne 53 ]; then
+  echo "check: wrong fork-server responses" >&2
+  exit 1
+fi
+
+# LD R2, M; OUTER LD R1, N; INNER ADD R1, R1, #-1; BRp INNER;
+# ADD R2, R2, #-1; BRp OUTER; HALT; N .FILL 1000; M .FILL 100
+# That is 200302 instructions, so the trace has four chunks and the inner
+# loop's runs cross the chunk boundaries.
+image nested.obj 3000 2407 2205 127F 03FE 14BF 03FB F025 03E8 0064
+# LD R1, N; LOOP ADD R1, R1, #-1; BRz DONE; BR LOOP; DONE HALT; N .FILL 5
+# The loop never falls through its backward branch, so the trace ends with
+# the loop still running.
+image unfinished.obj 3000 2204 127F 0401 0FFD F025 0005
+
+# Fails unless the report on TRACE has each of the given lines, compared
+# with runs of spaces squeezed.
+expect() {
+  local trace=$1
+  shift
+  tr -s ' ' < "$dir/$trace.report" > "$dir/$trace.squeezed"
+  for line in "$@"; do
+    if ! grep -qxF -- "$line" "$dir/$trace.squeezed"; then
+      echo "check: the $trace trace report lacks '$line'" >&2
+      exit 1
+    fi
+  done
+}
+
+for program in nested unfinished; do
+  "$lc3sim" -T "$dir/$program.trace" "$dir/$program.obj" < /dev/null \
+    > /dev/null
+  "$lc3trace" "$dir/$program.trace" > "$dir/$program.report"
+  # decoding the chunks in parallel must not change the result
+  if ! "$lc3trace" -j 4 "$dir/$program.trace" |
+      diff -u "$dir/$program.report" - >&2; then
+    echo "check: lc3trace -j 4 disagrees on the $program trace" >&2
+    exit 1
+  fi
+done
+expect nested "200302 instructions" "BR 100100 49.97%" "ADD 100100 49.97%" \
+  "LD 101 0.05%" "TRAP 1 0.00%" " 100000 99.90% x3003" " 100 99.00% x3005" \
+  " 100 1000.0 1000 x3003" " 1 100.0 100 x3005" \
+  "reuse distances of 101 data accesses:" " 0 99 98.02%" \
+  " first use 2 1.98%"
+expect unfinished "16 instructions" " 1 5.0 5 x3003"
+
+echo "check: ok"
@@ -0,0 +1,125 @@
+#include "image_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iterator>
+#include <string_view>
+
+#include "simulator.h"  // for Simulator::InitializeMemory
+
+ImageCache::Image::~Image() {
+  if (words) {
+    munmap(const_cast<uint16_t *>(words), kMemoryBytes);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+std::shared_ptr<const ImageCache::Image> ImageCache::Get(
+    const std::vector<std::string> &images) {
+  std::vector<FileVersion> versions;
+  for (auto &image : images) {
+    struct stat info;
+    if (stat(image.c_str(), &info) < 0) {
+      return nullptr;
+    }
+    versions.push_back({info.st_dev, info.st_ino, info.st_size,
+                        info.st_mtim.tv_sec * 1000000000LL +
+                            info.st_mtim.tv_nsec});
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_name_.find(images);
+    if (it != by_name_.end() && it->second.versions == versions) {
+      it->second.used = ++clock_;
+      return it->second.image;
+    }
+  }
+  // read the files unlocked, so that other lookups need not wait for them;
+  // two threads missing on the same names both read them
+  std::vector<uint16_t> memory(kMemorySize);
+  Simulator::InitializeMemory(memory.data());
+  for (auto &image : images) {
+    if (!LoadImage(image, memory.data())) {
+      return nullptr;
+    }
+  }
+  size_t hash = std::hash<std::string_view>()(std::string_view(
+      reinterpret_cast<const char *>(memory.data()), kMemoryBytes));
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<const Image> image = Intern(memory, hash);
+  if (image) {
+    if (!by_name_.count(images) && by_name_.size() == kMaxNames) {
+      Evict();
+    }
+    by_name_[images] = {std::move(versions), image, ++clock_};
+  }
+  return image;
+}
+
+void ImageCache::Evict() {
+  auto oldest = by_name_.begin();
+  for (auto it = by_name_.begin(); it != by_name_.end(); ++it) {
+    if (it->second.used < oldest->second.used) {
+      oldest = it;
+    }
+  }
+  by_name_.erase(oldest);
+}
+
+std::shared_ptr<const ImageCache::Image> ImageCache::Intern(
+    const std::vector<uint16_t> &memory, size_t hash) {
+  auto [begin, end] = by_hash_.equal_range(hash);
+  for (auto it = begin; it != end; ++it) {
+    auto image = it->second.lock();
+    if (image &&
+        std::memcmp(image->words, memory.data(), kMemoryBytes) == 0) {
+      return image;
+    }
+  }
+
+  int fd = memfd_create("lc3-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return nullptr;
+  }
+  void *words = MAP_FAILED;
+  if (pwrite(fd, memory.data(), kMemoryBytes, 0) ==
+          static_cast<ssize_t>(kMemoryBytes) &&
+      fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0) {
+    words = mmap(nullptr, kMemoryBytes, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  if (words == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+  auto image = std::make_shared<Image>();
+  image->fd = fd;
+  image->words = static_cast<const uint16_t *>(words);
+  // runs of nonzero words; short gaps are copied rather than split on
+  constexpr size_t kMaxGap = 32;
+  size_t address = 0;
+  while (address < kMemorySize) {
+    if (!memory[address]) {
+      ++address;
+      continue;
+    }
+    size_t begin = address;
+    size_t end = address;
+    while (address < kMemorySize && address - end <= kMaxGap) {
+      if (memory[address++]) end = address;
+    }
+    image->segments.emplace_back(begin, end);
+  }
+  for (auto it = by_hash_.begin(); it != by_hash_.end();) {
+    it = it->second.expired() ? by_hash_.erase(it) : std::next(it);
+  }
+  by_hash_.emplace(hash, image);
+  return image;
+}
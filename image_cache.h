@@ -0,0 +1,85 @@
+#ifndef LC3_IMAGE_CACHE_H_
+#define LC3_IMAGE_CACHE_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Keeps initial memory images in sealed memfds, so that Simulators loading
+// the same images copy a ready-made memory (Simulator::CopyImage) or share
+// its pages copy-on-write (Simulator::MapImage) instead of each parsing the
+// files. Images are looked up by the list of file names, and then by a
+// hash of the resulting memory, so identical contents are stored once
+// whatever they are called. Each lookup stats the files, and a file whose
+// device, inode, size or modification time changed is read again. Only the
+// kMaxNames most recently used name lists are kept; an image lives while
+// a name list or a caller holds it. The fds can be inherited by or passed
+// to other processes, which then share the pages.
+class ImageCache {
+ public:
+  ImageCache() = default;
+
+  ImageCache(const ImageCache &) = delete;
+  ImageCache &operator=(ImageCache &) = delete;
+
+  // The memory that loading some images in order into a fresh Simulator
+  // produces, as a memfd and a read-only shared mapping of it. Everything
+  // outside the segments is zero, as in a fresh Simulator.
+  struct Image {
+    Image() = default;
+    ~Image();
+
+    Image(const Image &) = delete;
+    Image &operator=(Image &) = delete;
+
+    int fd = -1;
+    const uint16_t *words = nullptr;
+    std::vector<std::pair<uint32_t, uint32_t>> segments;  // [begin, end)
+  };
+
+  // Returns the image for the given files, or nullptr if one cannot be
+  // loaded. Thread-safe.
+  std::shared_ptr<const Image> Get(const std::vector<std::string> &images);
+
+ private:
+  static constexpr size_t kMaxNames = 256;
+
+  // What a file was when it was read.
+  struct FileVersion {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    int64_t mtime;  // nanoseconds
+
+    bool operator==(const FileVersion &other) const {
+      return device == other.device && inode == other.inode &&
+             size == other.size && mtime == other.mtime;
+    }
+  };
+
+  struct Named {
+    std::vector<FileVersion> versions;  // one per file name
+    std::shared_ptr<const Image> image;
+    uint64_t used;  // clock_ at the last lookup
+  };
+
+  // Returns the stored image equal to memory, whose hash is given, storing
+  // it first if there is none. Called with mutex_ held.
+  std::shared_ptr<const Image> Intern(const std::vector<uint16_t> &memory,
+                                      size_t hash);
+  void Evict();
+
+  std::mutex mutex_;
+  uint64_t clock_ = 0;
+  std::map<std::vector<std::string>, Named> by_name_;
+  std::unordered_multimap<size_t, std::weak_ptr<const Image>> by_hash_;
+};
+
+#endif  // LC3_IMAGE_CACHE_H_
@@ -0,0 +1,199 @@
+#ifndef LC3_ISA_H_
+#define LC3_ISA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+enum Register {
+  kR0 = 0,
+  kR1,
+  kR2,
+  kR3,
+  kR4,
+  kR5,
+  kR6,
+  kR7,
+  kPC,  // program counter
+  kCOND,
+  kRegisterCount
+};
+
+enum OpCode {
+  kBR = 0,  // branch
+  kADD,     // add
+  kLD,      // load
+  kST,      // store
+  kJSR,     // jump register
+  kAND,     // bitwise and
+  kLDR,     // load register
+  kSTR,     // store register
+  kRTI,     // return from interrupt
+  kNOT,     // bitwise not
+  kLDI,     // load indirect
+  kSTI,     // store indirect
+  kJMP,     // jump
+  kRES,     // reserved (unused)
+  kLEA,     // load effective address
+  kTRAP     // execute trap
+};
+
+enum Flag {
+  kPositive = 1 << 0,  // P
+  kZero = 1 << 1,      // Z
+  kNegative = 1 << 2,  // N
+};
+
+enum MMIO {
+  kMMIOBase = 0xFE00,  // device registers live at and above this address
+  kKBSR = 0xFE00,      // keyboard status
+  kKBDR = 0xFE02,      // keyboard data
+  kDSR = 0xFE04,       // display status
+  kDDR = 0xFE06,       // display data
+  kDKSR = 0xFE10,      // disk status
+  kDKCR = 0xFE12,      // disk command; writing starts a transfer
+  kDKBR = 0xFE14,      // disk block number
+  kDKAR = 0xFE16,      // disk transfer memory address
+  kMCR = 0xFFFE        // machine control
+};
+
+enum DeviceStatus {
+  kReady = 1 << 15,            // KBSR: a character is waiting in KBDR;
+                               // DSR: the display accepts a character
+  kInterruptEnable = 1 << 14,  // KBSR: raise an interrupt when ready
+  kDone = 1 << 13,             // DKSR: a transfer finished since last read
+  kError = 1 << 0,             // DKSR: the last transfer failed
+  kClockEnable = 1 << 15       // MCR: clearing this bit halts the machine
+};
+
+enum DiskCommand { kDiskRead = 1, kDiskWrite = 2 };
+
+enum ProcessorStatus {
+  kUserMode = 1 << 15,     // PSR[15]: 0 = supervisor, 1 = user
+  kPriorityShift = 8,      // PSR[10:8]: priority level
+  kPriorityMask = 0x0700
+};
+
+enum InterruptVector {
+  kTrapTable = 0x0000,       // x0000-x00FF: trap vector table
+  kInterruptTable = 0x0100,  // x0100-x01FF: interrupt vector table
+  kPrivilegeViolation = 0x00,
+  kIllegalOpcode = 0x01,
+  kKeyboardInterrupt = 0x80,
+  kDiskInterrupt = 0x81
+};
+
+constexpr uint16_t kKeyboardPriority = 4;
+constexpr uint16_t kDiskPriority = 5;
+
+enum TrapCode {
+  kGETC = 0x20,   // get character from keyboard, not echoed onto the terminal
+  kOUT = 0x21,    // output a character
+  kPUTS = 0x22,   // output a word string
+  kIN = 0x23,     // get character from keyboard, echoed onto the terminal
+  kPUTSP = 0x24,  // output a byte string
+  kHALT = 0x25,   // halt the program
+
+  // Host-accelerated block operations over guest memory. R0 is the
+  // destination, R1 the source (or fill value for MEMSET) and R2 the length
+  // in words; ranges wrap around the address space like word-by-word loops.
+  kMEMCPY = 0x30,   // copy R2 words from R1 to R0; overlap acts as MEMMOVE
+  kMEMMOVE = 0x31,  // copy R2 words from R1 to R0, allowing overlap
+  kMEMSET = 0x32,   // store R1 into R2 words starting at R0
+  kMEMCMP = 0x33,   // compare R2 words at R0 and R1; R0 and NZP are set to
+                    // -1, 0 or 1 by the first differing unsigned word
+
+  // Host file access below the sandbox directory. Files hold big-endian
+  // words, like images. Each call returns its result in R0 and sets NZP;
+  // -1 means failure. A read or write moves at most x7FFF words.
+  kFOPEN = 0x34,   // open the word string path at R0 with mode R1
+                   // (0 read, 1 write/create/truncate, 2 read/write);
+                   // returns a handle
+  kFCLOSE = 0x35,  // close handle R0
+  kFREAD = 0x36,   // read up to R2 words from handle R0 into memory at R1;
+                   // returns the number of words read, 0 at end of file
+  kFWRITE = 0x37,  // write R2 words at R1 to handle R0; returns words written
+  kFSEEK = 0x38    // move handle R0 to word offset R1:R2 (high:low)
+};
+
+enum FileMode { kFileRead = 0, kFileWrite = 1, kFileReadWrite = 2 };
+
+inline uint16_t SignExtend(uint16_t x, int bitCount) {
+  if ((x >> (bitCount - 1)) & 1) {
+    x |= (0xFFFF << bitCount);
+  }
+  return x;
+}
+
+// Instruction fields, shared by the interpreters and the trace tools so that
+// they always decode alike.
+inline uint16_t RegisterField(uint16_t instr) {  // DR or SR; nzp for BR
+  return (instr >> 9) & 0x7;
+}
+inline uint16_t BaseField(uint16_t instr) {  // SR1 or BaseR
+  return (instr >> 6) & 0x7;
+}
+inline uint16_t SourceField(uint16_t instr) { return instr & 0x7; }  // SR2
+inline bool ImmediateFlag(uint16_t instr) { return (instr >> 5) & 0x1; }
+inline bool LongFlag(uint16_t instr) { return (instr >> 11) & 0x1; }  // JSR
+inline uint16_t Immediate5(uint16_t instr) {
+  return SignExtend(instr & 0x1F, 5);
+}
+inline uint16_t Offset6(uint16_t instr) { return SignExtend(instr & 0x3F, 6); }
+inline uint16_t PCOffset9(uint16_t instr) {
+  return SignExtend(instr & 0x1FF, 9);
+}
+inline uint16_t PCOffset11(uint16_t instr) {
+  return SignExtend(instr & 0x7FF, 11);
+}
+inline uint8_t TrapVector(uint16_t instr) { return instr & 0xFF; }
+
+// Whether instr transfers control, which ends a block in the interpreters;
+// kRES does too, as it raises an exception.
+inline bool EndsBlock(uint16_t instr) {
+  switch (instr >> 12) {
+    case kBR:
+    case kJMP:
+    case kJSR:
+    case kTRAP:
+    case kRTI:
+    case kRES:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline const char *OpCodeName(uint16_t op) {
+  static constexpr const char *kNames[] = {
+      "BR",  "ADD", "LD",  "ST",  "JSR", "AND", "LDR", "STR",
+      "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+  return kNames[op & 0xF];
+}
+
+inline uint16_t Swap16(uint16_t x) { return (x << 8) | (x >> 8); }
+
+inline void CloseFile(std::FILE *fp) { std::fclose(fp); };
+
+constexpr size_t kMemorySize = 1 << 16;
+constexpr size_t kMemoryBytes = kMemorySize * sizeof(uint16_t);
+constexpr uint16_t kPCStart = 0x3000;
+constexpr uint16_t kSSPStart = 0x3000;  // supervisor stack grows down from here
+
+// The number of words before the zero that ends the string at address,
+// wrapping past xFFFF, or kMemorySize if memory holds no zero word.
+inline size_t StringLength(const uint16_t *memory, uint16_t address) {
+  size_t length = 0;
+  while (length < kMemorySize &&
+         memory[static_cast<uint16_t>(address + length)]) {
+    ++length;
+  }
+  return length;
+}
+
+// Loads an image file (a big-endian origin followed by big-endian words)
+// into a 64K-word memory.
+bool LoadImage(const std::string &filename, uint16_t *memory);
+
+#endif  // LC3_ISA_H_
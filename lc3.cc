@@ -0,0 +1,123 @@
+#include "lc3.h"
+
+#include <chrono>
+#include <new>
+
+#include "simulator.h"
+
+static_assert(LC3_WOULD_BLOCK == kConsoleWouldBlock,
+              "console protocols must agree");
+
+struct lc3_vm {
+  Simulator sim;
+  lc3_io io;
+};
+
+extern "C" {
+
+lc3_vm *lc3_create(void) {
+  // the Simulator allocates its memory too; no exception may leave here
+  try {
+    return new lc3_vm();
+  } catch (const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void lc3_destroy(lc3_vm *vm) { delete vm; }
+
+int lc3_load_image(lc3_vm *vm, const char *filename) {
+  return vm->sim.ReadImage(filename) ? 0 : -1;
+}
+
+void lc3_set_io(lc3_vm *vm, const lc3_io *io) {
+  Console none = NullConsole();
+  if (!io) {
+    vm->sim.SetConsole(none);
+    return;
+  }
+  vm->io = *io;
+  auto read = [](void *context) {
+    const lc3_io &io = static_cast<lc3_vm *>(context)->io;
+    return io.read(io.context);
+  };
+  auto ready = [](void *context) {
+    const lc3_io &io = static_cast<lc3_vm *>(context)->io;
+    return io.ready(io.context) != 0;
+  };
+  auto write = [](void *context, const char *data, size_t size) {
+    const lc3_io &io = static_cast<lc3_vm *>(context)->io;
+    io.write(io.context, data, size);
+  };
+  // missing callbacks act as the null console's, which ignore context
+  vm->sim.SetConsole({io->read ? +read : none.read,
+                      io->ready ? +ready : none.ready,
+                      io->write ? +write : none.write, vm});
+}
+
+static lc3_status ToStatus(StopReason reason) {
+  switch (reason) {
+    case StopReason::kHalted:
+      return LC3_HALTED;
+    case StopReason::kBudgetExhausted:
+      return LC3_BUDGET_EXHAUSTED;
+    case StopReason::kWaitingForInput:
+      return LC3_WAITING_FOR_INPUT;
+    case StopReason::kStopRequested:
+      return LC3_STOPPED;
+    case StopReason::kFault:
+      break;
+  }
+  return LC3_FAULT;
+}
+
+lc3_status lc3_step(lc3_vm *vm) {
+  if (vm->sim.Step()) {
+    return LC3_RUNNING;
+  }
+  return ToStatus(vm->sim.stop_reason());
+}
+
+lc3_status lc3_run(lc3_vm *vm, uint64_t max_instructions) {
+  return ToStatus(vm->sim.Run(max_instructions));
+}
+
+lc3_status lc3_run_for(lc3_vm *vm, uint64_t max_instructions,
+                       uint64_t nanoseconds) {
+  using Clock = std::chrono::steady_clock;
+  auto deadline = nanoseconds > INT64_MAX / 2
+                      ? Clock::time_point::max()
+                      : Clock::now() + std::chrono::nanoseconds(nanoseconds);
+  return ToStatus(vm->sim.RunUntil(deadline, max_instructions));
+}
+
+void lc3_request_stop(lc3_vm *vm) { vm->sim.RequestStop(); }
+
+uint16_t lc3_get_register(const lc3_vm *vm, int reg) {
+  if (reg < 0 || reg >= kRegisterCount) {
+    return 0;
+  }
+  return vm->sim.ReadRegister(reg);
+}
+
+void lc3_set_register(lc3_vm *vm, int reg, uint16_t value) {
+  if (reg >= 0 && reg < kRegisterCount) {
+    vm->sim.WriteRegister(reg, value);
+  }
+}
+
+uint16_t lc3_read_memory(const lc3_vm *vm, uint16_t address) {
+  return vm->sim.PeekMemory(address);
+}
+
+void lc3_write_memory(lc3_vm *vm, uint16_t address, uint16_t value) {
+  vm->sim.PokeMemory(address, value);
+}
+
+uint64_t lc3_instructions(const lc3_vm *vm) {
+  return vm->sim.instructions();
+}
+
+const char *lc3_error(const lc3_vm *vm) { return vm->sim.error().c_str(); }
+
+}  // extern "C"
@@ -0,0 +1,85 @@
+/* C interface to the LC-3 simulator. Each lc3_vm is independent; separate
+ * machines may be used from separate threads without locking. */
+#ifndef LC3_H_
+#define LC3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lc3_vm lc3_vm;
+
+typedef enum lc3_status {
+  LC3_RUNNING = 0,          /* lc3_step only: the machine can continue */
+  LC3_HALTED = 1,           /* HALT, or MCR's clock bit was cleared */
+  LC3_BUDGET_EXHAUSTED = 2, /* the instruction or time budget ran out */
+  LC3_STOPPED = 3,          /* lc3_request_stop was called */
+  LC3_FAULT = 4,            /* the machine cannot continue; see lc3_error */
+  LC3_WAITING_FOR_INPUT = 5 /* GETC, IN or a KBSR read got LC3_WOULD_BLOCK;
+                               run again once input is available */
+} lc3_status;
+
+#define LC3_WOULD_BLOCK (-2)
+
+/* Console callbacks. read returns the next input byte, or -1 at end of
+ * input; it may block, or return LC3_WOULD_BLOCK. ready returns nonzero if
+ * read would return at once; if read never blocks, it may always do so.
+ * Each is passed context. */
+typedef struct lc3_io {
+  int (*read)(void *context);
+  int (*ready)(void *context);
+  void (*write)(void *context, const char *data, size_t size);
+  void *context;
+} lc3_io;
+
+/* Returns a machine with PC at x3000 and no console (input is at end, output
+ * is discarded), or NULL if out of memory. */
+lc3_vm *lc3_create(void);
+void lc3_destroy(lc3_vm *vm);
+
+/* Loads an image file: a big-endian origin followed by big-endian words.
+ * Returns 0 on success and -1 on failure. */
+int lc3_load_image(lc3_vm *vm, const char *filename);
+
+/* io is copied; io->context must outlive its use by vm. A NULL io restores
+ * the machine's initial console. A NULL read acts as end of input, a NULL
+ * ready as always ready and a NULL write discards the output. */
+void lc3_set_io(lc3_vm *vm, const lc3_io *io);
+
+lc3_status lc3_step(lc3_vm *vm);
+
+/* Runs until the machine stops or about max_instructions more instructions
+ * have retired (UINT64_MAX for no limit). */
+lc3_status lc3_run(lc3_vm *vm, uint64_t max_instructions);
+
+/* Like lc3_run, but also returns LC3_BUDGET_EXHAUSTED after about
+ * nanoseconds of host time. Resuming later continues where it stopped, so
+ * a host thread can time-slice many machines. */
+lc3_status lc3_run_for(lc3_vm *vm, uint64_t max_instructions,
+                       uint64_t nanoseconds);
+
+/* Makes lc3_run return LC3_STOPPED soon. Safe to call from another thread
+ * or a signal handler. */
+void lc3_request_stop(lc3_vm *vm);
+
+/* Registers are numbered R0-R7, then PC (8) and the condition codes (9). */
+uint16_t lc3_get_register(const lc3_vm *vm, int reg);
+void lc3_set_register(lc3_vm *vm, int reg, uint16_t value);
+
+/* Raw memory access; device registers are not triggered. */
+uint16_t lc3_read_memory(const lc3_vm *vm, uint16_t address);
+void lc3_write_memory(lc3_vm *vm, uint16_t address, uint16_t value);
+
+uint64_t lc3_instructions(const lc3_vm *vm);
+
+/* The reason for the last LC3_FAULT, or "" if none. */
+const char *lc3_error(const lc3_vm *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LC3_H_ */
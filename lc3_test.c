@@ -0,0 +1,115 @@
+/* Uses the C interface from C: creates machines, loads an image, runs,
+ * steps, and reads a fault message. Run by "make check". */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lc3.h"
+
+static int failures = 0;
+
+static void expect(int ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "lc3_test: %s\n", what);
+    ++failures;
+  }
+}
+
+struct output {
+  char data[64];
+  size_t size;
+};
+
+static void collect(void *context, const char *data, size_t size) {
+  struct output *out = context;
+  if (size > sizeof(out->data) - out->size) {
+    size = sizeof(out->data) - out->size;
+  }
+  memcpy(out->data + out->size, data, size);
+  out->size += size;
+}
+
+/* LEA R0, MSG; PUTS; HALT; MSG "hi" */
+static const unsigned char kImage[] = {0x30, 0x00, 0xE0, 0x02, 0xF0, 0x22,
+                                       0xF0, 0x25, 0x00, 0x68, 0x00, 0x69,
+                                       0x00, 0x00};
+
+static void check_run(const char *image) {
+  lc3_vm *vm = lc3_create();
+  expect(vm != NULL, "cannot create a machine");
+  if (!vm) {
+    return;
+  }
+  expect(lc3_load_image(vm, "/nonexistent/image.obj") == -1,
+         "loaded a missing image");
+  expect(lc3_load_image(vm, image) == 0, "cannot load the image");
+  expect(lc3_read_memory(vm, 0x3003) == 'h', "image not at its origin");
+
+  struct output out = {{0}, 0};
+  lc3_io io = {NULL, NULL, collect, &out};
+  lc3_set_io(vm, &io);
+  expect(lc3_step(vm) == LC3_RUNNING, "step did not continue");
+  expect(lc3_get_register(vm, 0) == 0x3003 && lc3_get_register(vm, 8) == 0x3001,
+         "step did not run LEA");
+  expect(lc3_run(vm, UINT64_MAX) == LC3_HALTED, "run did not halt");
+  expect(out.size == 7 && memcmp(out.data, "hiHALT\n", 7) == 0,
+         "wrong output");
+  expect(lc3_instructions(vm) == 3, "wrong instruction count");
+  expect(strcmp(lc3_error(vm), "") == 0, "error set without a fault");
+
+  /* the null console again: output is discarded */
+  lc3_set_io(vm, NULL);
+  lc3_set_register(vm, 8, 0x3000);
+  expect(lc3_run(vm, UINT64_MAX) == LC3_HALTED, "rerun did not halt");
+  expect(out.size == 7, "output written after the console was reset");
+  lc3_destroy(vm);
+}
+
+static void check_fault(void) {
+  lc3_vm *vm = lc3_create();
+  if (!vm) {
+    return;
+  }
+  /* GETC with no read callback sees end of input */
+  lc3_io io = {NULL, NULL, NULL, NULL};
+  lc3_set_io(vm, &io);
+  lc3_write_memory(vm, 0x3000, 0xF020);
+  lc3_set_register(vm, 0, 0);
+  expect(lc3_step(vm) == LC3_RUNNING, "GETC did not continue");
+  expect(lc3_get_register(vm, 0) == 0xFFFF, "GETC did not read EOF");
+
+  /* the reserved opcode with no handler in the vector table */
+  lc3_write_memory(vm, 0x3001, 0xD000);
+  expect(lc3_run(vm, 100) == LC3_FAULT, "reserved opcode did not fault");
+  expect(strlen(lc3_error(vm)) > 0, "no fault message");
+  expect(lc3_step(vm) == LC3_FAULT, "stepped past a fault");
+  lc3_destroy(vm);
+}
+
+int main(void) {
+  char image[] = "/tmp/lc3-test-XXXXXX";
+  int fd = mkstemp(image);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 2;
+  }
+  if (write(fd, kImage, sizeof(kImage)) != (ssize_t)sizeof(kImage)) {
+    perror("write");
+    return 2;
+  }
+  close(fd);
+
+  check_run(image);
+  check_fault();
+
+  unlink(image);
+  if (failures) {
+    return 1;
+  }
+  printf("lc3_test: ok\n");
+  return 0;
+}
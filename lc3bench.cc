@@ -0,0 +1,766 @@
+// Runs a fixed corpus of LC-3 workloads on each engine and reports their
+// speed as JSON, optionally against a stored baseline. With --micro, it
+// instead times single instruction forms in the interpreter.
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "isa.h"
+#include "lockstep.h"
+#include "observer.h"
+#include "simulator.h"
+
+namespace {
+
+void ShowUsage(const std::string &program) {
+  std::cerr << "usage: " << program << " [option] ...\n"
+            << "Options and arguments:\n"
+            << "\t-s, --scale N\t\tMake every workload N (up to 32) times "
+               "longer\n"
+            << "\t-r, --repeat N\t\tTime each benchmark N times and keep "
+               "the best\n"
+            << "\t-b, --baseline FILE\tCompare with the results in FILE\n"
+            << "\t-t, --tolerance PCT\tAllow PCT percent slowdown against "
+               "the baseline\n"
+            << "\t-m, --micro\t\tReport cycles per operation for each "
+               "instruction form\n"
+            << "\t-h, --help\t\tShow this help message" << std::endl;
+}
+
+// Just enough of an assembler to write the corpus. Branch, PC-relative and
+// .FILL operands may name labels defined before or after them.
+class Assembler {
+ public:
+  void Label(const std::string &name) { labels_[name] = kPCStart + size(); }
+
+  void Add(int dr, int sr1, int sr2) { Operate(kADD, dr, sr1, sr2); }
+  void AddImm(int dr, int sr1, int imm5) { OperateImm(kADD, dr, sr1, imm5); }
+  void And(int dr, int sr1, int sr2) { Operate(kAND, dr, sr1, sr2); }
+  void AndImm(int dr, int sr1, int imm5) { OperateImm(kAND, dr, sr1, imm5); }
+  void Not(int dr, int sr) { Emit(kNOT << 12 | dr << 9 | sr << 6 | 0x3F); }
+
+  void Br(int nzp, const std::string &label) {
+    Relative(kBR << 12 | nzp << 9, label, 9);
+  }
+  void Jsr(const std::string &label) {
+    Relative(kJSR << 12 | 1 << 11, label, 11);
+  }
+  void Jsrr(int base) { Emit(kJSR << 12 | base << 6); }
+  void Ret() { Emit(kJMP << 12 | kR7 << 6); }
+
+  void Ld(int dr, const std::string &label) { Relative(kLD, dr, label); }
+  void Ldi(int dr, const std::string &label) { Relative(kLDI, dr, label); }
+  void Lea(int dr, const std::string &label) { Relative(kLEA, dr, label); }
+  void St(int sr, const std::string &label) { Relative(kST, sr, label); }
+  void Sti(int sr, const std::string &label) { Relative(kSTI, sr, label); }
+  void Ldr(int dr, int base, int offset6) {
+    Emit(kLDR << 12 | dr << 9 | base << 6 | (offset6 & 0x3F));
+  }
+  void Str(int sr, int base, int offset6) {
+    Emit(kSTR << 12 | sr << 9 | base << 6 | (offset6 & 0x3F));
+  }
+  void Trap(uint8_t vector) { Emit(kTRAP << 12 | vector); }
+
+  void Fill(uint16_t value) { Emit(value); }
+  void Fill(const std::string &label) {
+    fixups_.push_back({size(), label, 16});
+    Emit(0);
+  }
+  void Stringz(const std::string &text) {
+    for (char c : text) {
+      Emit(static_cast<uint8_t>(c));
+    }
+    Emit(0);
+  }
+
+  // Writes an image file: the origin, then the words, big-endian.
+  bool Write(const std::string &filename) {
+    for (auto &fixup : fixups_) {
+      auto it = labels_.find(fixup.label);
+      if (it == labels_.end()) {
+        return false;
+      }
+      uint16_t &word = words_[fixup.index];
+      if (fixup.bits == 16) {
+        word = it->second;
+      } else {
+        uint16_t offset = it->second - (kPCStart + fixup.index + 1);
+        word |= offset & ((1 << fixup.bits) - 1);
+      }
+    }
+    std::vector<uint16_t> file = {Swap16(kPCStart)};
+    for (uint16_t word : words_) {
+      file.push_back(Swap16(word));
+    }
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(file.data()),
+              file.size() * sizeof(uint16_t));
+    return static_cast<bool>(out);
+  }
+
+ private:
+  struct Fixup {
+    size_t index;
+    std::string label;
+    int bits;  // of the offset field, or 16 for an address
+  };
+
+  size_t size() const { return words_.size(); }
+  void Emit(uint16_t word) { words_.push_back(word); }
+
+  void Operate(int op, int dr, int sr1, int sr2) {
+    Emit(op << 12 | dr << 9 | sr1 << 6 | sr2);
+  }
+  void OperateImm(int op, int dr, int sr1, int imm5) {
+    Emit(op << 12 | dr << 9 | sr1 << 6 | 0x20 | (imm5 & 0x1F));
+  }
+
+  void Relative(int op, int r, const std::string &label) {
+    Relative(op << 12 | r << 9, label, 9);
+  }
+  void Relative(uint16_t word, const std::string &label, int bits) {
+    fixups_.push_back({size(), label, bits});
+    Emit(word);
+  }
+
+  std::vector<uint16_t> words_;
+  std::map<std::string, uint16_t> labels_;
+  std::vector<Fixup> fixups_;
+};
+
+constexpr int kN = 4, kZ = 2, kP = 1;
+
+// Loop counts are positive 16-bit words, which bounds the scale.
+constexpr int kMaxScale = 32;
+
+struct Workload {
+  const char *name;
+  const char *description;
+  // writes the program for the given scale and returns its input
+  std::function<std::string(Assembler &, int scale)> build;
+};
+
+const std::vector<Workload> &Corpus() {
+  static const std::vector<Workload> corpus = {
+      {"alu", "nested register arithmetic loops",
+       [](Assembler &a, int scale) {
+         a.Ld(kR1, "outer");
+         a.Label("OUTER");
+         a.Ld(kR2, "inner");
+         a.Label("INNER");
+         a.Add(kR3, kR3, kR2);
+         a.AndImm(kR4, kR3, 15);
+         a.Not(kR5, kR4);
+         a.AddImm(kR6, kR5, 1);
+         a.AddImm(kR2, kR2, -1);
+         a.Br(kP, "INNER");
+         a.AddImm(kR1, kR1, -1);
+         a.Br(kP, "OUTER");
+         a.Trap(kHALT);
+         a.Label("outer");
+         a.Fill(800 * scale);
+         a.Label("inner");
+         a.Fill(1000);
+         return std::string();
+       }},
+      {"copy", "word-by-word copies between two 8K-word buffers",
+       [](Assembler &a, int scale) {
+         a.Ld(kR1, "reps");
+         a.Label("AGAIN");
+         a.Ld(kR2, "source");
+         a.Ld(kR3, "destination");
+         a.Ld(kR4, "words");
+         a.Label("LOOP");
+         a.Ldr(kR5, kR2, 0);
+         a.Str(kR5, kR3, 0);
+         a.AddImm(kR2, kR2, 1);
+         a.AddImm(kR3, kR3, 1);
+         a.AddImm(kR4, kR4, -1);
+         a.Br(kP, "LOOP");
+         a.AddImm(kR1, kR1, -1);
+         a.Br(kP, "AGAIN");
+         a.Trap(kHALT);
+         a.Label("reps");
+         a.Fill(100 * scale);
+         a.Label("source");
+         a.Fill(0x4000);
+         a.Label("destination");
+         a.Fill(0x6000);
+         a.Label("words");
+         a.Fill(0x2000);
+         return std::string();
+       }},
+      {"recursive", "recursive Fibonacci through JSR and a memory stack",
+       [](Assembler &a, int scale) {
+         a.Ld(kR6, "stack");
+         a.Ld(kR1, "reps");
+         a.Label("AGAIN");
+         a.AndImm(kR0, kR0, 0);
+         a.AddImm(kR0, kR0, 15);
+         a.AddImm(kR0, kR0, 5);
+         a.Jsr("FIB");
+         a.AddImm(kR1, kR1, -1);
+         a.Br(kP, "AGAIN");
+         a.Trap(kHALT);
+         a.Label("stack");
+         a.Fill(0xF000);
+         a.Label("reps");
+         a.Fill(16 * scale);
+         // R0 = fib(R0), saving R7, R1 and R2 on the stack at R6
+         a.Label("FIB");
+         a.AddImm(kR6, kR6, -3);
+         a.Str(kR7, kR6, 0);
+         a.Str(kR1, kR6, 1);
+         a.Str(kR2, kR6, 2);
+         a.AddImm(kR1, kR0, -2);
+         a.Br(kN, "BASE");
+         a.AddImm(kR1, kR0, 0);
+         a.AddImm(kR0, kR1, -1);
+         a.Jsr("FIB");
+         a.AddImm(kR2, kR0, 0);
+         a.AddImm(kR0, kR1, -2);
+         a.Jsr("FIB");
+         a.Add(kR0, kR0, kR2);
+         a.Label("BASE");
+         a.Ldr(kR7, kR6, 0);
+         a.Ldr(kR1, kR6, 1);
+         a.Ldr(kR2, kR6, 2);
+         a.AddImm(kR6, kR6, 3);
+         a.Ret();
+         return std::string();
+       }},
+      {"output", "OUT and PUTS in a loop",
+       [](Assembler &a, int scale) {
+         a.Ld(kR6, "outer");
+         a.Label("OUTER");
+         a.Ld(kR1, "inner");
+         a.Label("LOOP");
+         a.Ld(kR0, "star");
+         a.Trap(kOUT);
+         a.Lea(kR0, "message");
+         a.Trap(kPUTS);
+         a.AddImm(kR1, kR1, -1);
+         a.Br(kP, "LOOP");
+         a.AddImm(kR6, kR6, -1);
+         a.Br(kP, "OUTER");
+         a.Trap(kHALT);
+         a.Label("outer");
+         a.Fill(10 * scale);
+         a.Label("inner");
+         a.Fill(10000);
+         a.Label("star");
+         a.Fill('*');
+         a.Label("message");
+         a.Stringz("benchmark\n");
+         return std::string();
+       }},
+      {"kbsr", "polls KBSR and sums scripted input until a 'q'",
+       [](Assembler &a, int scale) {
+         a.Ld(kR2, "quit");
+         a.Label("POLL");
+         a.Ldi(kR1, "kbsr");
+         a.Br(kZ | kP, "POLL");
+         a.Ldi(kR0, "kbdr");
+         a.Add(kR1, kR0, kR2);
+         a.Br(kZ, "DONE");
+         a.Add(kR3, kR3, kR0);
+         a.Br(kN | kZ | kP, "POLL");
+         a.Label("DONE");
+         a.Trap(kHALT);
+         a.Label("quit");
+         a.Fill(-'q');
+         a.Label("kbsr");
+         a.Fill(kKBSR);
+         a.Label("kbdr");
+         a.Fill(kKBDR);
+         return std::string(500000 * scale, 'a') + "q";
+       }},
+      {"smc", "rewrites an instruction in its own loop body",
+       [](Assembler &a, int scale) {
+         a.Ld(kR6, "outer");
+         a.Label("OUTER");
+         a.Ld(kR1, "inner");
+         a.Label("LOOP");
+         a.Ld(kR2, "template");
+         a.AndImm(kR4, kR1, 15);
+         a.Add(kR2, kR2, kR4);
+         a.St(kR2, "PATCHED");
+         a.Label("PATCHED");
+         a.AddImm(kR3, kR3, 0);
+         a.AddImm(kR1, kR1, -1);
+         a.Br(kP, "LOOP");
+         a.AddImm(kR6, kR6, -1);
+         a.Br(kP, "OUTER");
+         a.Trap(kHALT);
+         a.Label("outer");
+         a.Fill(70 * scale);
+         a.Label("inner");
+         a.Fill(10000);
+         a.Label("template");
+         a.Fill(kADD << 12 | kR3 << 9 | kR3 << 6 | 0x20);
+         return std::string();
+       }},
+  };
+  return corpus;
+}
+
+struct Engine {
+  const char *name;
+  // runs the image with input once; returns false unless it halted
+  std::function<bool(const std::string &image, const std::string &input,
+                     uint64_t *instructions)>
+      run;
+};
+
+constexpr int kLockstepLanes = 16;
+
+const std::vector<Engine> &Engines() {
+  static const std::vector<Engine> engines = {
+      {"interpreter",
+       [](const std::string &image, const std::string &input,
+          uint64_t *instructions) {
+         Simulator sim;
+         StringConsole console(input);
+         sim.SetConsole(console.console());
+         bool halted = sim.ReadImage(image) &&
+                       sim.Run() == StopReason::kHalted;
+         *instructions = sim.instructions();
+         return halted;
+       }},
+      {"counters",
+       [](const std::string &image, const std::string &input,
+          uint64_t *instructions) {
+         Simulator sim;
+         StringConsole console(input);
+         sim.SetConsole(console.console());
+         InstructionCounters counters;
+         bool halted = sim.ReadImage(image) &&
+                       sim.Run(UINT64_MAX, counters) == StopReason::kHalted;
+         *instructions = sim.instructions();
+         return halted;
+       }},
+      {"lockstep",
+       [](const std::string &image, const std::string &input,
+          uint64_t *instructions) {
+         LockstepEngine engine(kLockstepLanes);
+         if (!engine.ReadImage(image)) {
+           return false;
+         }
+         for (int lane = 0; lane < kLockstepLanes; ++lane) {
+           engine.SetInput(lane, input);
+         }
+         engine.Run();
+         *instructions = 0;
+         bool halted = true;
+         for (int lane = 0; lane < kLockstepLanes; ++lane) {
+           *instructions += engine.instructions(lane);
+           halted = halted && engine.status(lane) ==
+                                  LockstepEngine::LaneStatus::kHalted;
+         }
+         return halted;
+       }},
+  };
+  return engines;
+}
+
+struct Measurement {
+  bool ok;
+  uint64_t instructions;
+  double seconds;  // of CPU time, in the best run
+  long peak_rss_kb;
+};
+
+// CPU time rather than wall time, so that other load on the host (or, on a
+// virtual machine, stolen time) disturbs the results less.
+double CpuSeconds() {
+  timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Runs the benchmark repeat times in a child process, so that its peak
+// RSS is its own.
+Measurement Measure(const Engine &engine, const std::string &image,
+                    const std::string &input, int repeat) {
+  Measurement result = {false, 0, 0, 0};
+  int fds[2];
+  if (pipe(fds) < 0) {
+    return result;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    result.ok = true;
+    for (int i = 0; i < repeat && result.ok; ++i) {
+      double start = CpuSeconds();
+      result.ok = engine.run(image, input, &result.instructions);
+      double elapsed = CpuSeconds() - start;
+      if (i == 0 || elapsed < result.seconds) {
+        result.seconds = elapsed;
+      }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result.peak_rss_kb = usage.ru_maxrss;
+    bool written = write(fds[1], &result, sizeof(result)) == sizeof(result);
+    _exit(written ? 0 : 1);
+  }
+  close(fds[1]);
+  if (pid > 0 && read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+    result.ok = false;
+  }
+  close(fds[0]);
+  if (pid > 0) {
+    waitpid(pid, nullptr, 0);
+  }
+  return result;
+}
+
+// Reads the value of "key": in a line of our own JSON output.
+bool Field(const std::string &line, const std::string &key,
+           std::string *value) {
+  std::string quoted = "\"" + key + "\": ";
+  size_t start = line.find(quoted);
+  if (start == std::string::npos) {
+    return false;
+  }
+  start += quoted.size();
+  size_t end = line.find_first_of(",}", start);
+  *value = line.substr(start, end - start);
+  value->erase(std::remove(value->begin(), value->end(), '"'), value->end());
+  return true;
+}
+
+// ns per instruction by workload and engine, from a file this program wrote.
+bool ReadBaseline(const std::string &filename,
+                  std::map<std::pair<std::string, std::string>, double> *ns) {
+  std::ifstream file(filename);
+  if (!file) {
+    return false;
+  }
+  std::string line, workload, engine, value;
+  while (std::getline(file, line)) {
+    if (Field(line, "workload", &workload) &&
+        Field(line, "engine", &engine) &&
+        Field(line, "ns_per_instruction", &value)) {
+      (*ns)[{workload, engine}] = std::atof(value.c_str());
+    }
+  }
+  return true;
+}
+
+// Counts the calling thread's CPU cycles with a perf event if the kernel
+// allows it, or else reads the time stamp counter, or else the clock.
+class CycleCounter {
+ public:
+  CycleCounter() {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~CycleCounter() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  CycleCounter(const CycleCounter &) = delete;
+  CycleCounter &operator=(CycleCounter &) = delete;
+
+  const char *unit() const {
+    if (fd_ >= 0) {
+      return "cycles";
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return "tsc";
+#else
+    return "ns";
+#endif
+  }
+
+  uint64_t Read() const {
+    uint64_t value;
+    if (fd_ >= 0 && read(fd_, &value, sizeof(value)) == sizeof(value)) {
+      return value;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000000000) + now.tv_nsec;
+#endif
+  }
+
+ private:
+  int fd_;
+};
+
+// One form of an instruction, or a short sequence, to time on its own.
+struct Micro {
+  const char *name;
+  const char *instruction;
+  // emits the copy'th of the unrolled copies in the loop
+  std::function<void(Assembler &, int copy)> emit;
+};
+
+const std::vector<Micro> &Micros() {
+  static const std::vector<Micro> micros = {
+      {"add_reg", "ADD R3, R3, R2",
+       [](Assembler &a, int) { a.Add(kR3, kR3, kR2); }},
+      {"add_imm", "ADD R3, R3, #1",
+       [](Assembler &a, int) { a.AddImm(kR3, kR3, 1); }},
+      {"and_reg", "AND R3, R3, R2",
+       [](Assembler &a, int) { a.And(kR3, kR3, kR2); }},
+      {"and_imm", "AND R3, R3, #7",
+       [](Assembler &a, int) { a.AndImm(kR3, kR3, 7); }},
+      {"not", "NOT R3, R3", [](Assembler &a, int) { a.Not(kR3, kR3); }},
+      {"lea", "LEA R3, DATA", [](Assembler &a, int) { a.Lea(kR3, "data"); }},
+      {"ld", "LD R3, DATA", [](Assembler &a, int) { a.Ld(kR3, "data"); }},
+      {"ldr", "LDR R3, R4, #0 (RAM)",
+       [](Assembler &a, int) { a.Ldr(kR3, kR4, 0); }},
+      {"ldi", "LDI R3, POINTER (RAM)",
+       [](Assembler &a, int) { a.Ldi(kR3, "pointer"); }},
+      {"st", "ST R3, DATA", [](Assembler &a, int) { a.St(kR3, "data"); }},
+      {"str", "STR R3, R4, #0 (RAM)",
+       [](Assembler &a, int) { a.Str(kR3, kR4, 0); }},
+      {"sti", "STI R3, POINTER (RAM)",
+       [](Assembler &a, int) { a.Sti(kR3, "pointer"); }},
+      {"ldr_kbsr", "LDR R3, R6, #0 (KBSR)",
+       [](Assembler &a, int) { a.Ldr(kR3, kR6, 0); }},
+      {"ldi_kbsr", "LDI R3, KBSR_POINTER",
+       [](Assembler &a, int) { a.Ldi(kR3, "kbsr_pointer"); }},
+      {"br_taken", "BRp NEXT",
+       [](Assembler &a, int copy) {
+         std::string next = "NEXT" + std::to_string(copy);
+         a.Br(kP, next);
+         a.Label(next);
+       }},
+      {"br_not_taken", "BRn NEXT",
+       [](Assembler &a, int copy) {
+         std::string next = "NEXT" + std::to_string(copy);
+         a.Br(kN, next);
+         a.Label(next);
+       }},
+      {"jsr", "JSR SUB, then RET",
+       [](Assembler &a, int) { a.Jsr("SUB"); }},
+      {"jsrr", "JSRR R5, then RET", [](Assembler &a, int) { a.Jsrr(kR5); }},
+  };
+  return micros;
+}
+
+constexpr int kMicroCopies = 64;  // of the instruction in each iteration
+constexpr int kMicroIterations = 4096;
+
+// A loop that runs micro's instruction kMicroCopies times per iteration, or
+// just the loop if micro is null. The condition codes are positive on
+// entry to the body, and R4, R5 and R6 hold addresses of RAM, a subroutine
+// that returns and KBSR.
+void AssembleMicro(Assembler &a, const Micro *micro) {
+  a.Ld(kR4, "ram");
+  a.Lea(kR5, "SUB");
+  a.Ld(kR6, "kbsr");
+  a.Ld(kR1, "iterations");
+  a.Label("LOOP");
+  for (int copy = 0; micro && copy < kMicroCopies; ++copy) {
+    micro->emit(a, copy);
+  }
+  a.AddImm(kR1, kR1, -1);
+  a.Br(kP, "LOOP");
+  a.Trap(kHALT);
+  a.Label("SUB");
+  a.Ret();
+  a.Label("iterations");
+  a.Fill(kMicroIterations);
+  a.Label("ram");
+  a.Fill(0x4000);
+  a.Label("kbsr");
+  a.Fill(kKBSR);
+  a.Label("pointer");
+  a.Fill("ram");
+  a.Label("kbsr_pointer");
+  a.Fill(kKBSR);
+  a.Label("data");
+  a.Fill(0);
+}
+
+// The counts that Simulator::Run() took for image, or 0 if it did not halt.
+uint64_t TimeRun(const CycleCounter &counter, const std::string &image) {
+  Simulator sim;
+  StringConsole console("");
+  sim.SetConsole(console.console());
+  if (!sim.ReadImage(image)) {
+    return 0;
+  }
+  uint64_t start = counter.Read();
+  StopReason reason = sim.Run();
+  uint64_t count = counter.Read() - start;
+  return reason == StopReason::kHalted ? count : 0;
+}
+
+// Times each of Micros() less the cost of the bare loop around it. The two
+// take turns, so that both best times come from the same stretch of host
+// conditions.
+int RunMicrobenchmarks(const std::string &directory, int repeat) {
+  CycleCounter counter;
+  std::string loop_image = directory + "/loop.obj";
+  std::string image = directory + "/micro.obj";
+  Assembler loop;
+  AssembleMicro(loop, nullptr);
+  if (!loop.Write(loop_image)) {
+    std::cerr << "cannot write " << loop_image << std::endl;
+    return 1;
+  }
+  int exit_code = 0;
+  bool first = true;
+  std::printf("{\"unit\": \"%s\", \"operations\": %d, \"micro\": [\n",
+              counter.unit(), kMicroCopies * kMicroIterations);
+  for (const Micro &micro : Micros()) {
+    Assembler assembler;
+    AssembleMicro(assembler, &micro);
+    bool written = assembler.Write(image);
+    uint64_t best_loop = UINT64_MAX, best = UINT64_MAX;
+    for (int i = 0; i < repeat && written && best; ++i) {
+      best_loop = std::min(best_loop, TimeRun(counter, loop_image));
+      best = std::min(best, TimeRun(counter, image));
+    }
+    if (!written || !best || !best_loop) {
+      std::cerr << micro.name << " did not halt" << std::endl;
+      exit_code = 1;
+      continue;
+    }
+    double per_op = (static_cast<double>(best) - best_loop) /
+                    (kMicroCopies * kMicroIterations);
+    std::printf("%s  {\"name\": \"%s\", \"instruction\": \"%s\", "
+                "\"per_op\": %.2f}",
+                first ? "" : ",\n", micro.name, micro.instruction, per_op);
+    first = false;
+  }
+  std::printf("\n]}\n");
+  unlink(loop_image.c_str());
+  unlink(image.c_str());
+  return exit_code;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int scale = 1;
+  int repeat = 0;  // 5, or 30 with --micro
+  std::string baseline_file;
+  double tolerance = 10;
+  bool micro = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if ((arg == "-s" || arg == "--scale") && has_value) {
+      scale = std::clamp(std::atoi(argv[++i]), 1, kMaxScale);
+    } else if ((arg == "-r" || arg == "--repeat") && has_value) {
+      repeat = std::max(1, std::atoi(argv[++i]));
+    } else if ((arg == "-b" || arg == "--baseline") && has_value) {
+      baseline_file = argv[++i];
+    } else if ((arg == "-t" || arg == "--tolerance") && has_value) {
+      tolerance = std::atof(argv[++i]);
+    } else if (arg == "-m" || arg == "--micro") {
+      micro = true;
+    } else {
+      ShowUsage(argv[0]);
+      return 2;
+    }
+  }
+  std::map<std::pair<std::string, std::string>, double> baseline;
+  if (!baseline_file.empty() && !ReadBaseline(baseline_file, &baseline)) {
+    std::cerr << "cannot read " << baseline_file << std::endl;
+    return 2;
+  }
+
+  char directory[] = "/tmp/lc3bench.XXXXXX";
+  if (!mkdtemp(directory)) {
+    std::cerr << "cannot create a directory for the corpus" << std::endl;
+    return 2;
+  }
+  if (micro) {
+    int exit_code = RunMicrobenchmarks(directory, repeat ? repeat : 30);
+    rmdir(directory);
+    return exit_code;
+  }
+
+  repeat = repeat ? repeat : 5;
+  int exit_code = 0;
+  bool first = true;
+  std::string comparison;  // against the baseline, for after the results
+  std::printf("{\"scale\": %d, \"benchmarks\": [\n", scale);
+  for (const Workload &workload : Corpus()) {
+    Assembler assembler;
+    std::string input = workload.build(assembler, scale);
+    std::string image = std::string(directory) + "/" + workload.name + ".obj";
+    if (!assembler.Write(image)) {
+      std::cerr << "cannot write " << image << std::endl;
+      rmdir(directory);
+      return 2;
+    }
+    for (const Engine &engine : Engines()) {
+      Measurement m = Measure(engine, image, input, repeat);
+      if (!m.ok) {
+        std::cerr << workload.name << " did not halt on " << engine.name
+                  << std::endl;
+        exit_code = 1;
+        continue;
+      }
+      double ns = m.seconds * 1e9 / m.instructions;
+      std::printf(
+          "%s  {\"workload\": \"%s\", \"engine\": \"%s\", "
+          "\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.1f, "
+          "\"ns_per_instruction\": %.3f, \"peak_rss_kb\": %ld}",
+          first ? "" : ",\n", workload.name, engine.name,
+          static_cast<unsigned long long>(m.instructions), m.seconds,
+          m.instructions / m.seconds / 1e6, ns, m.peak_rss_kb);
+      std::fflush(stdout);
+      first = false;
+
+      auto it = baseline.find({workload.name, engine.name});
+      if (it != baseline.end()) {
+        double change = 100 * (ns / it->second - 1);
+        bool regressed = change > tolerance;
+        char line[128];
+        std::snprintf(line, sizeof(line),
+                      "%-10s %-12s %8.3f -> %8.3f ns %+7.1f%%%s\n",
+                      workload.name, engine.name, it->second, ns, change,
+                      regressed ? "  REGRESSION" : "");
+        comparison += line;
+        if (regressed) {
+          exit_code = 1;
+        }
+      }
+    }
+    unlink(image.c_str());
+  }
+  std::printf("\n]}\n");
+  std::fflush(stdout);
+  std::cerr << comparison;
+  rmdir(directory);
+  return exit_code;
+}
@@ -1,383 +1,1785 @@
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
-#include <sys/time.h>
-#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-#include <array>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-enum Register {
-  kR0 = 0,
-  kR1,
-  kR2,
-  kR3,
-  kR4,
-  kR5,
-  kR6,
-  kR7,
-  kPC,  // program counter
-  kCOND,
-  kRegisterCount
-};
+#include "cache.h"
+#include "image_cache.h"
+#include "lockstep.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "simulator.h"
+#include "trace.h"
+
+// Turns off line buffering and echo on the terminal while in scope.
+class RawTerminal {
+ public:
+  RawTerminal() {
+    tcgetattr(STDIN_FILENO, &original_);
+    struct termios raw = original_;
+    raw.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  }
+
+  ~RawTerminal() { tcsetattr(STDIN_FILENO, TCSANOW, &original_); }
+
+  RawTerminal(const RawTerminal &) = delete;
+  RawTerminal &operator=(RawTerminal &) = delete;
 
-enum OpCode {
-  kBR = 0,  // branch
-  kADD,     // add
-  kLD,      // load
-  kST,      // store
-  kJSR,     // jump register
-  kAND,     // bitwise and
-  kLDR,     // load register
-  kSTR,     // store register
-  kRTI,     // unused
-  kNOT,     // bitwise not
-  kLDI,     // load indirect
-  kSTI,     // store indirect
-  kJMP,     // jump
-  kRES,     // reserved (unused)
-  kLEA,     // load effective address
-  kTRAP     // execute trap
+ private:
+  struct termios original_;
 };
 
-enum Flag {
-  kPositive = 1 << 0,  // P
-  kZero = 1 << 1,      // Z
-  kNegative = 1 << 2,  // N
+// The interactive Simulator, stopped by SIGINT.
+Simulator *interrupt_target = nullptr;
+
+void HandleInterrupt(int) { interrupt_target->RequestStop(); }
+
+void ShowUsage(const std::string &program) {
+  std::cerr << "usage: " << program << " [option] ... [IMAGE] ...\n"
+            << "Options and arguments:\n"
+            << "\t-g, --guest-traps\tService every trap through the guest "
+               "trap vector table\n"
+            << "\t-t, --trap VEC=MODE\tService trap VEC (hex) natively or "
+               "in the guest\n"
+            << "\t\t\t\t(MODE is native or guest)\n"
+            << "\t-s, --sandbox DIR\tLet the file traps access files below "
+               "DIR\n"
+            << "\t-d, --disk FILE\t\tAttach FILE as the disk image\n"
+            << "\t-b, --batch MANIFEST\tRun every job in MANIFEST instead of "
+               "IMAGE\n"
+            << "\t-o, --results FILE\tWrite batch results to FILE instead of "
+               "stdout\n"
+            << "\t-j, --jobs N\t\tRun batch jobs on N threads\n"
+            << "\t-l, --lockstep\t\tRun batch jobs with the same images "
+               "together on\n\t\t\t\tSIMD lanes\n"
+            << "\t-P, --processes N\tShard batch jobs across N worker "
+               "processes\n"
+            << "\t-R, --records FILE\tKeep batch result records in FILE\n"
+            << "\t--resume\t\tSkip batch jobs already recorded in the "
+               "records\n\t\t\t\tfile\n"
+            << "\t--map-images\t\tShare image pages between batch or "
+               "server jobs\n\t\t\t\tcopy-on-write instead of copying "
+               "them\n"
+            << "\t-F, --fork-server\tLoad IMAGE once, then run it in a "
+               "forked child\n\t\t\t\tfor each request on stdin\n"
+            << "\t-S, --serve SOCKET\tServe jobs on the Unix socket SOCKET "
+               "with -j\n\t\t\t\tworkers; only this user may connect\n"
+            << "\t-I, --sessions SOCKET\tRun IMAGE interactively for each "
+               "client of the\n\t\t\t\tUnix socket SOCKET, with the "
+               "connection as its\n\t\t\t\tconsole\n"
+            << "\t-c, --count\t\tPrint the instruction mix to stderr on "
+               "exit\n"
+            << "\t-p, --profile FILE\tWrite the guest call graph to FILE as "
+               "folded\n\t\t\t\tstacks and a function table to stderr\n"
+            << "\t--sample RATE\t\tSample the guest PC RATE times per "
+               "CPU second\n\t\t\t\tand print a histogram to stderr\n"
+            << "\t-T, --trace FILE\tRecord every instruction to FILE\n"
+            << "\t--cache SPEC\t\tModel a cache level and print its misses "
+               "to stderr;\n\t\t\t\tSPEC is LEVEL:SIZE:WAYS:LINE[:POLICY]..., "
+               "with\n\t\t\t\tLEVEL l1i, l1d or l2, sizes in words, and "
+               "POLICY\n\t\t\t\tlru, fifo, random, wb or wt\n"
+            << "\t-y, --symbols FILE\tName guest addresses by the labels "
+               "in FILE\n"
+            << "\t--stats\t\t\tReport instructions, MIPS, traps and input "
+               "waits\n\t\t\t\ton SIGUSR1 and on exit\n"
+            << "\t--stats-interval SEC\tAlso report every SEC seconds\n"
+            << "\t--stats-file FILE\tWrite the reports to FILE instead of "
+               "stderr\n"
+            << "\t-h, --help\t\tShow this help message" << std::endl;
+}
+
+// Prints the instruction mix: each opcode's and each used trap vector's
+// count and share of all retired instructions.
+void PrintCounters(const InstructionCounters &counters) {
+  auto print = [&](const std::string &name, uint64_t n) {
+    double share = counters.total ? 100.0 * n / counters.total : 0;
+    std::fprintf(stderr, "%-8s %14llu %6.2f%%\n", name.c_str(),
+                 static_cast<unsigned long long>(n), share);
+  };
+  print("total", counters.total);
+  for (int op = 0; op < 16; ++op) {
+    if (counters.opcodes[op]) {
+      print(OpCodeName(op), counters.opcodes[op]);
+    }
+  }
+  for (int vector = 0; vector < 256; ++vector) {
+    if (counters.traps[vector]) {
+      char name[16];
+      std::snprintf(name, sizeof(name), "TRAP x%02X", vector);
+      print(name, counters.traps[vector]);
+    }
+  }
+}
+
+// Set by SIGUSR1 to ask for a statistics report.
+volatile sig_atomic_t report_requested = 0;
+
+void HandleReportRequest(int) { report_requested = 1; }
+
+// Live statistics of the interactive Simulator: instructions retired, the
+// MIPS since the last report and overall, traps by vector, and the time
+// spent waiting in the console for input. Reports go to stderr, or replace
+// a stats file so that other tools can poll it. The Simulator runs in
+// slices (see deadline()) and Poll() reports between them, so nothing
+// reads its state while it runs.
+class RunStatistics {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // interval is in seconds; with 0, only SIGUSR1 and Report() report.
+  RunStatistics(const Simulator &sim, double interval, std::string filename)
+      : sim_(sim),
+        interval_(std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(interval))),
+        filename_(std::move(filename)),
+        start_(Clock::now()),
+        last_(start_),
+        next_report_(interval > 0 ? start_ + interval_
+                                  : Clock::time_point::max()) {}
+
+  RunStatistics(const RunStatistics &) = delete;
+  RunStatistics &operator=(RunStatistics &) = delete;
+
+  // console, with the time its read() takes counted as blocked on input.
+  Console Wrap(const Console &console) {
+    console_ = console;
+    auto read = [](void *context) {
+      auto *self = static_cast<RunStatistics *>(context);
+      Clock::time_point start = Clock::now();
+      int c = self->console_.read(self->console_.context);
+      self->blocked_ += Clock::now() - start;
+      return c;
+    };
+    auto ready = [](void *context) {
+      auto *self = static_cast<RunStatistics *>(context);
+      return self->console_.ready(self->console_.context);
+    };
+    auto write = [](void *context, const char *data, size_t size) {
+      auto *self = static_cast<RunStatistics *>(context);
+      self->console_.write(self->console_.context, data, size);
+    };
+    return {read, ready, write, this};
+  }
+
+  // When the current slice of the run should end: at the next report, or
+  // soon enough to answer SIGUSR1 promptly.
+  Clock::time_point deadline() const {
+    return std::min(next_report_, Clock::now() + kSignalLatency);
+  }
+
+  // Reports if the interval has passed or SIGUSR1 asked for it.
+  void Poll() {
+    if (report_requested || Clock::now() >= next_report_) {
+      Report();
+    }
+  }
+
+  void Report() {
+    report_requested = 0;
+    Clock::time_point now = Clock::now();
+    if (now >= next_report_) {
+      next_report_ = now + interval_;
+    }
+    double elapsed = Seconds(now - start_);
+    double interval = Seconds(now - last_);
+    uint64_t instructions = sim_.instructions();
+    double mips =
+        interval > 0 ? (instructions - last_instructions_) / interval / 1e6
+                     : 0;
+    double average_mips = elapsed > 0 ? instructions / elapsed / 1e6 : 0;
+    double blocked = Seconds(blocked_);
+    last_ = now;
+    last_instructions_ = instructions;
+
+    uint64_t traps = 0;
+    std::string trap_list, trap_lines;
+    for (int vector = 0; vector < 256; ++vector) {
+      if (uint64_t n = sim_.traps(vector)) {
+        char line[64];
+        std::snprintf(line, sizeof(line), " x%02X=%llu", vector,
+                      static_cast<unsigned long long>(n));
+        trap_list += line;
+        std::snprintf(line, sizeof(line), "trap_x%02X %llu\n", vector,
+                      static_cast<unsigned long long>(n));
+        trap_lines += line;
+        traps += n;
+      }
+    }
+
+    if (filename_.empty()) {
+      std::fprintf(stderr,
+                   "[%.1f s] %llu instructions, %.1f MIPS (average "
+                   "%.1f), %.2f s blocked on input, %llu traps%s\n",
+                   elapsed, static_cast<unsigned long long>(instructions),
+                   mips, average_mips, blocked,
+                   static_cast<unsigned long long>(traps), trap_list.c_str());
+      return;
+    }
+    // written aside and renamed, so readers never see a partial file
+    std::string temporary = filename_ + ".tmp";
+    std::FILE *file = std::fopen(temporary.c_str(), "w");
+    if (!file) {
+      return;
+    }
+    std::fprintf(file,
+                 "elapsed_seconds %.3f\ninstructions %llu\nmips %.3f\n"
+                 "average_mips %.3f\ninput_blocked_seconds %.3f\n"
+                 "traps %llu\n%s",
+                 elapsed, static_cast<unsigned long long>(instructions), mips,
+                 average_mips, blocked,
+                 static_cast<unsigned long long>(traps), trap_lines.c_str());
+    if (std::fclose(file) == 0) {
+      std::rename(temporary.c_str(), filename_.c_str());
+    }
+  }
+
+ private:
+  static constexpr std::chrono::milliseconds kSignalLatency{200};
+
+  static double Seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  }
+
+  const Simulator &sim_;
+  Clock::duration interval_;
+  std::string filename_;
+  Console console_;
+  Clock::time_point start_;
+  Clock::time_point last_;  // of the last report
+  Clock::time_point next_report_;
+  uint64_t last_instructions_ = 0;
+  Clock::duration blocked_{};
 };
 
-enum MMIO {
-  kKBSR = 0xFE00,  // keyboard status
-  kKBDR = 0xFE02   // keyboard data
+// Runs sim until deadline under observer and every further observer that
+// is not null. Each combination is its own instantiation of the
+// interpreter, so a run pays nothing for the instrumentation it does not
+// use.
+template <typename Observer>
+StopReason RunObserved(Simulator &sim,
+                       RunStatistics::Clock::time_point deadline,
+                       Observer &observer) {
+  return sim.RunUntil(deadline, UINT64_MAX, observer);
+}
+
+template <typename Observer, typename Next, typename... Rest>
+StopReason RunObserved(Simulator &sim,
+                       RunStatistics::Clock::time_point deadline,
+                       Observer &observer, Next *next, Rest *...rest) {
+  if (!next) {
+    return RunObserved(sim, deadline, observer, rest...);
+  }
+  ObserverPair<Observer, Next> pair{observer, *next};
+  return RunObserved(sim, deadline, pair, rest...);
+}
+
+// Parses "VEC=MODE", e.g. "x25=guest".
+bool ParseTrapOption(const std::string &arg, uint8_t *vector, TrapMode *mode) {
+  auto eq = arg.find('=');
+  if (eq == std::string::npos || eq == 0) {
+    return false;
+  }
+  std::string number = arg.substr(0, eq);
+  if (number[0] == 'x' || number[0] == 'X') {
+    number.erase(0, 1);
+  }
+  char *end;
+  unsigned long v = std::strtoul(number.c_str(), &end, 16);
+  if (number.empty() || *end != '\0' || v > 0xFF) {
+    return false;
+  }
+  std::string name = arg.substr(eq + 1);
+  if (name == "native") {
+    *mode = TrapMode::kNative;
+  } else if (name == "guest") {
+    *mode = TrapMode::kGuest;
+  } else {
+    return false;
+  }
+  *vector = static_cast<uint8_t>(v);
+  return true;
+}
+
+// Settings from the command line that apply to every Simulator created.
+struct Options {
+  bool guest_traps = false;
+  std::vector<std::pair<uint8_t, TrapMode>> trap_modes;
+  std::string sandbox;
+  std::string disk;
+  bool map_images = false;  // MapImage() rather than CopyImage() for jobs
 };
 
-enum TrapCode {
-  kGETC = 0x20,   // get character from keyboard, not echoed onto the terminal
-  kOUT = 0x21,    // output a character
-  kPUTS = 0x22,   // output a word string
-  kIN = 0x23,     // get character from keyboard, echoed onto the terminal
-  kPUTSP = 0x24,  // output a byte string
-  kHALT = 0x25    // halt the program
+bool Configure(Simulator &sim, const Options &options) {
+  if (options.guest_traps) {
+    sim.SetAllTrapModes(TrapMode::kGuest);
+  }
+  for (auto &[vector, mode] : options.trap_modes) {
+    if (!sim.SetTrapMode(vector, mode)) {
+      std::cerr << "no native handler for trap x" << std::hex
+                << static_cast<int>(vector) << std::dec << std::endl;
+      return false;
+    }
+  }
+  if (!options.sandbox.empty() && !sim.SetSandbox(options.sandbox)) {
+    std::cerr << "cannot open sandbox directory" << std::endl;
+    return false;
+  }
+  if (!options.disk.empty() && !sim.AttachDisk(options.disk)) {
+    std::cerr << "cannot open disk image" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool ReadFile(const std::string &filename, std::string *contents) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  contents->assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  return true;
+}
+
+// One line of a batch manifest:
+//   IMAGE[,IMAGE...] INPUT EXPECTED [MAX_INSTRUCTIONS]
+// INPUT and EXPECTED name files, or "-" for no input and no comparison.
+// Blank lines and lines starting with '#' are skipped.
+struct Job {
+  std::vector<std::string> images;
+  std::string input;
+  std::string expected;
+  uint64_t max_instructions = UINT64_MAX;
 };
 
-uint16_t SignExtend(uint16_t x, int bitCount) {
-  if ((x >> (bitCount - 1)) & 1) {
-    x |= (0xFFFF << bitCount);
+// Parses a decimal count; signs, spaces and trailing characters are errors.
+bool ParseCount(const std::string &arg, uint64_t *count) {
+  if (arg.empty() || !std::isdigit(static_cast<unsigned char>(arg[0]))) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  unsigned long long v = std::strtoull(arg.c_str(), &end, 10);
+  if (*end != '\0' || errno == ERANGE) {
+    return false;
   }
-  return x;
+  *count = v;
+  return true;
 }
 
-uint16_t Swap16(uint16_t x) { return (x << 8) | (x >> 8); }
+bool ReadManifest(const std::string &filename, std::vector<Job> *jobs) {
+  std::ifstream in(filename);
+  if (!in) {
+    std::cerr << "cannot open manifest " << filename << std::endl;
+    return false;
+  }
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); ++line_number) {
+    std::istringstream fields(line);
+    std::string images;
+    Job job;
+    if (!(fields >> images) || images[0] == '#') {
+      continue;
+    }
+    // MAX_INSTRUCTIONS is optional, but must be a count and the last field
+    std::string limit;
+    std::string extra;
+    if (!(fields >> job.input >> job.expected) ||
+        (fields >> limit &&
+         (!ParseCount(limit, &job.max_instructions) || fields >> extra))) {
+      std::cerr << filename << ":" << line_number << ": expected IMAGES INPUT "
+                << "EXPECTED [MAX_INSTRUCTIONS]" << std::endl;
+      return false;
+    }
+    std::istringstream names(images);
+    for (std::string image; std::getline(names, image, ',');) {
+      job.images.push_back(image);
+    }
+    jobs->push_back(std::move(job));
+  }
+  return true;
+}
 
-void CloseFile(std::FILE *fp) { std::fclose(fp); };
+enum class JobStatus {
+  kOk,     // halted; no expected output to compare
+  kPass,   // halted with the expected output
+  kFail,   // halted with different output
+  kLimit,  // ran out of instructions
+  kError   // could not be set up, or faulted
+};
 
-constexpr uint16_t kPCStart = 0x3000;
+const char *JobStatusName(JobStatus status) {
+  static const char *const kNames[] = {"ok", "pass", "fail", "limit", "error"};
+  return kNames[static_cast<int>(status)];
+}
 
-class Simulator {
- public:
-  Simulator() {
-    // set the program counter to starting position
-    registers_[kPC] = kPCStart;
+struct JobResult {
+  JobStatus status = JobStatus::kError;
+  uint64_t instructions = 0;
+  std::chrono::microseconds elapsed{0};
+};
+
+JobStatus Grade(const Job &job, bool halted, const std::string &output,
+                const std::string &expected) {
+  if (!halted) {
+    return JobStatus::kLimit;
+  }
+  if (job.expected == "-") {
+    return JobStatus::kOk;
   }
+  return output == expected ? JobStatus::kPass : JobStatus::kFail;
+}
 
-  Simulator(const Simulator &) = delete;
-  Simulator &operator=(Simulator &) = delete;
+// Loads the images through cache, so that jobs running the same images
+// copy a prepared memory instead of parsing the files again. Most jobs are
+// short, and copying beats sharing pages for them, so jobs only map the
+// images copy-on-write, sharing the pages with every other job and worker
+// process running them, with options.map_images. Guest memory that is not
+// a mapping comes from the worker's pool.
+JobResult RunJob(const Job &job, const Options &options, ImageCache *cache,
+                 MemoryPool *memory) {
+  JobResult result;
+  auto start = std::chrono::steady_clock::now();
+  std::string input;
+  std::string expected;
+  if ((job.input != "-" && !ReadFile(job.input, &input)) ||
+      (job.expected != "-" && !ReadFile(job.expected, &expected))) {
+    return result;
+  }
 
-  void UpdateFlags(uint16_t r) {
-    if (registers_[r] == 0) {
-      registers_[kCOND] = kZero;
-    } else if (registers_[r] >>
-               15)  // a 1 in the left-most bit indicates negative
-    {
-      registers_[kCOND] = kNegative;
-    } else {
-      registers_[kCOND] = kPositive;
+  auto image = cache->Get(job.images);
+  if (!image) {
+    return result;
+  }
+  auto sim = std::make_unique<Simulator>(
+      memory, options.map_images ? image.get() : nullptr);
+  if (!Configure(*sim, options)) {
+    return result;
+  }
+  if (!options.map_images) {
+    sim->CopyImage(*image);
+  }
+
+  StringConsole console(std::move(input));
+  sim->SetConsole(console.console());
+
+  StopReason reason = sim->Run(job.max_instructions);
+
+  result.instructions = sim->instructions();
+  result.status =
+      reason == StopReason::kFault
+          ? JobStatus::kError
+          : Grade(job, reason == StopReason::kHalted, console.output(),
+                  expected);
+  result.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  return result;
+}
+
+// Called with each job's manifest index and result as the job finishes.
+using JobDone = std::function<void(size_t index, const JobResult &result)>;
+
+// Runs jobs that load the same images on one LockstepEngine. Jobs the
+// engine cannot finish are rerun on their own Simulator.
+void RunLockstep(const std::vector<Job> &jobs,
+                 const std::vector<size_t> &indices, const Options &options,
+                 ImageCache *cache, MemoryPool *memory, const JobDone &done) {
+  auto start = std::chrono::steady_clock::now();
+  LockstepEngine engine(indices.size());
+  std::vector<std::string> expected(indices.size());
+  bool ok = true;
+  for (auto &image : jobs[indices[0]].images) {
+    ok = ok && engine.ReadImage(image);
+  }
+  for (size_t lane = 0; lane < indices.size() && ok; ++lane) {
+    const Job &job = jobs[indices[lane]];
+    std::string input;
+    ok = (job.input == "-" || ReadFile(job.input, &input)) &&
+         (job.expected == "-" || ReadFile(job.expected, &expected[lane]));
+    engine.SetInput(lane, std::move(input));
+    engine.SetLimit(lane, job.max_instructions);
+  }
+  if (!ok) {
+    for (size_t i : indices) {
+      done(i, RunJob(jobs[i], options, cache, memory));
     }
+    return;
   }
 
-  bool ReadImage(const std::string &filename) {
-    std::unique_ptr<std::FILE, decltype(&CloseFile)> fp(
-        std::fopen(filename.c_str(), "rb"), &CloseFile);
-    uint16_t memory_origin;
-    std::fread(&memory_origin, sizeof(memory_origin), 1, fp.get());
-    memory_origin = Swap16(memory_origin);
+  engine.Run();
 
-    uint16_t remaining_memory_size = UINT16_MAX - memory_origin;
-    uint16_t *p = &memory_[0] + memory_origin;
-    auto nread =
-        std::fread(p, sizeof(uint16_t), remaining_memory_size, fp.get());
-    while (nread-- > 0) {
-      *p = Swap16(*p);
-      ++p;
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  for (size_t lane = 0; lane < indices.size(); ++lane) {
+    const Job &job = jobs[indices[lane]];
+    auto status = engine.status(lane);
+    if (status == LockstepEngine::LaneStatus::kUnsupported) {
+      done(indices[lane], RunJob(job, options, cache, memory));
+      continue;
     }
-    return true;
+    JobResult result;
+    bool halted = status == LockstepEngine::LaneStatus::kHalted;
+    result.status = Grade(job, halted, engine.output(lane), expected[lane]);
+    result.instructions = engine.instructions(lane);
+    result.elapsed = elapsed;
+    done(indices[lane], result);
   }
+}
+
+// Largest number of jobs run together on one LockstepEngine.
+constexpr size_t kMaxLockstepJobs = 256;
 
-  uint16_t CheckKeyInput() {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(STDIN_FILENO, &read_fds);
+// Runs tasks [0, count) on a fixed set of threads. Each thread starts with
+// a contiguous slice of the tasks in its own deque and takes work from the
+// back; when it runs dry it steals from the front of another thread's
+// deque, so a few long jobs do not leave the other threads idle. Tasks
+// never spawn tasks, so a thread that finds every deque empty is done.
+// Each task is told which worker runs it, for per-worker state.
+class WorkStealingPool {
+ public:
+  explicit WorkStealingPool(int threads)
+      : threads_(std::max(threads, 1)),
+        queues_(std::make_unique<Queue[]>(threads_)) {}
+
+  int threads() const { return threads_; }
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &read_fds, NULL, NULL, &timeout) != 0;
+  void Run(size_t count, const std::function<void(int, size_t)> &task) {
+    for (int i = 0; i < threads_; ++i) {
+      size_t begin = count * i / threads_;
+      size_t end = count * (i + 1) / threads_;
+      for (size_t j = begin; j < end; ++j) {
+        queues_[i].tasks.push_back(j);
+      }
+    }
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads_; ++i) {
+      workers.emplace_back([this, i, &task] {
+        size_t next;
+        while (Pop(i, &next) || Steal(i, &next)) {
+          task(i, next);
+        }
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
   }
 
-  void WriteMemory(uint16_t address, uint16_t x) { memory_[address] = x; }
+ private:
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
 
-  uint16_t ReadMemory(uint16_t address) {
-    if (address == kKBSR) {
-      if (CheckKeyInput()) {
-        memory_[kKBSR] = (1 << 15);
-        auto c = std::getchar();
-        memory_[kKBDR] = static_cast<uint16_t>(c);
-      } else {
-        memory_[kKBSR] = 0;
+  bool Pop(int self, size_t *task) {
+    Queue &queue = queues_[self];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    *task = queue.tasks.back();
+    queue.tasks.pop_back();
+    return true;
+  }
+
+  bool Steal(int self, size_t *task) {
+    for (int i = 1; i < threads_; ++i) {
+      Queue &victim = queues_[(self + i) % threads_];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        *task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
       }
     }
-    return memory_[address];
+    return false;
   }
 
-  void Run() {
-    bool running = true;
-    while (running) {
-      uint16_t instr = ReadMemory(registers_[kPC]++);
-      uint16_t op = instr >> 12;
+  int threads_;
+  std::unique_ptr<Queue[]> queues_;
+};
 
-      switch (op) {
-        case kADD: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t r1 = (instr >> 6) & 0x7;
-          bool immediate = (instr >> 5) & 0x1;
-          if (immediate) {
-            uint16_t imm5 = SignExtend(instr & 0x1F, 5);
-            registers_[r0] = registers_[r1] + imm5;
-          } else {
-            uint16_t r2 = instr & 0x7;
-            registers_[r0] = registers_[r1] + registers_[r2];
-          }
-          UpdateFlags(r0);
-        } break;
-
-        case kAND: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t r1 = (instr >> 6) & 0x7;
-          bool immediate = (instr >> 5) & 0x1;
-          if (immediate) {
-            uint16_t imm5 = SignExtend(instr & 0x1F, 5);
-            registers_[r0] = registers_[r1] & imm5;
-          } else {
-            uint16_t r2 = instr & 0x7;
-            registers_[r0] = registers_[r1] & registers_[r2];
-          }
-          UpdateFlags(r0);
-        } break;
-
-        case kNOT: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t r1 = (instr >> 6) & 0x7;
-          registers_[r0] = ~registers_[r1];
-          UpdateFlags(r0);
-        } break;
-
-        case kBR: {
-          uint16_t pc_offset = SignExtend(instr & 0x1FF, 9);
-          uint16_t condition = (instr >> 9) & 0x7;
-          if (condition & registers_[kCOND]) {
-            registers_[kPC] += pc_offset;
-          }
-        } break;
-
-        case kJMP: {
-          uint16_t r1 = (instr >> 6) & 0x7;
-          registers_[kPC] = registers_[r1];
-        } break;
-
-        case kJSR: {
-          bool long_flag = (instr >> 11) & 1;
-          registers_[kR7] = registers_[kPC];
-          if (long_flag) {  // JSR
-            uint16_t longpc_offset = SignExtend(instr & 0x7FF, 11);
-            registers_[kPC] += longpc_offset;
-          } else {  // JSRR
-            uint16_t r1 = (instr >> 6) & 0x7;
-            registers_[kPC] += registers_[r1];
-          }
-        } break;
-
-        case kLD: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t pc_offset = SignExtend(instr & 0x1FF, 9);
-          registers_[r0] = ReadMemory(registers_[kPC] + pc_offset);
-          UpdateFlags(r0);
-        } break;
-
-        case kLDI: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t pc_offset = SignExtend(instr & 0x1FF, 9);
-          registers_[r0] = ReadMemory(ReadMemory(registers_[kPC] + pc_offset));
-          UpdateFlags(r0);
-        } break;
-
-        case kLDR: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t r1 = (instr >> 6) & 0x7;
-          uint16_t pc_offset = SignExtend(instr & 0x3F, 6);
-          registers_[r0] = ReadMemory(registers_[r1] + pc_offset);
-          UpdateFlags(r0);
-        } break;
-
-        case kLEA: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t pc_offset = SignExtend(instr & 0x1FF, 9);
-          registers_[r0] = registers_[kPC] + pc_offset;
-          UpdateFlags(r0);
-        } break;
-
-        case kST: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t pc_offset = SignExtend(instr & 0x1FF, 9);
-          WriteMemory(registers_[kPC] + pc_offset, registers_[r0]);
-        } break;
-
-        case kSTI: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t pc_offset = SignExtend(instr & 0x1FF, 9);
-          WriteMemory(ReadMemory(registers_[kPC] + pc_offset), registers_[r0]);
-        } break;
-
-        case kSTR: {
-          uint16_t r0 = (instr >> 9) & 0x7;
-          uint16_t r1 = (instr >> 6) & 0x7;
-          uint16_t offset = SignExtend(instr & 0x3F, 6);
-          WriteMemory(registers_[r1] + offset, registers_[r0]);
-        } break;
-
-        case kTRAP: {
-          switch (instr & 0xFF) {
-            case kGETC: {
-              auto c = std::getchar();
-              registers_[kR0] = static_cast<uint16_t>(c);
-            } break;
-
-            case kOUT: {
-              std::putchar(static_cast<char>(registers_[kR0]));
-              std::fflush(stdout);
-            } break;
-
-            case kPUTS: {
-              uint16_t *c = &memory_[0] + registers_[kR0];
-              while (*c) {
-                std::putchar(static_cast<char>(*c));
-                ++c;
-              }
-              std::fflush(stdout);
-            } break;
-
-            case kIN: {
-              std::cout << "Enter a character: ";
-              auto c = std::getchar();
-              std::putchar(c);
-              registers_[kR0] = static_cast<uint16_t>(c);
-            } break;
-
-            case kPUTSP: {
-              uint16_t *c = &memory_[0] + registers_[kR0];
-              while (*c) {
-                char c1 = static_cast<char>((*c) & 0xFF);
-                std::putchar(c1);
-                char c2 = static_cast<char>((*c) >> 8);
-                if (c2) {
-                  std::putchar(c2);
-                }
-                ++c;
-              }
-              std::fflush(stdout);
-            } break;
-
-            case kHALT: {
-              std::puts("HALT");
-              std::fflush(stdout);
-              running = false;
-            } break;
-          }
-          break;
-        }
+// Runs the jobs at indices on threads threads, loading images through
+// cache. With lockstep set, jobs that load the same images and use only the
+// default trap handlers are grouped onto LockstepEngines.
+void RunJobs(const std::vector<Job> &jobs, const std::vector<size_t> &indices,
+             int threads, bool lockstep, const Options &options,
+             ImageCache *cache, const JobDone &done) {
+  lockstep = lockstep && !options.guest_traps && options.trap_modes.empty();
+
+  // each unit of work is one job or one lockstep group
+  std::vector<std::vector<size_t>> units;
+  std::map<std::vector<std::string>, size_t> open_groups;
+  for (size_t i : indices) {
+    if (!lockstep) {
+      units.push_back({i});
+      continue;
+    }
+    auto it = open_groups.find(jobs[i].images);
+    if (it == open_groups.end() ||
+        units[it->second].size() == kMaxLockstepJobs) {
+      it = open_groups.insert_or_assign(jobs[i].images, units.size()).first;
+      units.emplace_back();
+    }
+    units[it->second].push_back(i);
+  }
 
-        case kRES:
-        case kRTI:
-        default:
-          std::abort();
-          break;
+  WorkStealingPool pool(threads);
+  // created by each worker, so that its memory is on the worker's node
+  std::vector<std::unique_ptr<MemoryPool>> memory(pool.threads());
+  pool.Run(units.size(), [&](int worker, size_t u) {
+    if (!memory[worker]) {
+      memory[worker] = std::make_unique<MemoryPool>();
+    }
+    if (units[u].size() == 1) {
+      done(units[u][0],
+           RunJob(jobs[units[u][0]], options, cache, memory[worker].get()));
+    } else {
+      RunLockstep(jobs, units[u], options, cache, memory[worker].get(), done);
+    }
+  });
+}
+
+// 64-bit FNV-1a, for hashes that are stored in files.
+uint64_t Fnv1a(const std::string &data) {
+  uint64_t hash = 0xCBF29CE484222325;
+  for (unsigned char c : data) {
+    hash = (hash ^ c) * 0x100000001B3;
+  }
+  return hash;
+}
+
+// A results file: a header, then one fixed-size record per manifest job,
+// mapped shared so that worker processes write their records in place.
+// Each record has one writer and its done flag is stored last, so no
+// locks are needed, and a record whose writer was killed part way is
+// simply not done. Opening an existing file for resuming keeps the
+// records of jobs that finished, provided the manifest is unchanged.
+class ResultRecords {
+ public:
+  ResultRecords() = default;
+  ~ResultRecords() {
+    if (header_) {
+      munmap(header_, Size());
+    }
+  }
+
+  ResultRecords(const ResultRecords &) = delete;
+  ResultRecords &operator=(ResultRecords &) = delete;
+
+  // An empty filename maps anonymous shared memory, which lasts only as
+  // long as the processes using it.
+  bool Open(const std::string &filename, uint64_t jobs, uint64_t manifest_hash,
+            bool resume) {
+    jobs_ = jobs;
+    int fd = -1;
+    if (!filename.empty()) {
+      fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      struct stat info;
+      if (fd < 0 || fstat(fd, &info) < 0) {
+        std::cerr << "cannot open " << filename << std::endl;
+        return false;
+      }
+      if (resume && static_cast<size_t>(info.st_size) != Size()) {
+        resume = false;  // nothing to keep, or not our file
       }
+      if ((!resume && ftruncate(fd, 0) < 0) || ftruncate(fd, Size()) < 0) {
+        close(fd);
+        return false;
+      }
+    }
+    void *p = mmap(nullptr, Size(), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    header_ = static_cast<Header *>(p);
+    records_ = reinterpret_cast<Record *>(header_ + 1);
+    if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+        header_->jobs != jobs || header_->manifest_hash != manifest_hash) {
+      std::memset(p, 0, Size());
+      std::memcpy(header_->magic, kMagic, sizeof(kMagic));
+      header_->jobs = jobs;
+      header_->manifest_hash = manifest_hash;
+    }
+    return true;
+  }
+
+  bool Done(size_t i) const {
+    return __atomic_load_n(&records_[i].done, __ATOMIC_ACQUIRE) != 0;
+  }
+
+  JobResult Get(size_t i) const {
+    JobResult result;
+    if (Done(i)) {
+      result.status = static_cast<JobStatus>(records_[i].status);
+      result.instructions = records_[i].instructions;
+      result.elapsed = std::chrono::microseconds(records_[i].microseconds);
     }
+    return result;
+  }
+
+  void Put(size_t i, const JobResult &result) {
+    Record &record = records_[i];
+    record.instructions = result.instructions;
+    record.microseconds = result.elapsed.count();
+    record.status = static_cast<int32_t>(result.status);
+    __atomic_store_n(&record.done, 1, __ATOMIC_RELEASE);
   }
 
+  // Writes the records back to the file.
+  void Sync() { msync(header_, Size(), MS_SYNC); }
+
  private:
-  std::array<uint16_t, UINT16_MAX> memory_;
-  std::array<uint16_t, Register::kRegisterCount> registers_;
+  static constexpr char kMagic[8] = "LC3RES1";
+
+  struct Header {
+    char magic[8];
+    uint64_t jobs;
+    uint64_t manifest_hash;  // Fnv1a() of the manifest text
+    uint64_t reserved;
+  };
+
+  struct Record {
+    uint64_t instructions;
+    uint64_t microseconds;
+    int32_t status;  // JobStatus
+    uint32_t done;   // nonzero once the fields above are valid
+  };
+
+  size_t Size() const { return sizeof(Header) + jobs_ * sizeof(Record); }
+
+  uint64_t jobs_ = 0;
+  Header *header_ = nullptr;
+  Record *records_ = nullptr;
 };
 
-struct termios original_termios;
+// Writes one "INDEX STATUS INSTRUCTIONS MICROSECONDS" line per job, in
+// manifest order. Returns 0 if every job halted with the expected output.
+//
+// Results are kept in records_file if one is given; with resume set, jobs
+// it already records are not run again. With processes above 1 the jobs
+// are sharded round-robin across that many forked workers, which share
+// the threads and write their results straight into the records. A job
+// whose worker died is reported as an error and runs again on resume.
+int RunBatch(const std::string &manifest, const std::string &results_file,
+             const std::string &records_file, bool resume, int processes,
+             int threads, bool lockstep, const Options &options) {
+  std::vector<Job> jobs;
+  std::string manifest_text;
+  if (!ReadManifest(manifest, &jobs) || !ReadFile(manifest, &manifest_text)) {
+    return 2;
+  }
+  ResultRecords records;
+  if (!records.Open(records_file, jobs.size(), Fnv1a(manifest_text),
+                    resume)) {
+    return 2;
+  }
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (!records.Done(i)) {
+      pending.push_back(i);
+    }
+  }
 
-void DisableInputBuffering() {
-  tcgetattr(STDIN_FILENO, &original_termios);
-  struct termios newTermios = original_termios;
-  newTermios.c_lflag &= ~ICANON & ~ECHO;
-  tcsetattr(STDIN_FILENO, TCSANOW, &newTermios);
+  auto record = [&](size_t i, const JobResult &result) {
+    records.Put(i, result);
+  };
+  processes = std::max(1, std::min<int>(processes, pending.size()));
+  ImageCache cache;
+  if (processes == 1) {
+    RunJobs(jobs, pending, threads, lockstep, options, &cache, record);
+  } else {
+    // load the images before forking, so that the workers inherit the
+    // cache and share its pages
+    std::set<std::vector<std::string>> loaded;
+    for (size_t i : pending) {
+      if (loaded.insert(jobs[i].images).second) {
+        cache.Get(jobs[i].images);
+      }
+    }
+    std::vector<pid_t> workers;
+    for (int k = 0; k < processes; ++k) {
+      pid_t pid = fork();
+      if (pid < 0) {
+        std::cerr << "cannot start worker process" << std::endl;
+        break;
+      }
+      if (pid == 0) {
+        std::vector<size_t> shard;
+        for (size_t j = k; j < pending.size(); j += processes) {
+          shard.push_back(pending[j]);
+        }
+        RunJobs(jobs, shard, std::max(1, threads / processes), lockstep,
+                options, &cache, record);
+        _exit(0);
+      }
+      workers.push_back(pid);
+    }
+    for (pid_t pid : workers) {
+      int status;
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      }
+    }
+  }
+  if (!records_file.empty()) {
+    records.Sync();
+  }
+
+  std::ofstream file;
+  if (results_file != "-") {
+    file.open(results_file);
+    if (!file) {
+      std::cerr << "cannot write " << results_file << std::endl;
+      return 2;
+    }
+  }
+  std::ostream &out = results_file == "-" ? std::cout : file;
+  int exit_code = 0;
+  size_t unfinished = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    unfinished += !records.Done(i);
+    const JobResult result = records.Get(i);
+    out << i << "\t" << JobStatusName(result.status) << "\t"
+        << result.instructions << "\t" << result.elapsed.count() << "\n";
+    if (result.status != JobStatus::kOk && result.status != JobStatus::kPass) {
+      exit_code = 1;
+    }
+  }
+  if (unfinished) {
+    std::cerr << unfinished << " jobs did not finish";
+    if (!records_file.empty()) {
+      std::cerr << "; run again with --resume to finish them";
+    }
+    std::cerr << std::endl;
+  }
+  return exit_code;
 }
 
-void RestoreInputBuffering() {
-  tcsetattr(STDIN_FILENO, TCSANOW, &original_termios);
+bool ReadFull(int fd, void *buffer, size_t size) {
+  char *p = static_cast<char *>(buffer);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
 }
 
-void HandleInterrupt(int signal) {
-  RestoreInputBuffering();
-  std::cerr << std::endl;
-  std::exit(-2);
+bool WriteFull(int fd, const void *buffer, size_t size) {
+  const char *p = static_cast<const char *>(buffer);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
 }
 
-void ShowUsage(const std::string &program) {
-  std::cerr << "usage: " << program << " [option] ... [IMAGE] ...\n"
-            << "Options and arguments:\n"
-            << "\t-h, --help\t\tShow this help message" << std::endl;
+// Largest input a fork-server or job-server request may carry.
+constexpr uint32_t kMaxInputSize = 16 << 20;
+
+// Fork-server protocol on the control pipe (stdin/stdout), in host byte
+// order and without padding. Each request is answered before the next one
+// is read.
+struct ForkRequest {
+  uint64_t max_instructions;  // 0 for no limit
+  uint32_t input_size;        // followed by that many bytes of input
+  uint32_t reserved;          // must be zero
+};
+
+enum class ForkStatus : int32_t {
+  kHalted = 0,
+  kLimit = 1,
+  kCrashed = 2,
+  kError = 3  // the request was malformed; the server exits
+};
+
+struct ForkResponse {
+  uint64_t instructions;
+  int32_t status;        // ForkStatus
+  uint32_t output_size;  // followed by that many bytes of output
+};
+
+// Loads the images once, then serves each request from a fork() of the
+// prepared Simulator, so a run costs a copy-on-write fork instead of a
+// process start and image parse.
+int RunForkServer(const std::vector<std::string> &images,
+                  const Options &options) {
+  if (!options.disk.empty()) {
+    // the disk's I/O thread would not survive fork()
+    std::cerr << "--disk cannot be used with --fork-server" << std::endl;
+    return 2;
+  }
+  Simulator sim;
+  if (!Configure(sim, options)) {
+    return 2;
+  }
+  for (auto &image : images) {
+    if (!sim.ReadImage(image)) {
+      return 2;
+    }
+  }
+  // children report their instruction count through a shared page
+  auto *child_instructions = static_cast<uint64_t *>(
+      mmap(nullptr, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  if (child_instructions == MAP_FAILED) {
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  ForkRequest request;
+  while (ReadFull(STDIN_FILENO, &request, sizeof(request))) {
+    if (request.input_size > kMaxInputSize || request.reserved != 0) {
+      // the stream cannot be resynchronized; answer and stop
+      ForkResponse response = {};
+      response.status = static_cast<int32_t>(ForkStatus::kError);
+      WriteFull(STDOUT_FILENO, &response, sizeof(response));
+      munmap(child_instructions, sizeof(uint64_t));
+      return 2;
+    }
+    std::string input(request.input_size, '\0');
+    if (!ReadFull(STDIN_FILENO, input.data(), input.size())) {
+      break;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+      return 2;
+    }
+    *child_instructions = 0;
+    pid_t pid = fork();
+    if (pid < 0) {
+      return 2;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      std::FILE *in = fmemopen(input.data(), input.size(), "r");
+      std::FILE *out = fdopen(fds[1], "w");
+      StdioConsole console(in, out);
+      sim.SetConsole(console.console());
+      uint64_t budget = request.max_instructions ? request.max_instructions
+                                                 : UINT64_MAX;
+      StopReason reason = sim.Run(budget);
+      *child_instructions = sim.instructions();
+      std::fclose(out);
+      // a fault exits with 2 and is reported as a crash
+      _exit(reason == StopReason::kHalted            ? 0
+            : reason == StopReason::kBudgetExhausted ? 1
+                                                     : 2);
+    }
+    close(fds[1]);
+    std::string output;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) != 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        break;
+      }
+      output.append(buffer, n);
+    }
+    close(fds[0]);
+    int wait_status;
+    while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR) {
+    }
+
+    ForkResponse response = {};
+    response.status = static_cast<int32_t>(ForkStatus::kCrashed);
+    if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) <= 1) {
+      response.status = static_cast<int32_t>(
+          WEXITSTATUS(wait_status) == 0 ? ForkStatus::kHalted
+                                        : ForkStatus::kLimit);
+    }
+    response.instructions = *child_instructions;
+    response.output_size = output.size();
+    if (!WriteFull(STDOUT_FILENO, &response, sizeof(response)) ||
+        !WriteFull(STDOUT_FILENO, output.data(), output.size())) {
+      break;
+    }
+  }
+  munmap(child_instructions, sizeof(uint64_t));
+  return 0;
 }
 
+// Returns a socket listening on the Unix domain socket path, or -1 after
+// reporting why not. Only the server's user may connect: job clients name
+// host files as images and session clients drive the machine, so the
+// socket is trusted like a shell. Ignores SIGPIPE, so that writes to
+// clients that went away fail instead.
+int Listen(const std::string &path) {
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (listener < 0 || path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "cannot create socket " << path << std::endl;
+    if (listener >= 0) {
+      close(listener);
+    }
+    return -1;
+  }
+  path.copy(address.sun_path, path.size());
+  struct stat info;
+  if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(path.c_str());  // left over from an earlier server
+  }
+  // nobody can connect before listen(), so the mode is set in time
+  if (bind(listener, reinterpret_cast<struct sockaddr *>(&address),
+           sizeof(address)) < 0 ||
+      chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    std::cerr << "cannot listen on " << path << std::endl;
+    close(listener);
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  return listener;
+}
+
+// Job-server protocol on each connection, in host byte order and without
+// padding. Requests may be pipelined; each response carries its request's
+// id, and responses come back in the order jobs finish.
+struct JobRequest {
+  uint64_t max_instructions;  // 0 for no limit
+  uint32_t id;                // echoed in the response
+  uint32_t images_size;       // followed by that many bytes of image names,
+                              // comma-separated, as in a batch manifest
+  uint32_t input_size;        // then by that many bytes of input
+  uint32_t reserved;          // must be zero
+};
+
+enum class JobServerStatus : int32_t {
+  kHalted = 0,
+  kLimit = 1,
+  kFault = 2,
+  kError = 3  // an image could not be loaded or the request was malformed
+};
+
+struct JobResponse {
+  uint64_t instructions;
+  uint32_t id;
+  int32_t status;        // JobServerStatus
+  uint32_t output_size;  // followed by that many bytes of output
+  uint32_t reserved;
+};
+
+// Largest image name list a request may carry.
+constexpr uint32_t kMaxImagesSize = 4096;
+
+// Most jobs one connection may have waiting for a worker. Its reader stops
+// reading requests until one is taken, so a client that sends faster than
+// the workers drain is held back by the socket instead of filling memory.
+constexpr int kMaxQueuedJobs = 8;
+
+// Serves jobs from clients of a Unix domain socket. Each connection has a
+// reader thread that queues its requests for a fixed set of workers. Each
+// worker keeps one configured Simulator and its own memory pool, and
+// resets the Simulator between jobs, and images are shared through an
+// ImageCache, so a job costs a reset and a copy of its images, or with
+// options.map_images a copy-on-write mapping of them. Image names are host
+// paths opened with the server's permissions, which is why Listen() lets
+// only the server's user connect.
+class JobServer {
+ public:
+  JobServer(int workers, const Options &options)
+      : workers_(std::max(workers, 1)), options_(options) {}
+
+  int Serve(const std::string &path) {
+    int listener = Listen(path);
+    if (listener < 0) {
+      return 2;
+    }
+
+    // check the configuration once, before any client depends on it
+    Simulator probe;
+    if (!Configure(probe, options_)) {
+      close(listener);
+      return 2;
+    }
+    for (int i = 0; i < workers_; ++i) {
+      worker_threads_.emplace_back(&JobServer::Work, this);
+    }
+    while (true) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) {
+          continue;
+        }
+        break;
+      }
+      auto connection = std::make_shared<Connection>(fd);
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto reader : finished_readers_) {
+        reader->thread.join();
+        readers_.erase(reader);
+      }
+      finished_readers_.clear();
+      auto reader = readers_.insert(readers_.end(), {{}, connection});
+      reader->thread = std::thread(&JobServer::Read, this, connection, reader);
+    }
+    close(listener);
+    Stop();
+    return 2;
+  }
+
+ private:
+  // Closed when the reader and every queued job are done with it.
+  struct Connection {
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() { close(fd); }
+
+    int fd;
+    std::mutex write_mutex;
+    int queued = 0;  // jobs in queue_; guarded by JobServer::mutex_
+  };
+
+  struct PendingJob {
+    std::shared_ptr<Connection> connection;
+    JobRequest request;
+    std::vector<std::string> images;
+    std::string input;
+  };
+
+  struct Reader {
+    std::thread thread;
+    std::weak_ptr<Connection> connection;  // for hanging up on Stop()
+  };
+
+  // Hangs up on every client and joins the readers, then stops the workers'
+  // machines and joins the workers. Queued jobs are dropped.
+  void Stop() {
+    std::list<Reader> readers;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      for (auto &reader : readers_) {
+        if (auto connection = reader.connection.lock()) {
+          shutdown(connection->fd, SHUT_RDWR);
+        }
+      }
+      readers.splice(readers.end(), readers_);
+    }
+    wakeup_.notify_all();
+    drained_.notify_all();
+    for (auto &reader : readers) {
+      reader.thread.join();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.clear();
+      for (Simulator *sim : machines_) {
+        sim->RequestStop();
+      }
+    }
+    for (auto &worker : worker_threads_) {
+      worker.join();
+    }
+  }
+
+  void Read(std::shared_ptr<Connection> connection,
+            std::list<Reader>::iterator self) {
+    ReadRequests(connection);
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_readers_.push_back(self);
+  }
+
+  // Waits until the connection may queue another job; false on Stop().
+  bool WaitForRoom(Connection &connection) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    drained_.wait(lock, [&] {
+      return stopping_ || connection.queued < kMaxQueuedJobs;
+    });
+    return !stopping_;
+  }
+
+  void ReadRequests(std::shared_ptr<Connection> connection) {
+    JobRequest request;
+    while (WaitForRoom(*connection) &&
+           ReadFull(connection->fd, &request, sizeof(request))) {
+      PendingJob job{connection, request, {}, {}};
+      std::string images(std::min(request.images_size, kMaxImagesSize), '\0');
+      job.input.resize(std::min(request.input_size, kMaxInputSize));
+      if (request.images_size > kMaxImagesSize ||
+          request.input_size > kMaxInputSize || request.reserved != 0 ||
+          !ReadFull(connection->fd, images.data(), images.size()) ||
+          !ReadFull(connection->fd, job.input.data(), job.input.size())) {
+        // the stream cannot be resynchronized; answer and hang up
+        Respond(*connection, request.id, JobServerStatus::kError, 0, "");
+        shutdown(connection->fd, SHUT_RDWR);
+        return;
+      }
+      std::istringstream names(images);
+      for (std::string image; std::getline(names, image, ',');) {
+        job.images.push_back(image);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++connection->queued;
+        queue_.push_back(std::move(job));
+      }
+      wakeup_.notify_one();
+    }
+  }
+
+  void Work() {
+    MemoryPool memory;
+    Simulator sim(&memory);
+    Configure(sim, options_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      machines_.push_back(&sim);
+    }
+    while (true) {
+      PendingJob job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wakeup_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (stopping_) {
+          return;
+        }
+        job = std::move(queue_.front());
+        queue_.pop_front();
+        --job.connection->queued;
+      }
+      drained_.notify_all();
+      auto image = cache_.Get(job.images);
+      if (job.images.empty() || !image) {
+        Respond(*job.connection, job.request.id, JobServerStatus::kError, 0,
+                "");
+        continue;
+      }
+      // a mapped image replaces the memory, so none is taken from the pool
+      sim.Reset(options_.map_images ? image.get() : nullptr);
+      if (!options_.map_images) {
+        sim.CopyImage(*image);
+      }
+      StringConsole console(std::move(job.input));
+      sim.SetConsole(console.console());
+      uint64_t budget = job.request.max_instructions
+                            ? job.request.max_instructions
+                            : UINT64_MAX;
+      {
+        // Reset() cleared any stop request, so Stop() must see this run
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+          return;
+        }
+      }
+      StopReason reason = sim.Run(budget);
+      JobServerStatus status = reason == StopReason::kHalted
+                                   ? JobServerStatus::kHalted
+                               : reason == StopReason::kBudgetExhausted
+                                   ? JobServerStatus::kLimit
+                                   : JobServerStatus::kFault;
+      Respond(*job.connection, job.request.id, status, sim.instructions(),
+              console.output());
+    }
+  }
+
+  void Respond(Connection &connection, uint32_t id, JobServerStatus status,
+               uint64_t instructions, const std::string &output) {
+    JobResponse response = {};
+    response.instructions = instructions;
+    response.id = id;
+    response.status = static_cast<int32_t>(status);
+    response.output_size = output.size();
+    std::lock_guard<std::mutex> lock(connection.write_mutex);
+    // a client that went away is noticed by its reader
+    WriteFull(connection.fd, &response, sizeof(response)) &&
+        WriteFull(connection.fd, output.data(), output.size());
+  }
+
+  int workers_;
+  const Options &options_;
+  ImageCache cache_;
+
+  std::vector<std::thread> worker_threads_;
+
+  std::mutex mutex_;  // guards the members below
+  std::condition_variable wakeup_;   // queue_ has a job, or stopping_
+  std::condition_variable drained_;  // a job left queue_, or stopping_
+  std::deque<PendingJob> queue_;
+  bool stopping_ = false;
+  std::vector<Simulator *> machines_;  // one per worker
+  std::list<Reader> readers_;
+  std::vector<std::list<Reader>::iterator> finished_readers_;
+};
+
+// Serves interactive sessions of one set of images to clients of a Unix
+// domain socket: each connection is the console of its own machine, and
+// every machine runs on one Scheduler on the calling thread, so a session
+// waiting for input costs nothing. One more thread polls the clients and
+// hands their input to the Scheduler.
+class SessionServer {
+ public:
+  explicit SessionServer(const Options &options)
+      : options_(options),
+        scheduler_(
+            [this](int session, const char *data, size_t size) {
+              Write(session, data, size);
+            },
+            [this](int session, StopReason) { Close(session); }) {}
+
+  int Serve(const std::vector<std::string> &images, const std::string &path) {
+    Simulator probe;
+    image_ = cache_.Get(images);
+    if (images.empty() || !image_) {
+      std::cerr << "cannot load the images" << std::endl;
+      return 2;
+    }
+    if (!Configure(probe, options_)) {
+      return 2;
+    }
+    int listener = Listen(path);
+    if (listener < 0) {
+      return 2;
+    }
+    std::thread poller(&SessionServer::Poll, this, listener);
+    scheduler_.Run(true);
+    poller.join();
+    close(listener);
+    return 2;
+  }
+
+ private:
+  struct Connection {
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() { close(fd); }
+
+    int fd;
+  };
+
+  struct Client {
+    int session;
+    std::shared_ptr<Connection> connection;
+    bool paused = false;  // not read while its machine has enough input
+  };
+
+  // Input a client may have waiting for its machine before Poll() stops
+  // reading from it.
+  static constexpr size_t kMaxBufferedInput = 64 * 1024;
+
+  // Accepts clients and delivers their input until the listener fails,
+  // then stops the Scheduler.
+  void Poll(int listener) {
+    std::vector<struct pollfd> fds = {{listener, POLLIN, 0}};
+    std::vector<Client> clients;  // clients[i] polls on fds[i + 1]
+    char buffer[4096];
+    while (true) {
+      // paused clients are resumed once their machines have caught up
+      bool paused = false;
+      for (size_t i = 1; i < fds.size(); ++i) {
+        Client &client = clients[i - 1];
+        if (client.paused &&
+            scheduler_.Buffered(client.session) < kMaxBufferedInput) {
+          client.paused = false;
+          fds[i].events = POLLIN;
+        }
+        paused = paused || client.paused;
+      }
+      if (poll(fds.data(), fds.size(), paused ? 10 : -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      for (size_t i = fds.size() - 1; i > 0; --i) {
+        if (fds[i].revents == 0) {
+          continue;
+        }
+        Client &client = clients[i - 1];
+        ssize_t size = 0;
+        if (fds[i].revents & POLLIN) {
+          size = read(fds[i].fd, buffer, sizeof(buffer));
+        }
+        if (size > 0) {
+          if (scheduler_.Deliver(client.session,
+                                 std::string_view(buffer, size)) >=
+              kMaxBufferedInput) {
+            client.paused = true;
+            fds[i].events = 0;
+          }
+        } else if (size < 0 && errno == EINTR) {
+          continue;
+        } else if (size == 0 && !(fds[i].revents & (POLLHUP | POLLERR))) {
+          // the machine may still write to a client that only shut down
+          // its sending side; it is stopped once the client hangs up
+          scheduler_.CloseInput(client.session);
+          fds[i].events = 0;
+        } else {
+          // a machine left running for a client that has gone would take
+          // time slices forever
+          scheduler_.Stop(client.session);
+          fds.erase(fds.begin() + i);
+          clients.erase(clients.begin() + (i - 1));
+        }
+      }
+      if (fds[0].revents == 0) {
+        continue;
+      }
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) {
+          continue;
+        }
+        break;
+      }
+      // a client that stops reading is hung up on rather than stalling
+      // every other session
+      struct timeval timeout = {1, 0};
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      auto connection = std::make_shared<Connection>(fd);
+      fds.push_back({fd, POLLIN, 0});
+      clients.push_back({Open(connection), connection});
+    }
+    scheduler_.Stop();
+  }
+
+  // Starts a machine on the images for a new client.
+  int Open(std::shared_ptr<Connection> connection) {
+    auto sim = std::make_unique<Simulator>(
+        nullptr, options_.map_images ? image_.get() : nullptr);
+    Configure(*sim, options_);
+    if (!options_.map_images) {
+      sim->CopyImage(*image_);
+    }
+    // registered before the machine can run, so no output is lost
+    std::lock_guard<std::mutex> lock(mutex_);
+    int session = scheduler_.Start(std::move(sim));
+    connections_.emplace(session, std::move(connection));
+    return session;
+  }
+
+  void Write(int session, const char *data, size_t size) {
+    std::shared_ptr<Connection> connection;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = connections_.find(session);
+      if (it == connections_.end()) {
+        return;
+      }
+      connection = it->second;
+    }
+    if (!WriteFull(connection->fd, data, size)) {
+      shutdown(connection->fd, SHUT_RDWR);
+      scheduler_.Stop(session);
+    }
+  }
+
+  // Hangs up once the machine stops; Poll() then drops the client.
+  void Close(int session) {
+    std::shared_ptr<Connection> connection;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = connections_.find(session);
+      if (it == connections_.end()) {
+        return;
+      }
+      connection = std::move(it->second);
+      connections_.erase(it);
+    }
+    shutdown(connection->fd, SHUT_RDWR);
+  }
+
+  const Options &options_;
+  ImageCache cache_;
+  std::shared_ptr<const ImageCache::Image> image_;
+
+  std::mutex mutex_;  // guards connections_
+  std::map<int, std::shared_ptr<Connection>> connections_;  // by session
+
+  Scheduler scheduler_;  // destroyed first, with any sessions still open
+};
+
 int main(int argc, char **argv) {
   if (argc < 2) {
     ShowUsage(argv[0]);
     std::exit(2);
   }
 
+  Options options;
   std::vector<std::string> images;
+  std::string manifest;
+  std::string results_file = "-";
+  std::string records_file;
+  bool resume = false;
+  int processes = 1;
+  bool lockstep = false;
+  bool fork_server = false;
+  bool count = false;
+  std::string profile_file;
+  int sample_rate = 0;
+  std::string trace_file;
+  std::unique_ptr<CacheSimulator> caches;
+  bool stats = false;
+  double stats_interval = 0;
+  std::string stats_file;
+  SymbolTable symbols;
+  std::string socket_path;
+  std::string sessions_path;
+  int threads = std::thread::hardware_concurrency();
   for (int i = 1; i < argc; ++i) {
     std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
     if (arg == "-h" || arg == "--help") {
       ShowUsage(argv[0]);
       std::exit(2);
+    } else if (arg == "-g" || arg == "--guest-traps") {
+      options.guest_traps = true;
+    } else if (arg == "-t" || arg == "--trap") {
+      uint8_t vector;
+      TrapMode mode;
+      if (!has_value || !ParseTrapOption(argv[++i], &vector, &mode)) {
+        std::cerr << "invalid trap option" << std::endl;
+        ShowUsage(argv[0]);
+        std::exit(2);
+      }
+      options.trap_modes.emplace_back(vector, mode);
+    } else if ((arg == "-s" || arg == "--sandbox") && has_value) {
+      options.sandbox = argv[++i];
+    } else if ((arg == "-d" || arg == "--disk") && has_value) {
+      options.disk = argv[++i];
+    } else if ((arg == "-b" || arg == "--batch") && has_value) {
+      manifest = argv[++i];
+    } else if ((arg == "-o" || arg == "--results") && has_value) {
+      results_file = argv[++i];
+    } else if ((arg == "-R" || arg == "--records") && has_value) {
+      records_file = argv[++i];
+    } else if (arg == "--resume") {
+      resume = true;
+    } else if (arg == "--map-images") {
+      options.map_images = true;
+    } else if ((arg == "-P" || arg == "--processes") && has_value) {
+      processes = std::atoi(argv[++i]);
+    } else if ((arg == "-S" || arg == "--serve") && has_value) {
+      socket_path = argv[++i];
+    } else if ((arg == "-I" || arg == "--sessions") && has_value) {
+      sessions_path = argv[++i];
+    } else if (arg == "-F" || arg == "--fork-server") {
+      fork_server = true;
+    } else if ((arg == "-p" || arg == "--profile") && has_value) {
+      profile_file = argv[++i];
+    } else if ((arg == "-T" || arg == "--trace") && has_value) {
+      trace_file = argv[++i];
+    } else if (arg == "--sample" && has_value) {
+      sample_rate = std::atoi(argv[++i]);
+    } else if ((arg == "-y" || arg == "--symbols") && has_value) {
+      if (!symbols.Read(argv[++i])) {
+        std::cerr << "cannot read " << argv[i] << std::endl;
+        std::exit(2);
+      }
+    } else if (arg == "--cache" && has_value) {
+      CacheLevel level;
+      CacheConfig config;
+      if (!ParseCacheSpec(argv[++i], &level, &config)) {
+        std::cerr << "invalid cache option" << std::endl;
+        ShowUsage(argv[0]);
+        std::exit(2);
+      }
+      if (!caches) {
+        caches.reset(new CacheSimulator());
+      }
+      caches->Configure(level, config);
+    } else if (arg == "--stats") {
+      stats = true;
+    } else if (arg == "--stats-interval" && has_value) {
+      stats = true;
+      stats_interval = std::atof(argv[++i]);
+    } else if (arg == "--stats-file" && has_value) {
+      stats = true;
+      stats_file = argv[++i];
+    } else if (arg == "-c" || arg == "--count") {
+      count = true;
+    } else if (arg == "-l" || arg == "--lockstep") {
+      lockstep = true;
+    } else if ((arg == "-j" || arg == "--jobs") && has_value) {
+      threads = std::atoi(argv[++i]);
+    } else if (arg[0] == '-' && arg.size() > 1) {
+      ShowUsage(argv[0]);
+      std::exit(2);
+    } else {
+      images.push_back(arg);
     }
-    images.push_back(arg);
+  }
+
+  if (resume && (manifest.empty() || records_file.empty())) {
+    // without records there is nothing to resume from
+    std::cerr << "--resume needs --batch and --records" << std::endl;
+    return 2;
+  }
+  if (!manifest.empty()) {
+    if (!options.disk.empty()) {
+      // every job would run its own I/O thread on the same image
+      std::cerr << "--disk cannot be used with --batch" << std::endl;
+      return 2;
+    }
+    return RunBatch(manifest, results_file, records_file, resume, processes,
+                    threads, lockstep, options);
+  }
+  if (!socket_path.empty()) {
+    if (!options.disk.empty()) {
+      std::cerr << "--disk cannot be used with --serve" << std::endl;
+      return 2;
+    }
+    return JobServer(threads, options).Serve(socket_path);
+  }
+  if (!sessions_path.empty()) {
+    if (!options.disk.empty()) {
+      // every session would run its own I/O thread on the same image
+      std::cerr << "--disk cannot be used with --sessions" << std::endl;
+      return 2;
+    }
+    return SessionServer(options).Serve(images, sessions_path);
+  }
+  if (fork_server) {
+    return RunForkServer(images, options);
   }
 
   Simulator sim;
+  if (!Configure(sim, options)) {
+    std::exit(2);
+  }
   for (auto &image : images) {
     if (!sim.ReadImage(image)) {
       exit(2);
     }
   }
 
-  signal(SIGINT, HandleInterrupt);
-  DisableInputBuffering();
-
-  sim.Run();
+  // without SA_RESTART, so that a GETC blocked on the terminal returns
+  interrupt_target = &sim;
+  struct sigaction action = {};
+  action.sa_handler = HandleInterrupt;
+  sigaction(SIGINT, &action, nullptr);
 
-  RestoreInputBuffering();
+  InstructionCounters counters;
+  std::unique_ptr<RunStatistics> statistics;
+  StdioConsole console(stdin, stdout);
+  if (stats) {
+    statistics.reset(new RunStatistics(sim, stats_interval, stats_file));
+    sim.SetConsole(statistics->Wrap(console.console()));
+    // with SA_RESTART, so that a report does not interrupt a GETC
+    struct sigaction report_action = {};
+    report_action.sa_handler = HandleReportRequest;
+    report_action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &report_action, nullptr);
+  } else {
+    sim.SetConsole(console.console());
+  }
+  std::unique_ptr<SamplingProfiler> sampler;
+  if (sample_rate) {
+    sampler = std::make_unique<SamplingProfiler>(&sim);
+    if (!sampler->Start(sample_rate)) {
+      std::cerr << "cannot start the sampling profiler" << std::endl;
+      return 2;
+    }
+  }
+  CallProfiler profiler;
+  bool profile = !profile_file.empty();
+  TraceRecorder recorder;
+  bool trace = !trace_file.empty();
+  if (trace && !recorder.Open(trace_file)) {
+    std::cerr << "cannot write " << trace_file << std::endl;
+    return 2;
+  }
+  StopReason reason;
+  {
+    RawTerminal terminal;
+    NullObserver none;
+    do {
+      reason = RunObserved(
+          sim,
+          statistics ? statistics->deadline()
+                     : RunStatistics::Clock::time_point::max(),
+          none, count ? &counters : nullptr,
+          profile ? &profiler : nullptr, trace ? &recorder : nullptr,
+          caches.get());
+      if (statistics && reason == StopReason::kBudgetExhausted) {
+        statistics->Poll();
+      }
+    } while (reason == StopReason::kBudgetExhausted);
+  }
+  if (statistics) {
+    statistics->Report();
+  }
+  if (sampler) {
+    sampler->Stop();
+  }
+  if (trace && !recorder.Finish()) {
+    std::cerr << "cannot write " << trace_file << std::endl;
+  }
+  if (count) {
+    PrintCounters(counters);
+  }
+  if (sampler) {
+    sampler->WriteHistogram(std::cerr, symbols);
+  }
+  if (caches) {
+    caches->WriteReport(std::cerr, symbols);
+  }
+  if (profile) {
+    std::ofstream file(profile_file);
+    profiler.WriteFoldedStacks(file, symbols);
+    if (!file) {
+      std::cerr << "cannot write " << profile_file << std::endl;
+    }
+    profiler.WriteFunctions(std::cerr, symbols);
+  }
 
+  if (reason == StopReason::kStopRequested) {
+    std::cerr << std::endl;
+    return -2;
+  }
+  if (reason == StopReason::kFault) {
+    std::cerr << sim.error() << std::endl;
+    return 1;
+  }
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,548 @@
+// Summarizes execution traces recorded with lc3sim --trace.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "isa.h"
+#include "profiler.h"
+#include "trace.h"
+
+namespace {
+
+void ShowUsage(const std::string &program) {
+  std::cerr << "usage: " << program << " [option] ... TRACE\n"
+            << "Options and arguments:\n"
+            << "\t-j, --jobs N\t\tDecode on N threads\n"
+            << "\t-n, --top N\t\tList the N hottest blocks, branches and "
+               "loops\n"
+            << "\t-y, --symbols FILE\tName guest addresses by the labels "
+               "in FILE\n"
+            << "\t-h, --help\t\tShow this help message" << std::endl;
+}
+
+constexpr uint32_t kNoAddress = 0x10000;
+
+// The ends of each chunk of the mapped trace.
+struct Chunk {
+  const uint8_t *begin;
+  const uint8_t *end;
+  uint32_t records;
+};
+
+// Statistics that do not depend on the order of the chunks, summed by
+// each thread over the chunks it decodes.
+struct Totals {
+  uint64_t records = 0;
+  std::array<uint64_t, 16> opcodes{};
+  std::array<uint64_t, 256> traps{};
+  std::vector<uint64_t> block_entries = std::vector<uint64_t>(kMemorySize);
+  std::vector<uint64_t> block_instructions =
+      std::vector<uint64_t>(kMemorySize);
+  std::vector<uint64_t> branches = std::vector<uint64_t>(kMemorySize);
+  std::vector<uint64_t> taken = std::vector<uint64_t>(kMemorySize);
+  std::vector<uint64_t> loop_runs = std::vector<uint64_t>(kMemorySize);
+  std::vector<uint64_t> loop_trips = std::vector<uint64_t>(kMemorySize);
+  std::vector<uint64_t> loop_max = std::vector<uint64_t>(kMemorySize);
+
+  void Add(const Totals &other) {
+    records += other.records;
+    for (size_t i = 0; i < opcodes.size(); ++i) {
+      opcodes[i] += other.opcodes[i];
+    }
+    for (size_t i = 0; i < traps.size(); ++i) {
+      traps[i] += other.traps[i];
+    }
+    for (size_t pc = 0; pc < kMemorySize; ++pc) {
+      block_entries[pc] += other.block_entries[pc];
+      block_instructions[pc] += other.block_instructions[pc];
+      branches[pc] += other.branches[pc];
+      taken[pc] += other.taken[pc];
+      loop_runs[pc] += other.loop_runs[pc];
+      loop_trips[pc] += other.loop_trips[pc];
+      loop_max[pc] = std::max(loop_max[pc], other.loop_max[pc]);
+    }
+  }
+
+  void AddLoopRun(uint16_t pc, uint64_t trips) {
+    ++loop_runs[pc];
+    loop_trips[pc] += trips;
+    loop_max[pc] = std::max(loop_max[pc], trips);
+  }
+};
+
+// A backward branch's taken streaks at the ends of a chunk, which continue
+// in the neighbouring chunks.
+struct LoopEnds {
+  uint64_t leading = 0;   // taken before the first fall-through
+  bool exited = false;    // fell through at least once
+  uint64_t trailing = 0;  // taken after the last fall-through
+};
+
+// What a chunk leaves for the in-order pass.
+struct ChunkResult {
+  bool ok = true;
+  // records before the chunk's first block entry, which belong to the
+  // block open at the end of the previous chunk
+  uint64_t head = 0;
+  uint32_t open_block = kNoAddress;  // the block open at the end
+  std::unordered_map<uint16_t, LoopEnds> loops;
+  std::vector<uint16_t> accesses;  // data addresses in order
+};
+
+// Decodes the first record of a chunk, which needs no earlier state.
+bool FirstRecord(const Chunk &chunk, TraceRecord *record) {
+  TraceCodec codec;
+  codec.Reset();
+  const uint8_t *in = chunk.begin;
+  return chunk.records && codec.Decode(&in, chunk.end, record);
+}
+
+// Decodes chunk and adds it up. next is the chunk after it, if any: its
+// first record tells where this chunk's last instruction went.
+void Analyze(const Chunk &chunk, const Chunk *next, bool first,
+             TraceCodec *codec, Totals *totals, ChunkResult *result) {
+  if (!chunk.records) {
+    return;
+  }
+  codec->Reset();
+  const uint8_t *in = chunk.begin;
+  TraceRecord record = {}, successor = {};
+  uint32_t block = kNoAddress;
+  bool have_record = false;
+  for (uint32_t i = 0; i <= chunk.records; ++i) {
+    bool known = true;
+    if (i < chunk.records) {
+      if (in == chunk.end || !codec->Decode(&in, chunk.end, &successor)) {
+        result->ok = false;
+        return;
+      }
+    } else {
+      known = next && FirstRecord(*next, &successor);
+    }
+    if (!have_record) {
+      // the trace's first instruction enters a block
+      if (first) {
+        block = successor.pc;
+        ++totals->block_entries[block];
+      }
+      record = successor;
+      have_record = true;
+      continue;
+    }
+
+    // record is complete now that its successor is known
+    ++totals->records;
+    uint16_t op = record.instr >> 12;
+    ++totals->opcodes[op];
+    if (op == kTRAP) {
+      ++totals->traps[TrapVector(record.instr)];
+    }
+    if (block == kNoAddress) {
+      ++result->head;
+    } else {
+      ++totals->block_instructions[block];
+    }
+    switch (op) {
+      case kLDI:
+      case kSTI:
+        result->accesses.push_back(record.pc + 1 + PCOffset9(record.instr));
+        [[fallthrough]];
+      case kLD:
+      case kLDR:
+      case kST:
+      case kSTR:
+        result->accesses.push_back(record.address);
+        break;
+    }
+    if (EndsBlock(record.instr) && known) {
+      block = successor.pc;
+      ++totals->block_entries[block];
+    }
+    if (op == kBR && known) {
+      uint16_t pc = record.pc;
+      bool taken = successor.pc != static_cast<uint16_t>(pc + 1);
+      ++totals->branches[pc];
+      totals->taken[pc] += taken;
+      if (static_cast<int16_t>(PCOffset9(record.instr)) < 0) {
+        LoopEnds &loop = result->loops[pc];
+        if (taken) {
+          ++(loop.exited ? loop.trailing : loop.leading);
+        } else if (loop.exited) {
+          totals->AddLoopRun(pc, loop.trailing + 1);
+          loop.trailing = 0;
+        } else {
+          loop.exited = true;
+        }
+      }
+    }
+    record = successor;
+    if (i == chunk.records) {
+      break;
+    }
+  }
+  result->open_block = block;
+}
+
+// LRU stack distances of an address stream: how many other addresses were
+// used since the last use of the same one. Counts marks over access times
+// in a Fenwick tree, with one mark at each address's latest use.
+class ReuseDistances {
+ public:
+  // The last bucket counts first uses; bucket b > 0 counts distances in
+  // [2^(b-1), 2^b).
+  static constexpr int kBuckets = 19;
+
+  ReuseDistances() : last_(kMemorySize, -1), tree_(kWindow + 1) {}
+
+  void Access(uint16_t address) {
+    if (now_ == kWindow) {
+      Compact();
+    }
+    int32_t last = last_[address];
+    if (last < 0) {
+      ++histogram_[kBuckets - 1];
+    } else {
+      uint32_t distance = live_ - Sum(last + 1);
+      int bucket = 0;
+      while (distance >> bucket) {
+        ++bucket;
+      }
+      ++histogram_[bucket];
+      Update(last + 1, -1);
+      --live_;
+    }
+    last_[address] = now_;
+    Update(now_ + 1, 1);
+    ++live_;
+    ++now_;
+  }
+
+  const std::array<uint64_t, kBuckets> &histogram() const {
+    return histogram_;
+  }
+
+ private:
+  static constexpr int32_t kWindow = 1 << 20;  // times before renumbering
+
+  // marks at times [0, n)
+  int32_t Sum(int32_t n) const {
+    int32_t sum = 0;
+    for (; n > 0; n -= n & -n) {
+      sum += tree_[n];
+    }
+    return sum;
+  }
+
+  void Update(int32_t i, int32_t delta) {
+    for (; i <= kWindow; i += i & -i) {
+      tree_[i] += delta;
+    }
+  }
+
+  // Renumbers the marks 0, 1, ..., keeping their order.
+  void Compact() {
+    std::vector<std::pair<int32_t, uint16_t>> marks;
+    for (size_t address = 0; address < kMemorySize; ++address) {
+      if (last_[address] >= 0) {
+        marks.emplace_back(last_[address], address);
+      }
+    }
+    std::sort(marks.begin(), marks.end());
+    std::fill(tree_.begin(), tree_.end(), 0);
+    now_ = 0;
+    for (auto &[time, address] : marks) {
+      last_[address] = now_;
+      Update(now_ + 1, 1);
+      ++now_;
+    }
+  }
+
+  std::vector<int32_t> last_;  // each address's latest use, or -1
+  std::vector<int32_t> tree_;
+  int32_t now_ = 0;
+  int32_t live_ = 0;
+  std::array<uint64_t, kBuckets> histogram_{};
+};
+
+// The addresses with the largest values, largest first.
+std::vector<uint16_t> Top(const std::vector<uint64_t> &values, size_t n) {
+  std::vector<uint16_t> addresses;
+  for (size_t pc = 0; pc < values.size(); ++pc) {
+    if (values[pc]) {
+      addresses.push_back(pc);
+    }
+  }
+  auto by_value = [&](uint16_t a, uint16_t b) { return values[a] > values[b]; };
+  n = std::min(n, addresses.size());
+  std::partial_sort(addresses.begin(), addresses.begin() + n, addresses.end(),
+                    by_value);
+  addresses.resize(n);
+  return addresses;
+}
+
+void Report(const Totals &totals, const ReuseDistances &reuse, size_t top,
+            const SymbolTable &symbols) {
+  auto share = [](uint64_t n, uint64_t total) {
+    return total ? 100.0 * n / total : 0.0;
+  };
+  std::printf("%llu instructions\n",
+              static_cast<unsigned long long>(totals.records));
+
+  std::printf("\ninstruction mix:\n");
+  for (int op = 0; op < 16; ++op) {
+    if (totals.opcodes[op]) {
+      std::printf("%-8s %14llu %6.2f%%\n", OpCodeName(op),
+                  static_cast<unsigned long long>(totals.opcodes[op]),
+                  share(totals.opcodes[op], totals.records));
+    }
+  }
+  for (int vector = 0; vector < 256; ++vector) {
+    if (totals.traps[vector]) {
+      std::printf("TRAP x%02X %14llu %6.2f%%\n", vector,
+                  static_cast<unsigned long long>(totals.traps[vector]),
+                  share(totals.traps[vector], totals.records));
+    }
+  }
+
+  std::printf("\nhottest blocks:\n%14s %14s %7s  %s\n", "instructions",
+              "entries", "share", "block");
+  for (uint16_t pc : Top(totals.block_instructions, top)) {
+    std::printf("%14llu %14llu %6.2f%%  %s\n",
+                static_cast<unsigned long long>(totals.block_instructions[pc]),
+                static_cast<unsigned long long>(totals.block_entries[pc]),
+                share(totals.block_instructions[pc], totals.records),
+                symbols.Locate(pc).c_str());
+  }
+
+  std::printf("\nbranches:\n%14s %7s  %s\n", "executed", "taken", "branch");
+  for (uint16_t pc : Top(totals.branches, top)) {
+    std::printf("%14llu %6.2f%%  %s\n",
+                static_cast<unsigned long long>(totals.branches[pc]),
+                share(totals.taken[pc], totals.branches[pc]),
+                symbols.Locate(pc).c_str());
+  }
+
+  std::printf("\nloops (by backward branch):\n%14s %14s %10s  %s\n", "runs",
+              "mean trips", "max trips", "branch");
+  for (uint16_t pc : Top(totals.loop_trips, top)) {
+    std::printf("%14llu %14.1f %10llu  %s\n",
+                static_cast<unsigned long long>(totals.loop_runs[pc]),
+                static_cast<double>(totals.loop_trips[pc]) /
+                    totals.loop_runs[pc],
+                static_cast<unsigned long long>(totals.loop_max[pc]),
+                symbols.Locate(pc).c_str());
+  }
+
+  const auto &histogram = reuse.histogram();
+  uint64_t accesses = 0;
+  for (uint64_t n : histogram) {
+    accesses += n;
+  }
+  std::printf("\nreuse distances of %llu data accesses:\n",
+              static_cast<unsigned long long>(accesses));
+  for (int b = 0; b < ReuseDistances::kBuckets; ++b) {
+    if (!histogram[b]) {
+      continue;
+    }
+    char range[32];
+    if (b == ReuseDistances::kBuckets - 1) {
+      std::snprintf(range, sizeof(range), "first use");
+    } else if (b == 0) {
+      std::snprintf(range, sizeof(range), "0");
+    } else {
+      std::snprintf(range, sizeof(range), "%u-%u", 1u << (b - 1),
+                    (1u << b) - 1);
+    }
+    std::printf("%14s %14llu %6.2f%%\n", range,
+                static_cast<unsigned long long>(histogram[b]),
+                share(histogram[b], accesses));
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int threads = std::thread::hardware_concurrency();
+  size_t top = 20;
+  SymbolTable symbols;
+  std::string filename;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if ((arg == "-j" || arg == "--jobs") && has_value) {
+      threads = std::atoi(argv[++i]);
+    } else if ((arg == "-n" || arg == "--top") && has_value) {
+      top = std::atoi(argv[++i]);
+    } else if ((arg == "-y" || arg == "--symbols") && has_value) {
+      if (!symbols.Read(argv[++i])) {
+        std::cerr << "cannot read " << argv[i] << std::endl;
+        return 2;
+      }
+    } else if (arg[0] == '-' || !filename.empty()) {
+      ShowUsage(argv[0]);
+      return 2;
+    } else {
+      filename = arg;
+    }
+  }
+  if (filename.empty()) {
+    ShowUsage(argv[0]);
+    return 2;
+  }
+  threads = std::max(threads, 1);
+
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    std::cerr << "cannot open " << filename << std::endl;
+    return 2;
+  }
+  size_t size = info.st_size;
+  void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                    : MAP_FAILED;
+  close(fd);
+  TraceFileHeader header;
+  if (data == MAP_FAILED || size < sizeof(header) ||
+      (std::memcpy(&header, data, sizeof(header)),
+       std::memcmp(header.magic, kTraceMagic, sizeof(kTraceMagic)) != 0)) {
+    std::cerr << filename << " is not a trace" << std::endl;
+    return 2;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  // the chunk headers chain through the file
+  std::vector<Chunk> chunks;
+  const uint8_t *in = static_cast<const uint8_t *>(data) + sizeof(header);
+  const uint8_t *end = static_cast<const uint8_t *>(data) + size;
+  while (end - in >= static_cast<ptrdiff_t>(sizeof(TraceChunkHeader))) {
+    TraceChunkHeader chunk;
+    std::memcpy(&chunk, in, sizeof(chunk));
+    in += sizeof(chunk);
+    if (chunk.size > static_cast<size_t>(end - in)) {
+      break;
+    }
+    chunks.push_back({in, in + chunk.size, chunk.records});
+    in += chunk.size;
+  }
+  if (in != end) {
+    std::cerr << filename << " is truncated; reading the complete chunks"
+              << std::endl;
+  }
+
+  // Threads decode chunks in any order, but no further ahead of the
+  // in-order pass, which this thread runs, than lookahead chunks, so that
+  // the buffered accesses stay bounded.
+  const size_t lookahead = 4 * threads;
+  std::vector<Totals> totals(threads);
+  std::vector<ChunkResult> results(chunks.size());
+  std::vector<char> ready(chunks.size());
+  std::atomic<size_t> claimed{0};
+  size_t merged = 0;
+  std::mutex mutex;
+  std::condition_variable progress;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      TraceCodec codec;
+      while (true) {
+        size_t i = claimed.fetch_add(1);
+        if (i >= chunks.size()) {
+          return;
+        }
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          progress.wait(lock, [&] { return i < merged + lookahead; });
+        }
+        const Chunk *next = i + 1 < chunks.size() ? &chunks[i + 1] : nullptr;
+        Analyze(chunks[i], next, i == 0, &codec, &totals[t], &results[i]);
+        std::lock_guard<std::mutex> lock(mutex);
+        ready[i] = true;
+        progress.notify_all();
+      }
+    });
+  }
+
+  ReuseDistances reuse;
+  std::vector<uint64_t> block_heads(kMemorySize);
+  std::unordered_map<uint16_t, uint64_t> streaks;  // loops running on
+  uint32_t open_block = kNoAddress;
+  bool ok = true;
+  std::vector<std::pair<uint16_t, uint64_t>> finished_runs;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      progress.wait(lock, [&] { return ready[i] != 0; });
+    }
+    ChunkResult &result = results[i];
+    ok = ok && result.ok;
+    if (open_block != kNoAddress) {
+      block_heads[open_block] += result.head;
+    }
+    if (result.open_block != kNoAddress) {
+      open_block = result.open_block;
+    }
+    for (auto &[pc, loop] : result.loops) {
+      uint64_t &streak = streaks[pc];
+      if (loop.exited) {
+        finished_runs.emplace_back(pc, streak + loop.leading + 1);
+        streak = loop.trailing;
+      } else {
+        streak += loop.leading;
+      }
+    }
+    for (uint16_t address : result.accesses) {
+      reuse.Access(address);
+    }
+    result = ChunkResult();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++merged;
+      progress.notify_all();
+    }
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  Totals &sum = totals[0];
+  for (int t = 1; t < threads; ++t) {
+    sum.Add(totals[t]);
+  }
+  for (size_t pc = 0; pc < kMemorySize; ++pc) {
+    sum.block_instructions[pc] += block_heads[pc];
+  }
+  for (auto &[pc, trips] : finished_runs) {
+    sum.AddLoopRun(pc, trips);
+  }
+  // A loop still running when the trace ended counts the iteration in
+  // progress, as a finished run counts the one that fell through. Runs
+  // that never took the branch yet cannot be told from straight-line code.
+  for (auto &[pc, streak] : streaks) {
+    if (streak) {
+      sum.AddLoopRun(pc, streak + 1);
+    }
+  }
+  munmap(data, size);
+
+  if (!ok) {
+    std::cerr << filename << " is corrupt" << std::endl;
+    return 1;
+  }
+  Report(sum, reuse, top, symbols);
+  return 0;
+}
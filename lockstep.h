@@ -0,0 +1,471 @@
+#ifndef LC3_LOCKSTEP_H_
+#define LC3_LOCKSTEP_H_
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "isa.h"
+#include "memory_pool.h"
+
+// Lanes of 16-bit guest words, one per VM: a 32-byte vector is one AVX2
+// register. Wider vectors are split element by element by GCC on AVX2
+// hosts, which is far slower than running two groups. Comparisons yield
+// all-ones lane masks.
+//
+// Only AVX2 and baseline x86-64 code is built; AVX-512 hosts run the AVX2
+// clone. An AVX-512 clone is not built because target_clones picks it by
+// CPU model, and virtualized CPUs that report a generic model would never
+// select it.
+constexpr int kLanes = 16;
+typedef uint16_t LaneWords
+    __attribute__((vector_size(kLanes * sizeof(uint16_t))));
+typedef int16_t LaneMask
+    __attribute__((vector_size(kLanes * sizeof(uint16_t))));
+
+// Lane instruction counters are 16 bits wide, so they are folded into the
+// 64-bit totals after at most this many steps.
+constexpr uint64_t kLaneFlushInterval = 0x4000;
+
+// Runs many VMs loaded with the same images in lockstep. Registers are
+// stored as structure-of-arrays lane vectors, and each step executes one
+// instruction for every VM whose PC equals the smallest live PC, so VMs
+// that diverge at a branch reconverge when the lagging ones catch up.
+// Register and PC updates are vector operations under the lane mask;
+// memory accesses and traps are done per lane.
+//
+// As in Simulator::Run(), a VM's instruction limit is only checked at
+// block boundaries: a VM that reaches it stops with LaneStatus::kLimit
+// once it has executed its next control transfer, unless it halts first.
+//
+// Only user-mode programs using the console traps are supported. A VM
+// that needs anything else (interrupts, RTI, other traps, the disk) stops
+// with LaneStatus::kUnsupported so that the caller can rerun it on a
+// Simulator.
+class LockstepEngine {
+ public:
+  enum class LaneStatus { kRunning, kHalted, kLimit, kUnsupported };
+
+  explicit LockstepEngine(int lanes)
+      : lanes_(lanes),
+        groups_((lanes + kLanes - 1) / kLanes),
+        image_(kMemorySize),
+        memory_(lanes * kMemoryBytes),
+        written_(kMemorySize / 64),
+        states_(lanes) {
+    image_[kDSR] = kReady;
+    image_[kMCR] = kClockEnable;
+  }
+
+  LockstepEngine(const LockstepEngine &) = delete;
+  LockstepEngine &operator=(LockstepEngine &) = delete;
+
+  bool ReadImage(const std::string &filename) {
+    return LoadImage(filename, image_.data());
+  }
+
+  void SetInput(int lane, std::string input) {
+    states_[lane].input = std::move(input);
+  }
+
+  void SetLimit(int lane, uint64_t max_instructions) {
+    states_[lane].limit = max_instructions;
+  }
+
+  LaneStatus status(int lane) const { return states_[lane].status; }
+  const std::string &output(int lane) const { return states_[lane].output; }
+  uint64_t instructions(int lane) const { return states_[lane].instructions; }
+
+  void Run() {
+    for (int lane = 0; lane < lanes_; ++lane) {
+      std::copy(image_.begin(), image_.end(), LaneMemory(lane));
+    }
+    for (size_t g = 0; g < groups_.size(); ++g) {
+      Group &group = groups_[g];
+      group = Group();
+      group.pc = Broadcast(kPCStart);
+      group.cond = Broadcast(kZero);
+      for (int l = 0; l < kLanes; ++l) {
+        group.live[l] = g * kLanes + l < static_cast<size_t>(lanes_);
+      }
+      group.live = -group.live;  // 1 -> all ones
+      for (int l = 0; l < kLanes; ++l) {
+        if (group.live[l] && !states_[LaneIndex(group, l)].limit) {
+          Stop(group, l, LaneStatus::kLimit);
+        }
+      }
+    }
+    Execute();
+    FlushCounters();
+  }
+
+ private:
+  struct alignas(64) Group {
+    LaneWords reg[8];
+    LaneWords pc;
+    LaneWords cond;
+    LaneWords live;      // all ones while the lane's VM is running
+    LaneWords executed;  // instructions since the last flush
+    LaneWords boundary;  // all ones if the last instruction ended a block
+    LaneWords expired;   // all ones once the limit is reached
+  };
+
+  struct LaneState {
+    std::string input;
+    size_t input_position = 0;
+    std::string output;
+    uint64_t limit = UINT64_MAX;
+    uint64_t instructions = 0;
+    LaneStatus status = LaneStatus::kRunning;
+  };
+
+  __attribute__((always_inline)) static bool Any(const LaneWords &m) {
+    uint64_t parts[sizeof(m) / sizeof(uint64_t)];
+    std::memcpy(parts, &m, sizeof(m));
+    uint64_t any = 0;
+    for (uint64_t part : parts) any |= part;
+    return any != 0;
+  }
+
+  __attribute__((always_inline)) static LaneWords Broadcast(uint16_t x) {
+    return LaneWords{} + x;
+  }
+
+  __attribute__((always_inline)) static LaneWords Select(
+      const LaneWords &m, const LaneWords &a, const LaneWords &b) {
+    return (a & m) | (b & ~m);
+  }
+
+  __attribute__((always_inline)) static LaneWords Flags(const LaneWords &v) {
+    LaneWords negative = (LaneWords)(((LaneMask)v) < 0);
+    LaneWords zero = (LaneWords)(v == 0);
+    return Select(zero, Broadcast(kZero),
+                  Select(negative, Broadcast(kNegative), Broadcast(kPositive)));
+  }
+
+  uint16_t *LaneMemory(int lane) {
+    return static_cast<uint16_t *>(memory_.data()) + lane * kMemorySize;
+  }
+
+  __attribute__((always_inline)) bool MinLivePC(uint16_t *pc) {
+    LaneWords any{};
+    LaneWords min = Broadcast(0xFFFF);
+    for (auto &group : groups_) {
+      LaneWords candidate = Select(group.live, group.pc, min);
+      min = candidate < min ? candidate : min;
+      any |= group.live;
+    }
+    if (!Any(any)) {
+      return false;
+    }
+    *pc = 0xFFFF;
+    for (int l = 0; l < kLanes; ++l) *pc = std::min<uint16_t>(*pc, min[l]);
+    return true;
+  }
+
+  void Stop(Group &group, int l, LaneStatus status) {
+    group.live[l] = 0;
+    states_[LaneIndex(group, l)].status = status;
+  }
+
+  int LaneIndex(const Group &group, int l) const {
+    return (&group - groups_.data()) * kLanes + l;
+  }
+
+  void FlushCounters() {
+    for (auto &group : groups_) {
+      for (int l = 0; l < kLanes; ++l) {
+        if (!group.executed[l]) continue;
+        LaneState &state = states_[LaneIndex(group, l)];
+        state.instructions += group.executed[l];
+        if (group.live[l] && state.instructions >= state.limit) {
+          if (group.boundary[l]) {
+            Stop(group, l, LaneStatus::kLimit);
+          } else {
+            group.expired[l] = 0xFFFF;  // stops at the end of its block
+          }
+        }
+      }
+      group.executed = LaneWords{};
+    }
+  }
+
+  bool Written(uint16_t address) const {
+    return (written_[address / 64] >> (address % 64)) & 1;
+  }
+
+  uint16_t LaneRead(Group &group, int l, uint16_t address) {
+    int lane = LaneIndex(group, l);
+    uint16_t *memory = LaneMemory(lane);
+    if (address >= kMMIOBase) {
+      if (address == kKBSR && !(memory[kKBSR] & kReady)) {
+        memory[kKBDR] = LaneGetc(lane);
+        memory[kKBSR] |= kReady;
+      } else if (address == kKBDR) {
+        memory[kKBSR] &= ~kReady;
+      }
+    }
+    return memory[address];
+  }
+
+  void LaneWrite(Group &group, int l, uint16_t address, uint16_t x) {
+    int lane = LaneIndex(group, l);
+    uint16_t *memory = LaneMemory(lane);
+    if (address >= kMMIOBase) {
+      switch (address) {
+        case kKBSR:
+        case kDKSR:
+          if (x & kInterruptEnable) {
+            Stop(group, l, LaneStatus::kUnsupported);
+          }
+          return;
+        case kDKCR:  // the disk is not modelled here
+          Stop(group, l, LaneStatus::kUnsupported);
+          return;
+        case kDDR:
+          states_[lane].output.push_back(static_cast<char>(x));
+          return;
+        case kMCR:
+          if (!(x & kClockEnable)) {
+            Stop(group, l, LaneStatus::kHalted);
+          }
+          break;
+      }
+    }
+    memory[address] = x;
+    written_[address / 64] |= uint64_t{1} << (address % 64);
+  }
+
+  int LaneGetc(int lane) {
+    LaneState &state = states_[lane];
+    if (state.input_position == state.input.size()) {
+      return EOF;
+    }
+    return static_cast<uint8_t>(state.input[state.input_position++]);
+  }
+
+  // Whether the string at R0 has a terminator. A lane whose memory holds no
+  // zero word stops, so that a Simulator reruns it and reports the fault.
+  bool LaneString(Group &group, int l) {
+    uint16_t *memory = LaneMemory(LaneIndex(group, l));
+    if (StringLength(memory, group.reg[kR0][l]) == kMemorySize) {
+      Stop(group, l, LaneStatus::kUnsupported);
+      return false;
+    }
+    return true;
+  }
+
+  void LaneTrap(Group &group, int l, uint8_t vector) {
+    int lane = LaneIndex(group, l);
+    uint16_t *memory = LaneMemory(lane);
+    std::string &output = states_[lane].output;
+    uint16_t r0 = group.reg[kR0][l];
+    switch (vector) {
+      case kGETC:
+        group.reg[kR0][l] = static_cast<uint16_t>(LaneGetc(lane));
+        break;
+      case kOUT:
+        output.push_back(static_cast<char>(r0));
+        break;
+      case kPUTS:
+        if (!LaneString(group, l)) break;
+        for (uint16_t a = r0; memory[a]; ++a) {
+          output.push_back(static_cast<char>(memory[a]));
+        }
+        break;
+      case kIN: {
+        output += "Enter a character: ";
+        int c = LaneGetc(lane);
+        output.push_back(static_cast<char>(c));
+        group.reg[kR0][l] = static_cast<uint16_t>(c);
+      } break;
+      case kPUTSP:
+        if (!LaneString(group, l)) break;
+        for (uint16_t a = r0; memory[a]; ++a) {
+          output.push_back(static_cast<char>(memory[a] & 0xFF));
+          if (memory[a] >> 8) {
+            output.push_back(static_cast<char>(memory[a] >> 8));
+          }
+        }
+        break;
+      case kHALT:
+        output += "HALT\n";
+        Stop(group, l, LaneStatus::kHalted);
+        break;
+      default:
+        Stop(group, l, LaneStatus::kUnsupported);
+        break;
+    }
+  }
+
+  // The whole step loop is cloned per instruction set and chosen at load
+  // time, so a generic build still uses AVX2 where the host has it.
+  __attribute__((target_clones("avx2", "default")))
+  void Execute() {
+    uint64_t steps = 0;
+    uint64_t flush_at = FlushInterval();
+    uint16_t pc;
+    while (MinLivePC(&pc)) {
+      Step(pc);
+      if (++steps == flush_at) {
+        FlushCounters();
+        steps = 0;
+        flush_at = FlushInterval();
+      }
+    }
+  }
+
+  // Steps until the next flush. A lane runs at most one instruction per
+  // step, so flushing no later than the smallest remaining budget notices
+  // every lane as soon as it reaches its limit.
+  uint64_t FlushInterval() const {
+    uint64_t interval = kLaneFlushInterval;
+    for (const LaneState &state : states_) {
+      if (state.status == LaneStatus::kRunning &&
+          state.limit > state.instructions) {
+        interval = std::min(interval, state.limit - state.instructions);
+      }
+    }
+    return std::max<uint64_t>(interval, 1);
+  }
+
+  // Executes the instruction at pc for every live lane stopped there.
+  __attribute__((always_inline)) void Step(uint16_t pc) {
+    // Lanes only disagree about the instruction if one of them stored to pc.
+    bool check_instr = Written(pc);
+    uint16_t instr = image_[pc];
+    if (check_instr) {
+      for (auto &group : groups_) {
+        LaneWords m = (LaneWords)(group.pc == pc) & group.live;
+        int l = 0;
+        while (l < kLanes && !m[l]) ++l;
+        if (l < kLanes) {
+          instr = LaneMemory(LaneIndex(group, l))[pc];
+          break;
+        }
+      }
+    }
+
+    uint16_t op = instr >> 12;
+    uint16_t r0 = RegisterField(instr);
+    uint16_t r1 = BaseField(instr);
+    uint16_t r2 = SourceField(instr);
+    uint16_t imm5 = Immediate5(instr);
+    uint16_t offset6 = Offset6(instr);
+    uint16_t offset9 = PCOffset9(instr);
+    uint16_t offset11 = PCOffset11(instr);
+    bool immediate = ImmediateFlag(instr);
+    bool ends_block = EndsBlock(instr);
+
+    for (auto &group : groups_) {
+      LaneWords m = (LaneWords)(group.pc == pc) & group.live;
+      if (!Any(m)) {
+        continue;
+      }
+      if (check_instr) {
+        for (int l = 0; l < kLanes; ++l) {
+          if (m[l] && LaneMemory(LaneIndex(group, l))[pc] != instr) m[l] = 0;
+        }
+      }
+      group.executed -= m;  // all ones is -1
+      group.boundary = Select(m, Broadcast(ends_block ? 0xFFFF : 0),
+                              group.boundary);
+      LaneWords next = group.pc + 1;
+      group.pc = Select(m, next, group.pc);
+      LaneWords *reg = group.reg;
+
+      switch (op) {
+        case kADD:
+        case kAND: {
+          LaneWords b = immediate ? Broadcast(imm5) : reg[r2];
+          LaneWords v = op == kADD ? reg[r1] + b : reg[r1] & b;
+          reg[r0] = Select(m, v, reg[r0]);
+          group.cond = Select(m, Flags(v), group.cond);
+        } break;
+
+        case kNOT: {
+          LaneWords v = ~reg[r1];
+          reg[r0] = Select(m, v, reg[r0]);
+          group.cond = Select(m, Flags(v), group.cond);
+        } break;
+
+        case kBR: {
+          LaneWords taken = (LaneWords)((group.cond & r0) != 0) & m;
+          group.pc = Select(taken, next + offset9, group.pc);
+        } break;
+
+        case kJMP:
+          group.pc = Select(m, reg[r1], group.pc);
+          break;
+
+        case kJSR: {
+          LaneWords target = LongFlag(instr) ? next + offset11 : reg[r1];
+          group.pc = Select(m, target, group.pc);
+          reg[kR7] = Select(m, next, reg[kR7]);
+        } break;
+
+        case kLEA: {
+          LaneWords v = next + offset9;
+          reg[r0] = Select(m, v, reg[r0]);
+          group.cond = Select(m, Flags(v), group.cond);
+        } break;
+
+        case kLD:
+        case kLDI:
+        case kLDR: {
+          LaneWords address = op == kLDR ? reg[r1] + offset6 : next + offset9;
+          LaneWords v = reg[r0];
+          for (int l = 0; l < kLanes; ++l) {
+            if (!m[l]) continue;
+            uint16_t a = address[l];
+            if (op == kLDI) a = LaneRead(group, l, a);
+            v[l] = LaneRead(group, l, a);
+          }
+          reg[r0] = v;
+          group.cond = Select(m, Flags(v), group.cond);
+        } break;
+
+        case kST:
+        case kSTI:
+        case kSTR: {
+          LaneWords address = op == kSTR ? reg[r1] + offset6 : next + offset9;
+          for (int l = 0; l < kLanes; ++l) {
+            if (!m[l]) continue;
+            uint16_t a = address[l];
+            if (op == kSTI) a = LaneRead(group, l, a);
+            LaneWrite(group, l, a, reg[r0][l]);
+          }
+        } break;
+
+        case kTRAP:
+          for (int l = 0; l < kLanes; ++l) {
+            if (m[l]) LaneTrap(group, l, TrapVector(instr));
+          }
+          break;
+
+        default:
+          for (int l = 0; l < kLanes; ++l) {
+            if (m[l]) Stop(group, l, LaneStatus::kUnsupported);
+          }
+          break;
+      }
+
+      LaneWords expired = m & group.expired & group.live;
+      if (ends_block && Any(expired)) {
+        for (int l = 0; l < kLanes; ++l) {
+          if (expired[l]) Stop(group, l, LaneStatus::kLimit);
+        }
+      }
+    }
+  }
+
+  int lanes_;
+  std::vector<Group> groups_;
+  std::vector<uint16_t> image_;
+  HugePageBuffer memory_;          // lanes_ consecutive 64K-word memories
+  std::vector<uint64_t> written_;  // addresses any lane has stored to
+  std::vector<LaneState> states_;
+};
+
+#endif  // LC3_LOCKSTEP_H_
@@ -0,0 +1,349 @@
+// Drives a Simulator one instruction or device access at a time and checks
+// the machine's devices, interrupts and traps. Run by "make check".
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+
+#include "simulator.h"
+
+namespace {
+
+int failures = 0;
+
+void Expect(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "machine_test: " << what << std::endl;
+    ++failures;
+  }
+}
+
+// Calls done until it returns true or five seconds have passed.
+template <typename Done>
+bool WaitFor(Done done) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// Runs a disk command and polls DKSR until it is done; returns the status.
+uint16_t DiskCommand(Simulator &sim, uint16_t command, uint16_t block,
+                     uint16_t address) {
+  sim.WriteMemory(kDKBR, block);
+  sim.WriteMemory(kDKAR, address);
+  sim.WriteMemory(kDKCR, command);
+  uint16_t status = 0;
+  WaitFor([&] { return (status = sim.ReadMemory(kDKSR)) & kDone; });
+  return status;
+}
+
+void CheckDisk(const std::string &dir) {
+  // block 1 holds the words x0100 + i, big-endian
+  std::string image(2 * kDiskBlockWords * 2, '\0');
+  for (size_t i = 0; i < kDiskBlockWords; ++i) {
+    image[(kDiskBlockWords + i) * 2] = 0x01;
+    image[(kDiskBlockWords + i) * 2 + 1] = static_cast<char>(i);
+  }
+  std::string path = dir + "/disk";
+  std::ofstream(path, std::ios::binary) << image;
+
+  Simulator sim;
+  Expect(sim.AttachDisk(path), "disk: cannot attach");
+  uint16_t status = DiskCommand(sim, kDiskRead, 1, 0x4000);
+  Expect(status == (kReady | kDone), "disk: read did not finish cleanly");
+  Expect(!(sim.ReadMemory(kDKSR) & kDone), "disk: reading DKSR kept done");
+  bool loaded = true;
+  for (size_t i = 0; i < kDiskBlockWords; ++i) {
+    loaded = loaded && sim.PeekMemory(0x4000 + i) == 0x0100 + i;
+  }
+  Expect(loaded, "disk: read loaded the wrong words");
+
+  for (size_t i = 0; i < kDiskBlockWords; ++i) {
+    sim.PokeMemory(0x5000 + i, 0xA500 + i);
+  }
+  status = DiskCommand(sim, kDiskWrite, 0, 0x5000);
+  Expect(status == (kReady | kDone), "disk: write did not finish cleanly");
+  std::ifstream file(path, std::ios::binary);
+  std::string written((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  bool stored = written.size() == image.size();
+  for (size_t i = 0; stored && i < kDiskBlockWords; ++i) {
+    stored = static_cast<uint8_t>(written[i * 2]) == 0xA5 &&
+             static_cast<uint8_t>(written[i * 2 + 1]) == i;
+  }
+  Expect(stored, "disk: write stored the wrong bytes");
+  Expect(written.compare(kDiskBlockWords * 2, std::string::npos, image,
+                         kDiskBlockWords * 2) == 0,
+         "disk: write touched another block");
+
+  Expect(DiskCommand(sim, kDiskRead, 9, 0x4000) == (kReady | kDone | kError),
+         "disk: a read past the end did not fail");
+  sim.WriteMemory(kDKAR, 0xFD80);
+  sim.WriteMemory(kDKCR, kDiskRead);
+  Expect(sim.ReadMemory(kDKSR) == (kReady | kError),
+         "disk: a transfer into the device page was not refused");
+
+  // with interrupts enabled, a user program spinning in place is interrupted
+  // at priority 5 and resumed by the handler's RTI
+  Simulator spin;
+  spin.AttachDisk(path);
+  spin.PokeMemory(kPCStart, 0x0FFF);  // BRnzp #-1
+  spin.PokeMemory(kInterruptTable + kDiskInterrupt, 0x6000);
+  spin.PokeMemory(0x6000, 0x8000);  // RTI
+  spin.WriteRegister(kR6, 0xBEEF);
+  spin.WriteMemory(kDKSR, kInterruptEnable);
+  spin.WriteMemory(kDKBR, 1);
+  spin.WriteMemory(kDKAR, 0x4000);
+  spin.WriteMemory(kDKCR, kDiskRead);
+  bool interrupted = WaitFor([&] {
+    spin.Step();
+    return spin.ReadRegister(kPC) == 0x6000;
+  });
+  Expect(interrupted, "disk: no interrupt reached the x81 handler");
+  if (interrupted) {
+    Expect((spin.PSR() & kUserMode) == 0 &&
+               (spin.PSR() & kPriorityMask) >> kPriorityShift == kDiskPriority,
+           "disk: the handler does not run in supervisor mode at priority 5");
+    Expect(spin.ReadRegister(kR6) == kSSPStart - 2,
+           "disk: the interrupt did not push onto the supervisor stack");
+    Expect(spin.PeekMemory(0x4000) == 0x0100,
+           "disk: the interrupt came before the words");
+    spin.Step();
+    Expect(spin.ReadRegister(kPC) == kPCStart && (spin.PSR() & kUserMode) &&
+               spin.ReadRegister(kR6) == 0xBEEF,
+           "disk: RTI did not return to the user program");
+    Expect(!(spin.ReadMemory(kDKSR) & kDone),
+           "disk: the interrupt left done set");
+  }
+}
+
+// Steps a user program whose first instruction raises an exception, into
+// the handler at x6000 and back out through its RTI.
+void CheckException(uint16_t instr, uint16_t vector, const std::string &name) {
+  Simulator sim;
+  sim.PokeMemory(kPCStart, instr);
+  sim.PokeMemory(kInterruptTable + vector, 0x6000);
+  sim.PokeMemory(0x6000, 0x8000);  // RTI
+  sim.WriteRegister(kR6, 0xBEEF);
+  sim.WriteRegister(kCOND, kNegative);
+  sim.Step();
+  Expect(sim.ReadRegister(kPC) == 0x6000, name + ": handler not entered");
+  Expect(!(sim.PSR() & kUserMode) && (sim.PSR() & kPriorityMask) == 0,
+         name + ": handler not in supervisor mode at the same priority");
+  Expect(sim.ReadRegister(kR6) == kSSPStart - 2,
+         name + ": R6 is not the supervisor stack");
+  Expect(sim.PeekMemory(kSSPStart - 2) == kPCStart + 1 &&
+             sim.PeekMemory(kSSPStart - 1) == (kUserMode | kNegative),
+         name + ": PC and PSR were not pushed");
+  sim.WriteRegister(kCOND, kZero);
+  sim.Step();
+  Expect(sim.ReadRegister(kPC) == kPCStart + 1,
+         name + ": RTI did not return past the instruction");
+  Expect(sim.PSR() == (kUserMode | kNegative),
+         name + ": RTI did not restore the PSR");
+  Expect(sim.ReadRegister(kR6) == 0xBEEF,
+         name + ": RTI did not restore R6 from Saved.USP");
+
+  Simulator unhandled;
+  unhandled.PokeMemory(kPCStart, instr);
+  Expect(!unhandled.Step() && unhandled.stop_reason() == StopReason::kFault,
+         name + ": a missing handler did not fault");
+}
+
+void CheckInterrupts() {
+  CheckException(0x8000, kPrivilegeViolation, "RTI in user mode");
+  CheckException(0xD000, kIllegalOpcode, "reserved opcode");
+
+  // RTI in supervisor mode pops PC and PSR, and returning to user mode
+  // swaps R6 with Saved.USP
+  Simulator sim;
+  sim.PokeMemory(kPCStart, 0xD000);  // enter supervisor mode at x6000
+  sim.PokeMemory(kInterruptTable + kIllegalOpcode, 0x6000);
+  sim.PokeMemory(0x6000, 0x8000);
+  sim.WriteRegister(kR6, 0x7000);
+  sim.Step();
+  uint16_t ssp = sim.ReadRegister(kR6);
+  sim.PokeMemory(ssp, 0x3100);                              // PC
+  sim.PokeMemory(ssp + 1, kUserMode | 0x0300 | kPositive);  // PSR
+  sim.Step();
+  Expect(sim.ReadRegister(kPC) == 0x3100, "RTI: PC not popped");
+  Expect(sim.PSR() == (kUserMode | 0x0300 | kPositive),
+         "RTI: PSR not popped");
+  Expect(sim.ReadRegister(kR6) == 0x7000, "RTI: R6 not swapped back");
+  // the next exception saves the supervisor stack pointer RTI left
+  sim.PokeMemory(0x3100, 0xD000);
+  sim.Step();
+  Expect(sim.ReadRegister(kR6) == ssp, "RTI: Saved.SSP not kept");
+}
+
+void CheckTrapModes() {
+  // a guest-mode trap enters the vector table routine like an exception,
+  // keeping the priority
+  Simulator sim;
+  Expect(sim.SetTrapMode(kHALT, TrapMode::kGuest), "HALT cannot be guest");
+  sim.PokeMemory(kPCStart, 0xF025);  // HALT
+  sim.PokeMemory(kTrapTable + kHALT, 0x0520);
+  sim.WriteRegister(kR6, 0xBEEF);
+  Expect(sim.Step(), "guest HALT stopped the machine");
+  Expect(sim.ReadRegister(kPC) == 0x0520, "guest HALT did not enter x0520");
+  Expect(!(sim.PSR() & kUserMode), "guest HALT is not in supervisor mode");
+  Expect(sim.PeekMemory(kSSPStart - 2) == kPCStart + 1,
+         "guest HALT did not push the return address");
+  Expect(sim.traps(kHALT) == 1, "guest HALT was not counted");
+
+  // a guest-mode trap with no routine faults
+  Simulator missing;
+  missing.SetTrapMode(kGETC, TrapMode::kGuest);
+  missing.PokeMemory(kPCStart, 0xF020);  // GETC
+  Expect(!missing.Step() && missing.stop_reason() == StopReason::kFault &&
+             missing.error() == "no trap handler for vector x20 at x3001",
+         "a guest GETC with no routine did not fault: " + missing.error());
+
+  // vectors without a host routine only run in the guest
+  Simulator user;
+  Expect(!user.SetTrapMode(0x40, TrapMode::kNative),
+         "x40 accepted native mode");
+  user.PokeMemory(kPCStart, 0xF040);
+  user.PokeMemory(kTrapTable + 0x40, 0x0600);
+  user.Step();
+  Expect(user.ReadRegister(kPC) == 0x0600, "TRAP x40 did not enter x0600");
+
+  // native mode is the default, and can be restored
+  Simulator native;
+  native.SetAllTrapModes(TrapMode::kGuest);
+  Expect(native.SetTrapMode(kHALT, TrapMode::kNative),
+         "HALT cannot be native");
+  native.PokeMemory(kPCStart, 0xF025);
+  Expect(!native.Step() && native.stop_reason() == StopReason::kHalted,
+         "native HALT did not halt");
+}
+
+// Executes one TRAP with the given registers and returns R0.
+uint16_t Trap(Simulator &sim, uint8_t vector, uint16_t r0, uint16_t r1,
+              uint16_t r2) {
+  sim.PokeMemory(kPCStart, 0xF000 | vector);
+  sim.WriteRegister(kPC, kPCStart);
+  sim.WriteRegister(kR0, r0);
+  sim.WriteRegister(kR1, r1);
+  sim.WriteRegister(kR2, r2);
+  sim.Step();
+  return sim.ReadRegister(kR0);
+}
+
+// Fills count words at address with x0100 + i.
+void Fill(Simulator &sim, uint16_t address, uint16_t count) {
+  for (uint16_t i = 0; i < count; ++i) {
+    sim.PokeMemory(address + i, 0x0100 + i);
+  }
+}
+
+// True if the count words at address hold x0100 + first + i.
+bool Holds(Simulator &sim, uint16_t address, uint16_t count, uint16_t first) {
+  for (uint16_t i = 0; i < count; ++i) {
+    if (sim.PeekMemory(address + i) != 0x0100 + first + i) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CheckMemoryTraps() {
+  // overlapping copies behave as memmove in both directions, on the host
+  // memory path and on the word-by-word path across xFE00
+  for (uint16_t base : {0x4000, 0xFD00}) {
+    Simulator sim;
+    Fill(sim, base, 8);
+    Trap(sim, kMEMMOVE, base + 2, base, 6);
+    Expect(Holds(sim, base + 2, 6, 0), "MEMMOVE forward overlap");
+    Fill(sim, base, 8);
+    Trap(sim, kMEMCPY, base, base + 2, 6);
+    Expect(Holds(sim, base, 6, 2), "MEMCPY backward overlap");
+  }
+  Simulator wide;
+  Fill(wide, 0xFDF0, 0x10);
+  Trap(wide, kMEMMOVE, 0xFDF4, 0xFDF0, 0x10);
+  Expect(Holds(wide, 0xFDF4, 0x0C, 0) && wide.PeekMemory(kKBSR + 1) == 0x010D,
+         "MEMMOVE overlapping the device page");
+  Expect(wide.PeekMemory(kKBSR) == 0, "MEMMOVE wrote KBSR as memory");
+
+  // MEMSET into the device page goes through the registers; KBSR keeps its
+  // ready bit, which belongs to the keyboard
+  Simulator set;
+  Trap(set, kMEMSET, 0xFDFE, 0xFFFF, 4);
+  Expect(set.PeekMemory(0xFDFE) == 0xFFFF && set.PeekMemory(0xFDFF) == 0xFFFF,
+         "MEMSET below the device page");
+  Expect((set.PeekMemory(kKBSR) & ~kReady) == kInterruptEnable,
+         "MEMSET wrote more than KBSR's enable bit");
+  Expect(set.PeekMemory(kKBSR + 1) == 0xFFFF, "MEMSET stopped at KBSR");
+
+  // ranges wrap from xFFFF to x0000
+  Simulator wrap;
+  Trap(wrap, kMEMSET, 0xFFFF, 0x1234, 3);
+  Expect(wrap.PeekMemory(0xFFFF) == 0x1234 && wrap.PeekMemory(0) == 0x1234 &&
+             wrap.PeekMemory(1) == 0x1234 && wrap.PeekMemory(2) == 0,
+         "MEMSET did not wrap at xFFFF");
+  Fill(wrap, 0x4000, 3);
+  Trap(wrap, kMEMCPY, 0xFFFF, 0x4000, 3);
+  Expect(wrap.PeekMemory(0xFFFF) == 0x0100 && Holds(wrap, 0, 2, 1),
+         "MEMCPY did not wrap at xFFFF");
+
+  // MEMCMP compares unsigned words and sets NZP from the result
+  Simulator cmp;
+  Fill(cmp, 0x4000, 40);
+  Fill(cmp, 0x5000, 40);
+  Expect(Trap(cmp, kMEMCMP, 0x4000, 0x5000, 40) == 0 &&
+             cmp.ReadRegister(kCOND) == kZero,
+         "MEMCMP of equal ranges");
+  cmp.PokeMemory(0x4000 + 35, 0x0001);  // past the first 32-word chunk
+  cmp.PokeMemory(0x5000 + 35, 0x8000);
+  Expect(Trap(cmp, kMEMCMP, 0x4000, 0x5000, 40) == 0xFFFF &&
+             cmp.ReadRegister(kCOND) == kNegative,
+         "MEMCMP of x0001 and x8000 is not negative");
+  Expect(Trap(cmp, kMEMCMP, 0x5000, 0x4000, 40) == 1 &&
+             cmp.ReadRegister(kCOND) == kPositive,
+         "MEMCMP of x8000 and x0001 is not positive");
+  Expect(Trap(cmp, kMEMCMP, 0x4000, 0x5000, 35) == 0,
+         "MEMCMP looked past the count");
+  Fill(cmp, 0xFDF0, 0x10);
+  Fill(cmp, 0x6000, 0x10);
+  cmp.PokeMemory(0x6000 + 0x0F, 0xFFFF);
+  Expect(Trap(cmp, kMEMCMP, 0xFDF0, 0x6000, 0x10) == 0xFFFF &&
+             cmp.ReadRegister(kCOND) == kNegative,
+         "MEMCMP across the device page");
+}
+
+}  // namespace
+
+int main() {
+  char dir_template[] = "/tmp/lc3-machine-XXXXXX";
+  if (!mkdtemp(dir_template)) {
+    std::perror("mkdtemp");
+    return 2;
+  }
+  std::string dir = dir_template;
+
+  CheckDisk(dir);
+  CheckInterrupts();
+  CheckTrapModes();
+  CheckMemoryTraps();
+
+  std::string command = "rm -rf " + dir;
+  std::system(command.c_str());
+  if (failures) {
+    return 1;
+  }
+  std::cout << "machine_test: ok" << std::endl;
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include "memory_pool.h"
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <new>
+
+#include "isa.h"
+
+int CurrentNode() {
+  unsigned cpu;
+  unsigned node;
+  return getcpu(&cpu, &node) == 0 ? node : 0;
+}
+
+HugePageBuffer::HugePageBuffer(size_t bytes, int node)
+    : size_((bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize) {
+  data_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (data_ == MAP_FAILED) {
+    // no reserved huge pages: over-allocate to get 2 MiB alignment, which
+    // transparent huge pages need, and trim the ends
+    size_t padded = size_ + kHugePageSize;
+    void *p = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (begin + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    if (aligned > begin) {
+      munmap(p, aligned - begin);
+    }
+    munmap(reinterpret_cast<void *>(aligned + size_),
+           begin + padded - aligned - size_);
+    data_ = reinterpret_cast<void *>(aligned);
+    madvise(data_, size_, MADV_HUGEPAGE);
+  }
+  // a hint: fails harmlessly where NUMA is absent or mbind is filtered
+  unsigned long mask = 1UL << (node < 0 ? CurrentNode() : node);
+  syscall(SYS_mbind, data_, size_, MPOL_PREFERRED, &mask, sizeof(mask) * 8,
+          0);
+}
+
+HugePageBuffer::~HugePageBuffer() { munmap(data_, size_); }
+
+MemoryPool::MemoryPool(int node) : node_(node < 0 ? CurrentNode() : node) {}
+
+uint16_t *MemoryPool::Allocate() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (free_.empty()) {
+    slabs_.push_back(std::make_unique<HugePageBuffer>(kHugePageSize, node_));
+    auto *slab = static_cast<uint16_t *>(slabs_.back()->data());
+    for (size_t i = kHugePageSize / kMemoryBytes; i-- > 1;) {
+      free_.push_back(slab + i * kMemorySize);
+    }
+    return slab;  // a new slab is already zero
+  }
+  uint16_t *memory = free_.back();
+  free_.pop_back();
+  lock.unlock();
+  std::memset(memory, 0, kMemoryBytes);
+  return memory;
+}
+
+void MemoryPool::Free(uint16_t *memory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(memory);
+}
@@ -0,0 +1,56 @@
+#ifndef LC3_MEMORY_POOL_H_
+#define LC3_MEMORY_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+constexpr size_t kHugePageSize = 2 << 20;
+
+// Returns the NUMA node of the CPU the calling thread is running on.
+int CurrentNode();
+
+// Zero-filled anonymous memory in 2 MiB pages where the system has them,
+// either reserved hugetlbfs pages or transparent huge pages, with the
+// pages preferably placed on one NUMA node. Throws std::bad_alloc.
+class HugePageBuffer {
+ public:
+  // A negative node means the calling thread's node.
+  explicit HugePageBuffer(size_t bytes, int node = -1);
+  ~HugePageBuffer();
+
+  HugePageBuffer(const HugePageBuffer &) = delete;
+  HugePageBuffer &operator=(HugePageBuffer &) = delete;
+
+  void *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  void *data_;
+  size_t size_;  // rounded up to kHugePageSize
+};
+
+// Hands out guest memories for the Simulators of one worker thread, 16 to
+// a huge page, so that many machines cost few TLB entries and their memory
+// sits on the worker's node. A pool should outlive its Simulators.
+class MemoryPool {
+ public:
+  explicit MemoryPool(int node = -1);
+
+  MemoryPool(const MemoryPool &) = delete;
+  MemoryPool &operator=(MemoryPool &) = delete;
+
+  // Returns kMemorySize zeroed words.
+  uint16_t *Allocate();
+  void Free(uint16_t *memory);
+
+ private:
+  int node_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<HugePageBuffer>> slabs_;
+  std::vector<uint16_t *> free_;
+};
+
+#endif  // LC3_MEMORY_POOL_H_
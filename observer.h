@@ -0,0 +1,90 @@
+#ifndef LC3_OBSERVER_H_
+#define LC3_OBSERVER_H_
+
+#include <array>
+#include <cstdint>
+
+#include "isa.h"
+
+// Observers watch a Simulator execute. Run(), RunUntil() and Step() take one
+// as a template parameter, so each kind of instrumentation is compiled into
+// its own copy of the interpreter loop and the default NullObserver, whose
+// hooks are empty, costs nothing. Observers derive from it and hide the
+// hooks they need:
+//
+//   // The instruction instr at pc is about to execute.
+//   void Execute(uint16_t pc, uint16_t instr);
+//   // It read value from address; LDI and STI first read the pointer.
+//   void Load(uint16_t address, uint16_t value);
+//   // It is about to write value to address.
+//   void Store(uint16_t address, uint16_t value);
+//   // It set register r to value.
+//   void Result(uint16_t r, uint16_t value);
+//   // The instruction at pc did not retire and will execute again: a GETC
+//   // or IN found no input.
+//   void Retry(uint16_t pc, uint16_t instr);
+//
+// Only the instructions themselves are reported; the effects of native
+// trap routines, interrupts and devices are not.
+struct NullObserver {
+  void Execute(uint16_t, uint16_t) {}
+  void Load(uint16_t, uint16_t) {}
+  void Store(uint16_t, uint16_t) {}
+  void Result(uint16_t, uint16_t) {}
+  void Retry(uint16_t, uint16_t) {}
+};
+
+// Passes every event to two observers in turn.
+template <typename First, typename Second>
+struct ObserverPair {
+  void Execute(uint16_t pc, uint16_t instr) {
+    first.Execute(pc, instr);
+    second.Execute(pc, instr);
+  }
+
+  void Load(uint16_t address, uint16_t value) {
+    first.Load(address, value);
+    second.Load(address, value);
+  }
+
+  void Store(uint16_t address, uint16_t value) {
+    first.Store(address, value);
+    second.Store(address, value);
+  }
+
+  void Result(uint16_t r, uint16_t value) {
+    first.Result(r, value);
+    second.Result(r, value);
+  }
+
+  void Retry(uint16_t pc, uint16_t instr) {
+    first.Retry(pc, instr);
+    second.Retry(pc, instr);
+  }
+
+  First &first;
+  Second &second;
+};
+
+// Counts retired instructions by opcode, and TRAPs by vector.
+struct InstructionCounters : NullObserver {
+  void Execute(uint16_t, uint16_t instr) {
+    ++total;
+    ++opcodes[instr >> 12];
+    if ((instr >> 12) == kTRAP) {
+      ++traps[TrapVector(instr)];
+    }
+  }
+
+  void Retry(uint16_t, uint16_t instr) {
+    --total;
+    --opcodes[kTRAP];
+    --traps[TrapVector(instr)];
+  }
+
+  uint64_t total = 0;
+  std::array<uint64_t, 16> opcodes{};
+  std::array<uint64_t, 256> traps{};
+};
+
+#endif  // LC3_OBSERVER_H_
@@ -0,0 +1,301 @@
+#include "profiler.h"
+
+#include <signal.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+bool SymbolTable::Read(const std::string &filename) {
+  std::ifstream file(filename);
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    size_t start = line.find_first_not_of("/ \t");
+    if (start == std::string::npos) {
+      continue;
+    }
+    std::istringstream fields(line.substr(start));
+    std::string label, address;
+    if (!(fields >> label >> address)) {
+      continue;
+    }
+    if (address[0] == 'x' || address[0] == 'X') {
+      address.erase(0, 1);
+    }
+    char *end;
+    unsigned long value = std::strtoul(address.c_str(), &end, 16);
+    if (address.empty() || *end != '\0' || value > 0xFFFF) {
+      continue;  // a header or some other text
+    }
+    labels_.emplace(static_cast<uint16_t>(value), label);
+  }
+  return true;
+}
+
+std::string SymbolTable::Name(uint16_t address) const {
+  auto it = labels_.find(address);
+  if (it != labels_.end()) {
+    return it->second;
+  }
+  char name[8];
+  std::snprintf(name, sizeof(name), "x%04X", address);
+  return name;
+}
+
+std::string SymbolTable::Locate(uint16_t address) const {
+  auto it = labels_.upper_bound(address);
+  if (it == labels_.begin()) {
+    return Name(address);
+  }
+  --it;
+  if (it->first == address) {
+    return it->second;
+  }
+  return it->second + "+" + std::to_string(address - it->first);
+}
+
+CallProfiler::CallProfiler() {
+  nodes_.push_back({0, 0, 1, 0});
+  stack_.push_back({0, 0x10000});
+}
+
+void CallProfiler::Enter(uint16_t pc) {
+  Transfer transfer = transfer_;
+  transfer_ = Transfer::kNone;
+  switch (transfer) {
+    case Transfer::kStart:
+      nodes_[0].function = pc;
+      return;
+
+    case Transfer::kTrap:
+      if (pc == return_address_) {
+        return;  // serviced natively
+      }
+      [[fallthrough]];
+    case Transfer::kCall: {
+      if (stack_.size() >= kMaxDepth) {
+        return;
+      }
+      uint32_t parent = stack_.back().node;
+      uint64_t key = (static_cast<uint64_t>(parent) << 16) | pc;
+      auto [it, inserted] = children_.emplace(key, nodes_.size());
+      if (inserted) {
+        nodes_.push_back({pc, parent, 0, 0});
+      }
+      ++nodes_[it->second].calls;
+      stack_.push_back({it->second, return_address_});
+    } break;
+
+    case Transfer::kReturn:
+      // unwind to the frame this returns from; a jump to anywhere else is
+      // not a return
+      for (size_t depth = stack_.size(); depth > 1; --depth) {
+        if (stack_[depth - 1].return_address == pc) {
+          stack_.resize(depth - 1);
+          break;
+        }
+      }
+      break;
+
+    case Transfer::kNone:
+      break;
+  }
+}
+
+void CallProfiler::WriteFoldedStacks(std::ostream &out,
+                                     const SymbolTable &symbols) const {
+  std::vector<std::string> paths(nodes_.size());
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    std::string name = symbols.Name(nodes_[i].function);
+    paths[i] = i == 0 ? name : paths[nodes_[i].parent] + ";" + name;
+    if (nodes_[i].self) {
+      out << paths[i] << " " << nodes_[i].self << "\n";
+    }
+  }
+}
+
+void CallProfiler::WriteFunctions(std::ostream &out,
+                                  const SymbolTable &symbols) const {
+  // children come after their parents, so one backwards pass sums subtrees
+  std::vector<uint64_t> totals(nodes_.size());
+  for (size_t i = nodes_.size(); i-- > 0;) {
+    totals[i] += nodes_[i].self;
+    if (i > 0) {
+      totals[nodes_[i].parent] += totals[i];
+    }
+  }
+
+  struct Function {
+    uint64_t calls = 0;
+    uint64_t inclusive = 0;
+    uint64_t exclusive = 0;
+  };
+  std::unordered_map<uint16_t, Function> functions;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    Function &function = functions[nodes_[i].function];
+    function.calls += nodes_[i].calls;
+    function.exclusive += nodes_[i].self;
+    // a recursive call is already included in the outermost one
+    bool recursive = false;
+    for (size_t j = i; j > 0 && !recursive;) {
+      j = nodes_[j].parent;
+      recursive = nodes_[j].function == nodes_[i].function;
+    }
+    if (!recursive) {
+      function.inclusive += totals[i];
+    }
+  }
+
+  std::vector<std::pair<uint16_t, Function>> sorted(functions.begin(),
+                                                    functions.end());
+  std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+    return a.second.inclusive > b.second.inclusive;
+  });
+  char line[128];
+  std::snprintf(line, sizeof(line), "%14s %14s %10s  %s\n", "inclusive",
+                "exclusive", "calls", "function");
+  out << line;
+  for (auto &[address, function] : sorted) {
+    std::snprintf(line, sizeof(line), "%14llu %14llu %10llu  ",
+                  static_cast<unsigned long long>(function.inclusive),
+                  static_cast<unsigned long long>(function.exclusive),
+                  static_cast<unsigned long long>(function.calls));
+    out << line << symbols.Name(address) << "\n";
+  }
+}
+
+// older glibc headers lack the name for SIGEV_THREAD_ID's target
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+std::atomic<SamplingProfiler *> SamplingProfiler::active_{nullptr};
+
+void SamplingProfiler::HandleSignal(int) {
+  SamplingProfiler *profiler = active_.load(std::memory_order_relaxed);
+  if (profiler) {
+    uint16_t pc = profiler->sim_->block_pc();
+    profiler->samples_[pc].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool SamplingProfiler::Start(int rate) {
+  if (rate <= 0) {
+    return false;
+  }
+  SamplingProfiler *expected = nullptr;
+  if (!active_.compare_exchange_strong(expected, this)) {
+    return false;
+  }
+  struct sigaction action = {};
+  action.sa_handler = HandleSignal;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &action, nullptr);
+
+  // a per-thread CPU clock, so that only the interpreter is sampled
+  struct sigevent event = {};
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = gettid();
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_) < 0) {
+    active_.store(nullptr);
+    return false;
+  }
+  long interval = 1000000000L / rate;
+  struct itimerspec spec = {};
+  spec.it_interval.tv_sec = interval / 1000000000L;
+  spec.it_interval.tv_nsec = interval % 1000000000L;
+  spec.it_value = spec.it_interval;
+  timer_settime(timer_, 0, &spec, nullptr);
+  running_ = true;
+  return true;
+}
+
+void SamplingProfiler::Stop() {
+  if (!running_) {
+    return;
+  }
+  timer_delete(timer_);
+  active_.store(nullptr);
+  running_ = false;
+}
+
+namespace {
+
+// How far to look for the ends of a block.
+constexpr int kMaxBlockLength = 256;
+
+// The last instruction of the block entered at first.
+uint16_t BlockEnd(const Simulator &sim, uint16_t first) {
+  uint16_t last = first;
+  for (int i = 0; i < kMaxBlockLength && !EndsBlock(sim.PeekMemory(last));
+       ++i) {
+    ++last;
+  }
+  return last;
+}
+
+std::string Hex(uint16_t address) {
+  char text[8];
+  std::snprintf(text, sizeof(text), "x%04X", address);
+  return text;
+}
+
+}  // namespace
+
+void SamplingProfiler::WriteHistogram(std::ostream &out,
+                                      const SymbolTable &symbols) const {
+  constexpr size_t kTop = 20;
+  uint64_t total = 0;
+  std::vector<std::pair<uint64_t, uint16_t>> blocks;  // samples, first
+  // each block's samples shared evenly among its instructions, which run
+  // once each per pass
+  std::unordered_map<uint16_t, double> addresses;
+  for (size_t pc = 0; pc < kMemorySize; ++pc) {
+    uint64_t n = samples_[pc].load(std::memory_order_relaxed);
+    if (!n) {
+      continue;
+    }
+    total += n;
+    blocks.emplace_back(n, pc);
+    uint16_t last = BlockEnd(*sim_, pc);
+    double share = static_cast<double>(n) / (static_cast<uint16_t>(last - pc) + 1);
+    for (uint16_t a = pc;; ++a) {
+      addresses[a] += share;
+      if (a == last) {
+        break;
+      }
+    }
+  }
+
+  out << total << " samples\n";
+  if (!total) {
+    return;
+  }
+  char line[64];
+  std::vector<std::pair<double, uint16_t>> sorted;
+  for (auto &[pc, n] : addresses) {
+    sorted.emplace_back(n, pc);
+  }
+  std::sort(sorted.rbegin(), sorted.rend());
+  out << "hottest addresses (block samples spread over their instructions):\n";
+  for (size_t i = 0; i < sorted.size() && i < kTop; ++i) {
+    auto [n, pc] = sorted[i];
+    std::snprintf(line, sizeof(line), "%6.2f%% %.1f\t", 100.0 * n / total, n);
+    out << line << Hex(pc) << "\t" << symbols.Locate(pc) << "\n";
+  }
+  std::sort(blocks.rbegin(), blocks.rend());
+  out << "hottest blocks:\n";
+  for (size_t i = 0; i < blocks.size() && i < kTop; ++i) {
+    auto [n, first] = blocks[i];
+    uint16_t last = BlockEnd(*sim_, first);
+    std::snprintf(line, sizeof(line), "%6.2f%% ", 100.0 * n / total);
+    out << line << n << "\t" << Hex(first) << "-" << Hex(last) << "\t"
+        << symbols.Locate(first) << "\n";
+  }
+}
@@ -0,0 +1,154 @@
+#ifndef LC3_PROFILER_H_
+#define LC3_PROFILER_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "isa.h"
+#include "observer.h"
+#include "simulator.h"
+
+// Labels read from assembler symbol table (.sym) files.
+class SymbolTable {
+ public:
+  // Reads every line that holds a label followed by its hex address, such
+  // as "//	LOOP             3004" from lc3as or "LOOP x3004"; other lines
+  // are skipped. Returns false if the file cannot be read.
+  bool Read(const std::string &filename);
+
+  // The label at address, or the address as "x3004" if there is none.
+  std::string Name(uint16_t address) const;
+
+  // address relative to the nearest label at or below it, as "LOOP+2", or
+  // just the address if there is no such label.
+  std::string Locate(uint16_t address) const;
+
+  bool empty() const { return labels_.empty(); }
+
+ private:
+  std::map<uint16_t, std::string> labels_;
+};
+
+// An observer (see observer.h) that builds the guest's call tree and counts
+// the instructions run in each of its nodes. JSR and JSRR are calls, as are
+// TRAPs serviced by guest code; RET (JMP R7) and RTI return to the caller
+// whose return address they land on, which tolerates routines that return
+// early through another frame. Interrupt handlers are not tracked as calls,
+// so their instructions count towards whatever they interrupted.
+class CallProfiler : public NullObserver {
+ public:
+  CallProfiler();
+
+  void Execute(uint16_t pc, uint16_t instr) {
+    if (transfer_ != Transfer::kNone) {
+      Enter(pc);
+    }
+    ++nodes_[stack_.back().node].self;
+    switch (instr >> 12) {
+      case kJSR:
+        transfer_ = Transfer::kCall;
+        return_address_ = pc + 1;
+        break;
+      case kTRAP:
+        transfer_ = Transfer::kTrap;
+        return_address_ = pc + 1;
+        break;
+      case kJMP:
+        if (BaseField(instr) == kR7) {
+          transfer_ = Transfer::kReturn;
+        }
+        break;
+      case kRTI:
+        transfer_ = Transfer::kReturn;
+        break;
+    }
+  }
+
+  // A TRAP waiting for input has not called anything yet.
+  void Retry(uint16_t, uint16_t) {
+    --nodes_[stack_.back().node].self;
+    transfer_ = Transfer::kNone;
+  }
+
+  // Writes one "caller;callee;... COUNT" line per call path that ran
+  // instructions, for flame graph tools.
+  void WriteFoldedStacks(std::ostream &out, const SymbolTable &symbols) const;
+
+  // Writes a table of each function's calls and its inclusive and exclusive
+  // instruction counts, most expensive first.
+  void WriteFunctions(std::ostream &out, const SymbolTable &symbols) const;
+
+ private:
+  // Calls nested deeper than this are not tracked, so that runaway
+  // recursion cannot exhaust host memory.
+  static constexpr size_t kMaxDepth = 4096;
+
+  // What the instruction before the current one did.
+  enum class Transfer { kNone, kStart, kCall, kTrap, kReturn };
+
+  struct Node {
+    uint16_t function;  // entry address
+    uint32_t parent;
+    uint64_t calls;
+    uint64_t self;  // instructions run in this node, not in its callees
+  };
+
+  struct Frame {
+    uint32_t node;
+    uint32_t return_address;  // above 0xFFFF for the outermost frame
+  };
+
+  void Enter(uint16_t pc);
+
+  Transfer transfer_ = Transfer::kStart;
+  uint16_t return_address_ = 0;
+  std::vector<Node> nodes_;  // nodes_[0] is the root; parents come first
+  std::unordered_map<uint64_t, uint32_t> children_;  // parent:function
+  std::vector<Frame> stack_;
+};
+
+// Samples a running Simulator on a CPU-time timer signal (SIGPROF), so the
+// interpreter does no extra work per instruction. The handler reads
+// Simulator::block_pc(), so samples have block granularity: each is charged
+// to the block that was running, and the report spreads a block's samples
+// over its instructions for a per-address view. The handler only bumps a
+// counter in a fixed histogram, which is async-signal-safe and needs no
+// locks. Only one SamplingProfiler can run at a time in a process.
+class SamplingProfiler {
+ public:
+  explicit SamplingProfiler(const Simulator *sim) : sim_(sim) {}
+  ~SamplingProfiler() { Stop(); }
+
+  SamplingProfiler(const SamplingProfiler &) = delete;
+  SamplingProfiler &operator=(SamplingProfiler &) = delete;
+
+  // Starts sampling rate times per second of CPU time used by the calling
+  // thread, which should be the one running the Simulator. Returns false
+  // if the timer cannot be set up or another profiler is running.
+  bool Start(int rate);
+  void Stop();
+
+  // Writes the most sampled addresses and blocks. A block runs from where it
+  // was entered up to and including the next control transfer, as in
+  // Simulator::RunBlock(); its end is found from the sim's memory.
+  void WriteHistogram(std::ostream &out, const SymbolTable &symbols) const;
+
+ private:
+  static void HandleSignal(int signal);
+
+  static std::atomic<SamplingProfiler *> active_;
+
+  const Simulator *sim_;
+  bool running_ = false;
+  timer_t timer_;
+  std::array<std::atomic<uint32_t>, kMemorySize> samples_{};
+};
+
+#endif  // LC3_PROFILER_H_
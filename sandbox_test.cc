@@ -0,0 +1,192 @@
+// Tries to escape the file traps' sandbox, first through openat2 and then
+// through the component-by-component walk used where openat2 is refused,
+// and checks that transfers are clamped. Run by "make check".
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "simulator.h"
+
+namespace {
+
+int failures = 0;
+
+void Expect(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "sandbox_test: " << what << std::endl;
+    ++failures;
+  }
+}
+
+bool Exists(const std::string &path) {
+  struct stat info;
+  return lstat(path.c_str(), &info) == 0;
+}
+
+off_t FileSize(const std::string &path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 ? info.st_size : -1;
+}
+
+void WriteFile(const std::string &path, const std::string &data) {
+  std::ofstream(path, std::ios::binary) << data;
+}
+
+// Executes one TRAP with the given registers and returns R0.
+uint16_t Trap(Simulator &sim, uint8_t vector, uint16_t r0, uint16_t r1 = 0,
+              uint16_t r2 = 0) {
+  sim.PokeMemory(kPCStart, 0xF000 | vector);
+  sim.WriteRegister(kPC, kPCStart);
+  sim.WriteRegister(kR0, r0);
+  sim.WriteRegister(kR1, r1);
+  sim.WriteRegister(kR2, r2);
+  sim.Step();
+  return sim.ReadRegister(kR0);
+}
+
+// FOPENs path and returns the handle, or -1.
+int Open(Simulator &sim, const std::string &path, uint16_t mode) {
+  constexpr uint16_t kPath = 0x4000;
+  for (size_t i = 0; i <= path.size(); ++i) {
+    sim.PokeMemory(kPath + i, i < path.size() ? path[i] : 0);
+  }
+  return static_cast<int16_t>(Trap(sim, kFOPEN, kPath, mode));
+}
+
+// Paths that must not reach outside the sandbox, in any mode.
+const char *const kEscapes[] = {
+    "../outside/secret",
+    "/etc/passwd",
+    "up/secret",                // symbolic link to a directory outside
+    "secret",                   // symbolic link to a file outside
+    "abs/passwd",               // symbolic link to an absolute directory
+    "sub/../../outside/secret",
+    "../outside/created",
+};
+
+// Paths below the sandbox that must open.
+const char *const kInside[] = {"in", "sub/f", "./in", "sub//f"};
+
+// Paths the fallback refuses although they stay below the sandbox; openat2
+// allows them.
+const char *const kFallbackOnly[] = {"alias", "sub/../in"};
+
+void CheckOpens(const std::string &root, bool fallback) {
+  std::string phase = fallback ? "fallback: " : "openat2: ";
+  Simulator sim;
+  Expect(sim.SetSandbox(root + "/box"), phase + "cannot set the sandbox");
+  for (const char *path : kEscapes) {
+    for (uint16_t mode : {kFileRead, kFileWrite, kFileReadWrite}) {
+      int handle = Open(sim, path, mode);
+      Expect(handle < 0, phase + "opened " + path);
+      if (handle >= 0) {
+        Trap(sim, kFCLOSE, handle);
+      }
+    }
+  }
+  Expect(!Exists(root + "/outside/created"),
+         phase + "created a file outside the sandbox");
+  Expect(FileSize(root + "/outside/secret") == 6,
+         phase + "truncated a file outside the sandbox");
+  for (const char *path : kInside) {
+    int handle = Open(sim, path, kFileRead);
+    Expect(handle >= 0, phase + "cannot open " + path);
+    Trap(sim, kFCLOSE, handle);
+  }
+  for (const char *path : kFallbackOnly) {
+    int handle = Open(sim, path, kFileRead);
+    Expect((handle < 0) == fallback,
+           phase + (fallback ? "opened " : "cannot open ") + path);
+    if (handle >= 0) {
+      Trap(sim, kFCLOSE, handle);
+    }
+  }
+}
+
+// Transfers stop short of the device page and move at most x7FFF words.
+void CheckTransfers(const std::string &root) {
+  Simulator sim;
+  sim.SetSandbox(root + "/box");
+  int handle = Open(sim, "big", kFileRead);
+  Expect(handle >= 0, "cannot open big");
+  Expect(Trap(sim, kFREAD, handle, 0x0100, 0xFFFF) == 0x7FFF,
+         "FREAD of xFFFF words did not stop at x7FFF");
+  Expect(sim.ReadRegister(kCOND) == kPositive, "FREAD set NZP wrongly");
+  Trap(sim, kFSEEK, handle, 0, 0);
+  Expect(Trap(sim, kFREAD, handle, 0xFD00, 0x1000) == 0x0100,
+         "FREAD did not stop at the device page");
+  Expect(sim.PeekMemory(kKBSR) == 0, "FREAD wrote the device page");
+  Expect(Trap(sim, kFREAD, handle, kMMIOBase, 1) == 0,
+         "FREAD into the device page moved words");
+  Trap(sim, kFCLOSE, handle);
+
+  handle = Open(sim, "out", kFileWrite);
+  Expect(handle >= 0, "cannot create out");
+  Expect(Trap(sim, kFWRITE, handle, 0x0100, 0xFFFF) == 0x7FFF,
+         "FWRITE of xFFFF words did not stop at x7FFF");
+  Trap(sim, kFCLOSE, handle);
+  Expect(FileSize(root + "/box/out") == 0x7FFF * 2,
+         "FWRITE wrote the wrong number of bytes");
+}
+
+// Makes openat2 fail with EPERM, as a seccomp policy that does not know it
+// would, so that OpenInSandbox() takes its fallback.
+bool RefuseOpenat2() {
+  struct sock_filter filter[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_openat2, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)};
+  struct sock_fprog program = {sizeof(filter) / sizeof(filter[0]), filter};
+  return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 &&
+         prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == 0;
+}
+
+}  // namespace
+
+int main() {
+  char root_template[] = "/tmp/lc3-sandbox-XXXXXX";
+  if (!mkdtemp(root_template)) {
+    std::perror("mkdtemp");
+    return 2;
+  }
+  std::string root = root_template;
+  mkdir((root + "/box").c_str(), 0755);
+  mkdir((root + "/box/sub").c_str(), 0755);
+  mkdir((root + "/outside").c_str(), 0755);
+  WriteFile(root + "/outside/secret", "secret");
+  WriteFile(root + "/box/in", "in");
+  WriteFile(root + "/box/sub/f", "f");
+  WriteFile(root + "/box/big", std::string(0x9000 * 2, 'x'));
+  symlink("../outside", (root + "/box/up").c_str());
+  symlink("../outside/secret", (root + "/box/secret").c_str());
+  symlink("/etc", (root + "/box/abs").c_str());
+  symlink("in", (root + "/box/alias").c_str());
+
+  CheckOpens(root, false);
+  CheckTransfers(root);
+  if (RefuseOpenat2()) {
+    CheckOpens(root, true);
+  } else {
+    Expect(false, "cannot refuse openat2 to test the fallback");
+  }
+
+  std::string command = "rm -rf " + root;
+  std::system(command.c_str());
+  if (failures) {
+    return 1;
+  }
+  std::cout << "sandbox_test: ok" << std::endl;
+  return 0;
+}
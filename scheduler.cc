@@ -0,0 +1,141 @@
+#include "scheduler.h"
+
+int Scheduler::Start(std::unique_ptr<Simulator> sim) {
+  auto session = std::make_unique<Session>();
+  session->scheduler = this;
+  session->sim = std::move(sim);
+  session->sim->SetConsole(MakeConsole(session.get()));
+  session->task = Execute(session.get());
+  std::lock_guard<std::mutex> lock(mutex_);
+  session->id = next_id_++;
+  ready_.push_back(session->id);
+  int id = session->id;
+  sessions_.emplace(id, std::move(session));
+  wakeup_.notify_one();
+  return id;
+}
+
+size_t Scheduler::Deliver(int session, std::string_view input) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = sessions_.find(session);
+  if (it == sessions_.end() || it->second->closed) {
+    return 0;
+  }
+  Session &s = *it->second;
+  s.input.erase(0, s.position);
+  s.position = 0;
+  s.input.append(input);
+  if (s.waiting) {
+    s.waiting = false;
+    ready_.push_back(session);
+    wakeup_.notify_one();
+  }
+  return s.input.size();
+}
+
+size_t Scheduler::Buffered(int session) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = sessions_.find(session);
+  if (it == sessions_.end()) {
+    return 0;
+  }
+  return it->second->input.size() - it->second->position;
+}
+
+void Scheduler::CloseInput(int session) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = sessions_.find(session);
+  if (it == sessions_.end()) {
+    return;
+  }
+  Session &s = *it->second;
+  s.closed = true;
+  if (s.waiting) {
+    s.waiting = false;
+    ready_.push_back(session);
+    wakeup_.notify_one();
+  }
+}
+
+void Scheduler::Stop(int session) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = sessions_.find(session);
+  if (it == sessions_.end()) {
+    return;
+  }
+  Session &s = *it->second;
+  s.sim->RequestStop();
+  // a session waiting for input only sees the request once it runs again
+  s.closed = true;
+  if (s.waiting) {
+    s.waiting = false;
+    ready_.push_back(session);
+    wakeup_.notify_one();
+  }
+}
+
+void Scheduler::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopped_ = true;
+  wakeup_.notify_one();
+}
+
+void Scheduler::Run(bool wait_for_sessions) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_ && (wait_for_sessions || !sessions_.empty())) {
+    wakeup_.wait(lock, [this] { return stopped_ || !ready_.empty(); });
+    if (stopped_) {
+      break;
+    }
+    Session *session = sessions_.at(ready_.front()).get();
+    ready_.pop_front();
+    lock.unlock();
+
+    auto handle = session->task.handle();
+    handle.resume();
+    if (handle.done()) {
+      on_exit_(session->id, session->sim->stop_reason());
+    }
+
+    lock.lock();
+    if (handle.done()) {
+      sessions_.erase(session->id);
+    }
+  }
+}
+
+Scheduler::Task Scheduler::Execute(Session *session) {
+  while (true) {
+    auto deadline = std::chrono::steady_clock::now() + slice_;
+    switch (session->sim->RunUntil(deadline)) {
+      case StopReason::kBudgetExhausted:
+        co_await Yield{this, session};
+        break;
+      case StopReason::kWaitingForInput:
+        co_await WaitForInput{this, session};
+        break;
+      default:
+        co_return;
+    }
+  }
+}
+
+Console Scheduler::MakeConsole(Session *session) {
+  auto read = [](void *context) {
+    auto *session = static_cast<Session *>(context);
+    std::lock_guard<std::mutex> lock(session->scheduler->mutex_);
+    if (session->position < session->input.size()) {
+      return static_cast<int>(
+          static_cast<uint8_t>(session->input[session->position++]));
+    }
+    return session->closed ? EOF : kConsoleWouldBlock;
+  };
+  // read() never blocks, so a KBSR poll always reaches it and gets
+  // kConsoleWouldBlock when there is no input
+  auto ready = [](void *) { return true; };
+  auto write = [](void *context, const char *data, size_t size) {
+    auto *session = static_cast<Session *>(context);
+    session->scheduler->on_output_(session->id, data, size);
+  };
+  return {read, ready, write, session};
+}
@@ -0,0 +1,164 @@
+#ifndef LC3_SCHEDULER_H_
+#define LC3_SCHEDULER_H_
+
+// Needs C++20 for coroutines; the rest of the library is C++17.
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "simulator.h"
+
+// Runs many interactive Simulators on the calling thread. Each session is
+// a coroutine that runs its machine in time slices; a GETC or IN with no
+// input, or a KBSR read that finds none, suspends it until Deliver()
+// supplies some, so idle sessions cost nothing. That includes guest GETC
+// routines that poll KBSR, but also parks a guest that checks KBSR between
+// other work until a key arrives.
+//
+// Start(), Deliver(), Buffered(), CloseInput() and Stop() may be called
+// from any thread; the output and exit callbacks run on the thread in Run().
+class Scheduler {
+ public:
+  using OutputCallback =
+      std::function<void(int session, const char *data, size_t size)>;
+  using ExitCallback = std::function<void(int session, StopReason reason)>;
+
+  Scheduler(OutputCallback on_output, ExitCallback on_exit,
+            std::chrono::microseconds slice = std::chrono::milliseconds(1))
+      : on_output_(std::move(on_output)),
+        on_exit_(std::move(on_exit)),
+        slice_(slice) {}
+
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(Scheduler &) = delete;
+
+  // Takes over a loaded Simulator and returns its session id. The
+  // Simulator's console is replaced.
+  int Start(std::unique_ptr<Simulator> sim);
+
+  // Appends input for a session, waking it if it is waiting for input, and
+  // returns how much of its input is still unread. Input is not limited
+  // here; a caller reading from a client should stop while that is large.
+  // Unknown or finished sessions are ignored.
+  size_t Deliver(int session, std::string_view input);
+
+  // How much of a session's input is unread; 0 for unknown sessions.
+  size_t Buffered(int session);
+
+  // Marks the end of a session's input; reads past it return EOF.
+  void CloseInput(int session);
+
+  // Stops a session at its next block boundary, as if its machine had been
+  // stopped with Simulator::RequestStop(), and runs its exit callback.
+  // Unknown or finished sessions are ignored.
+  void Stop(int session);
+
+  // Resumes sessions until none are left, sleeping while every session is
+  // waiting for input. With wait_for_sessions set it sleeps for new
+  // sessions instead of returning, until Stop() is called.
+  void Run(bool wait_for_sessions = false);
+
+  // Makes Run() return once the running session, if any, yields. Sessions
+  // still open are destroyed with the Scheduler.
+  void Stop();
+
+ private:
+  struct Session;
+
+  // The coroutine running one session. It starts suspended and is resumed
+  // only by Run().
+  class Task {
+   public:
+    struct promise_type {
+      Task get_return_object() {
+        return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+    Task(Task &&other) noexcept : handle_(other.handle_) {
+      other.handle_ = nullptr;
+    }
+    Task &operator=(Task &&other) noexcept {
+      std::swap(handle_, other.handle_);
+      return *this;
+    }
+    ~Task() {
+      if (handle_) handle_.destroy();
+    }
+
+    std::coroutine_handle<promise_type> handle() const { return handle_; }
+
+   private:
+    std::coroutine_handle<promise_type> handle_;
+  };
+
+  // Requeues the session behind every other ready one.
+  struct Yield {
+    Scheduler *scheduler;
+    Session *session;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<>) {
+      std::lock_guard<std::mutex> lock(scheduler->mutex_);
+      scheduler->ready_.push_back(session->id);
+    }
+    void await_resume() {}
+  };
+
+  // Parks the session until Deliver() or CloseInput(); does not suspend if
+  // input arrived since the machine stopped.
+  struct WaitForInput {
+    Scheduler *scheduler;
+    Session *session;
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<>) {
+      std::lock_guard<std::mutex> lock(scheduler->mutex_);
+      if (session->position < session->input.size() || session->closed) {
+        return false;
+      }
+      session->waiting = true;
+      return true;
+    }
+    void await_resume() {}
+  };
+
+  struct Session {
+    Scheduler *scheduler;
+    int id;
+    std::unique_ptr<Simulator> sim;
+    Task task{nullptr};
+    std::string input;  // guarded by mutex_, as are the next three
+    size_t position = 0;
+    bool closed = false;
+    bool waiting = false;
+  };
+
+  Task Execute(Session *session);
+  Console MakeConsole(Session *session);
+
+  OutputCallback on_output_;
+  ExitCallback on_exit_;
+  std::chrono::microseconds slice_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::map<int, std::unique_ptr<Session>> sessions_;
+  std::deque<int> ready_;
+  int next_id_ = 0;
+  bool stopped_ = false;
+};
+
+#endif  // LC3_SCHEDULER_H_
@@ -0,0 +1,212 @@
+// Talks to "lc3sim -S" as a client: pipelines requests on one connection
+// and matches the responses, which come back in the order the jobs finish,
+// to their requests by id, and checks that the socket is private. Run by
+// "make check" as "server_test LC3SIM".
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// The job-server protocol, as lc3sim.cc defines it.
+struct JobRequest {
+  uint64_t max_instructions;
+  uint32_t id;
+  uint32_t images_size;
+  uint32_t input_size;
+  uint32_t reserved;
+};
+
+struct JobResponse {
+  uint64_t instructions;
+  uint32_t id;
+  int32_t status;
+  uint32_t output_size;
+  uint32_t reserved;
+};
+
+constexpr int32_t kHalted = 0;
+constexpr int32_t kLimit = 1;
+constexpr int32_t kError = 3;
+
+int failures = 0;
+
+void Expect(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "server_test: " << what << std::endl;
+    ++failures;
+  }
+}
+
+// Writes an image of the given words, the first being the origin.
+void WriteImage(const std::string &path, const std::vector<uint16_t> &words) {
+  std::ofstream file(path, std::ios::binary);
+  for (uint16_t word : words) {
+    file.put(static_cast<char>(word >> 8)).put(static_cast<char>(word));
+  }
+}
+
+bool WriteAll(int fd, const std::string &data) {
+  for (size_t done = 0; done < data.size();) {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void *buffer, size_t size) {
+  char *p = static_cast<char *>(buffer);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+std::string Request(uint32_t id, uint64_t max_instructions,
+                    const std::string &images, const std::string &input) {
+  JobRequest request = {max_instructions, id,
+                        static_cast<uint32_t>(images.size()),
+                        static_cast<uint32_t>(input.size()), 0};
+  return std::string(reinterpret_cast<const char *>(&request),
+                     sizeof(request)) +
+         images + input;
+}
+
+// Connects to the server at path, waiting for it to start listening.
+int Connect(const std::string &path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&address),
+                sizeof(address)) == 0) {
+      return fd;
+    }
+    close(fd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return -1;
+}
+
+struct Result {
+  JobResponse response;
+  std::string output;
+};
+
+void CheckPipelining(const std::string &dir, int fd) {
+  // LD R2, M; OUTER LD R1, N; INNER ADD R1, R1, #-1; BRp INNER;
+  // ADD R2, R2, #-1; BRp OUTER; HALT; N .FILL 1000; M .FILL 10000, about
+  // 20 million instructions
+  WriteImage(dir + "/slow.obj", {0x3000, 0x2407, 0x2205, 0x127F, 0x03FE,
+                                 0x14BF, 0x03FB, 0xF025, 0x03E8, 0x2710});
+  // LOOP GETC; ADD R1, R0, #1; BRz DONE; OUT; BR LOOP; DONE HALT
+  WriteImage(dir + "/echo.obj",
+             {0x3000, 0xF020, 0x1221, 0x0402, 0xF021, 0x0FFB, 0xF025});
+
+  // sent in one write, before any response is read
+  std::string requests = Request(70, 0, dir + "/slow.obj", "") +
+                         Request(71, 0, dir + "/echo.obj", "abc") +
+                         Request(72, 0, dir + "/missing.obj", "") +
+                         Request(73, 10, dir + "/slow.obj", "");
+  Expect(WriteAll(fd, requests), "cannot send the requests");
+
+  std::vector<uint32_t> order;
+  std::map<uint32_t, Result> results;
+  for (int i = 0; i < 4; ++i) {
+    Result result;
+    if (!ReadAll(fd, &result.response, sizeof(result.response))) {
+      Expect(false, "the server hung up");
+      return;
+    }
+    result.output.resize(result.response.output_size);
+    ReadAll(fd, result.output.data(), result.output.size());
+    order.push_back(result.response.id);
+    results[result.response.id] = result;
+  }
+  Expect(results.size() == 4, "a response id is missing or repeated");
+  Expect(order.back() == 70, "the slow job did not finish last");
+
+  const Result &slow = results[70];
+  Expect(slow.response.status == kHalted &&
+             slow.response.instructions == 20030002 &&
+             slow.output == "HALT\n",
+         "wrong response to the slow job");
+  const Result &echo = results[71];
+  Expect(echo.response.status == kHalted && echo.output == "abcHALT\n",
+         "wrong response to the echo job");
+  Expect(results[72].response.status == kError &&
+             results[72].response.output_size == 0,
+         "a missing image was not an error");
+  Expect(results[73].response.status == kLimit &&
+             results[73].response.instructions >= 10 &&
+             results[73].response.instructions < 20,
+         "wrong response to the limited job");
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::cerr << "usage: server_test LC3SIM" << std::endl;
+    return 2;
+  }
+  char dir_template[] = "/tmp/lc3-server-XXXXXX";
+  if (!mkdtemp(dir_template)) {
+    std::perror("mkdtemp");
+    return 2;
+  }
+  std::string dir = dir_template;
+  std::string socket_path = dir + "/socket";
+
+  pid_t server = fork();
+  if (server == 0) {
+    execl(argv[1], argv[1], "-S", socket_path.c_str(), "-j", "2", nullptr);
+    std::perror(argv[1]);
+    _exit(2);
+  }
+  int fd = Connect(socket_path);
+  Expect(fd >= 0, "cannot connect to the server");
+  // clients name host files, so only the server's user may connect
+  struct stat info;
+  Expect(stat(socket_path.c_str(), &info) == 0 &&
+             (info.st_mode & 0777) == (S_IRUSR | S_IWUSR),
+         "the socket is open to other users");
+  if (fd >= 0) {
+    CheckPipelining(dir, fd);
+    close(fd);
+  }
+  kill(server, SIGTERM);
+  waitpid(server, nullptr, 0);
+
+  std::string command = "rm -rf " + dir;
+  std::system(command.c_str());
+  if (failures) {
+    return 1;
+  }
+  std::cout << "server_test: ok" << std::endl;
+  return 0;
+}
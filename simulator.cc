@@ -0,0 +1,70 @@
+#include "simulator.h"
+
+#include <sys/select.h>
+
+bool LoadImage(const std::string &filename, uint16_t *memory) {
+  std::unique_ptr<std::FILE, decltype(&CloseFile)> fp(
+      std::fopen(filename.c_str(), "rb"), &CloseFile);
+  uint16_t memory_origin;
+  if (!fp ||
+      std::fread(&memory_origin, sizeof(memory_origin), 1, fp.get()) != 1) {
+    return false;
+  }
+  memory_origin = Swap16(memory_origin);
+
+  size_t remaining_memory_size = kMemorySize - memory_origin;
+  uint16_t *p = memory + memory_origin;
+  auto nread = std::fread(p, sizeof(uint16_t), remaining_memory_size, fp.get());
+  while (nread-- > 0) {
+    *p = Swap16(*p);
+    ++p;
+  }
+  return true;
+}
+
+Console NullConsole() {
+  return {[](void *) { return EOF; }, [](void *) { return true; },
+          [](void *, const char *, size_t) {}, nullptr};
+}
+
+Console StdioConsole::console() {
+  auto read = [](void *context) {
+    return std::getc(static_cast<StdioConsole *>(context)->input_);
+  };
+  auto ready = [](void *context) {
+    int fd = fileno(static_cast<StdioConsole *>(context)->input_);
+    if (fd < 0) {
+      return true;
+    }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(fd, &read_fds);
+
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    return select(fd + 1, &read_fds, NULL, NULL, &timeout) != 0;
+  };
+  auto write = [](void *context, const char *data, size_t size) {
+    std::FILE *output = static_cast<StdioConsole *>(context)->output_;
+    std::fwrite(data, 1, size, output);
+    std::fflush(output);
+  };
+  return {read, ready, write, this};
+}
+
+Console StringConsole::console() {
+  auto read = [](void *context) {
+    auto *self = static_cast<StringConsole *>(context);
+    if (self->position_ == self->input_.size()) {
+      return EOF;
+    }
+    return static_cast<int>(
+        static_cast<uint8_t>(self->input_[self->position_++]));
+  };
+  auto ready = [](void *) { return true; };
+  auto write = [](void *context, const char *data, size_t size) {
+    static_cast<StringConsole *>(context)->output_.append(data, size);
+  };
+  return {read, ready, write, this};
+}
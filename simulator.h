@@ -0,0 +1,1136 @@
+#ifndef LC3_SIMULATOR_H_
+#define LC3_SIMULATOR_H_
+
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "block_device.h"
+#include "image_cache.h"
+#include "memory_pool.h"
+#include "isa.h"
+#include "observer.h"
+
+// The host side of the keyboard and display. read() returns the next byte,
+// or EOF at end of input; it may block, or return kConsoleWouldBlock to make
+// a GETC or IN stop Run() with kWaitingForInput. ready() tells whether
+// read() would return at once; a console whose read() never blocks may
+// always say so. A KBSR read that then gets kConsoleWouldBlock makes Run()
+// stop with kWaitingForInput at the end of the block, once the guest has
+// seen KBSR not ready. Each callback is passed context.
+struct Console {
+  int (*read)(void *context);
+  bool (*ready)(void *context);
+  void (*write)(void *context, const char *data, size_t size);
+  void *context;
+};
+
+constexpr int kConsoleWouldBlock = -2;
+
+// A console with no input that discards its output.
+Console NullConsole();
+
+// A console over stdio streams. Streams without a file descriptor, such as
+// fmemopen() buffers, never block, so they always report input ready.
+class StdioConsole {
+ public:
+  StdioConsole(std::FILE *input, std::FILE *output)
+      : input_(input), output_(output) {}
+
+  Console console();
+
+ private:
+  std::FILE *input_;
+  std::FILE *output_;
+};
+
+// A console that reads from a string and collects the output in another.
+class StringConsole {
+ public:
+  explicit StringConsole(std::string input) : input_(std::move(input)) {}
+
+  Console console();
+
+  const std::string &output() const { return output_; }
+
+ private:
+  std::string input_;
+  size_t position_ = 0;
+  std::string output_;
+};
+
+enum class StopReason {
+  kHalted,           // HALT or a write to MCR cleared the clock
+  kBudgetExhausted,  // the instruction budget or the deadline ran out
+  kWaitingForInput,  // a GETC or IN found no input; rerun when there is some
+  kStopRequested,    // RequestStop() was called
+  kFault             // the machine cannot continue; see error()
+};
+
+constexpr int kMaxOpenFiles = 16;
+constexpr size_t kMaxPathLength = 255;
+
+// How many block boundaries pass between host polls for keyboard input while
+// keyboard interrupts are enabled; polling is a syscall, so keep it rare.
+constexpr int kInterruptPollInterval = 1024;
+
+// How many instructions RunUntil() runs between reads of the clock.
+constexpr uint64_t kDeadlineCheckInterval = 1 << 15;
+
+enum class TrapMode {
+  kNative,  // run the host implementation of the routine
+  kGuest    // jump through the trap vector table into guest OS code
+};
+
+// Cache-line aligned so that machines run by different threads never
+// share a line.
+class alignas(64) Simulator {
+ public:
+  // Guest memory comes from pool if given, else from the heap. With an
+  // image, memory starts as a mapping of it instead, as by MapImage().
+  explicit Simulator(MemoryPool *pool = nullptr,
+                     const ImageCache::Image *image = nullptr)
+      : pool_(pool) {
+    AllocateMemory(image);
+    // set the program counter to starting position
+    registers_[kPC] = kPCStart;
+    registers_[kCOND] = kZero;
+    InitializeMemory(memory_);
+
+    native_traps_.fill(nullptr);
+    native_traps_[kGETC] = &Simulator::TrapGetc;
+    native_traps_[kOUT] = &Simulator::TrapOut;
+    native_traps_[kPUTS] = &Simulator::TrapPuts;
+    native_traps_[kIN] = &Simulator::TrapIn;
+    native_traps_[kPUTSP] = &Simulator::TrapPutsp;
+    native_traps_[kHALT] = &Simulator::TrapHalt;
+    native_traps_[kMEMCPY] = &Simulator::TrapMemmove;
+    native_traps_[kMEMMOVE] = &Simulator::TrapMemmove;
+    native_traps_[kMEMSET] = &Simulator::TrapMemset;
+    native_traps_[kMEMCMP] = &Simulator::TrapMemcmp;
+    native_traps_[kFOPEN] = &Simulator::TrapFopen;
+    native_traps_[kFCLOSE] = &Simulator::TrapFclose;
+    native_traps_[kFREAD] = &Simulator::TrapFread;
+    native_traps_[kFWRITE] = &Simulator::TrapFwrite;
+    native_traps_[kFSEEK] = &Simulator::TrapFseek;
+    SetAllTrapModes(TrapMode::kNative);
+  }
+
+  ~Simulator() {
+    disk_.reset();  // stops DMA into memory
+    ReleaseMemory();
+    for (auto &file : files_) {
+      if (file.fd >= 0) {
+        close(file.fd);
+      }
+    }
+    if (sandbox_fd_ >= 0) {
+      close(sandbox_fd_);
+    }
+  }
+
+  Simulator(const Simulator &) = delete;
+  Simulator &operator=(Simulator &) = delete;
+
+  // Sets the device registers of a fresh memory to their reset values.
+  static void InitializeMemory(uint16_t *memory) {
+    memory[kDSR] = kReady;
+    memory[kMCR] = kClockEnable;
+  }
+
+  // Loads an image from ImageCache into a fresh Simulator by copying its
+  // nonzero segments; memory that was already written is not cleared.
+  void CopyImage(const ImageCache::Image &image) {
+    for (auto [begin, end] : image.segments) {
+      std::copy(image.words + begin, image.words + end, memory_ + begin);
+    }
+  }
+
+  // Replaces all of memory with a private copy-on-write mapping of an image
+  // from ImageCache, so pages are only copied when written. That saves
+  // memory when many long-lived machines run the same images, but every
+  // first touch of a page is a page fault, so short runs are faster with
+  // CopyImage(). Must be called before AttachDisk().
+  bool MapImage(const ImageCache::Image &image) {
+    uint16_t *memory = disk_ ? nullptr : Map(image);
+    if (!memory) {
+      return false;
+    }
+    ReleaseMemory();
+    memory_ = memory;
+    mapped_ = true;
+    return true;
+  }
+
+  // Returns a private copy-on-write mapping of image, or nullptr.
+  static uint16_t *Map(const ImageCache::Image &image) {
+    void *memory = mmap(nullptr, kMemoryBytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE, image.fd, 0);
+    return memory == MAP_FAILED ? nullptr : static_cast<uint16_t *>(memory);
+  }
+
+  // Points memory_ at a mapping of image if one is given and can be made,
+  // else at zeroed memory from the pool or the heap, loaded with image.
+  void AllocateMemory(const ImageCache::Image *image) {
+    memory_ = image ? Map(*image) : nullptr;
+    mapped_ = memory_ != nullptr;
+    if (!mapped_) {
+      memory_ = pool_ ? pool_->Allocate() : new uint16_t[kMemorySize]();
+      if (image) {
+        CopyImage(*image);
+      }
+    }
+  }
+
+  void ReleaseMemory() {
+    if (mapped_) {
+      munmap(memory_, kMemoryBytes);
+    } else if (pool_) {
+      pool_->Free(memory_);
+    } else {
+      delete[] memory_;
+    }
+    mapped_ = false;
+  }
+
+  // Returns the machine to its power-on state for another program, keeping
+  // its configuration: trap modes, sandbox, console, memory pool and disk.
+  // With an image, memory becomes a mapping of it, as by MapImage(), and no
+  // pool memory is taken. Open files are closed. A disk transfer must not
+  // be in flight.
+  void Reset(const ImageCache::Image *image = nullptr) {
+    if (mapped_ || image) {
+      ReleaseMemory();
+      AllocateMemory(image);
+      if (disk_) {
+        disk_->SetMemory(memory_);
+      }
+    } else {
+      std::fill_n(memory_, kMemorySize, 0);
+    }
+    InitializeMemory(memory_);
+    registers_ = {};
+    registers_[kPC] = kPCStart;
+    registers_[kCOND] = kZero;
+    psr_ = kUserMode;
+    saved_ssp_ = kSSPStart;
+    saved_usp_ = 0;
+    instructions_ = 0;
+    traps_ = {};
+    stop_reason_ = StopReason::kHalted;
+    error_.clear();
+    prompted_ = false;
+    events_.store(0, std::memory_order_relaxed);
+    poll_countdown_ = 1;
+    for (auto &file : files_) {
+      if (file.fd >= 0) {
+        close(file.fd);
+      }
+      file = {};
+    }
+  }
+
+  bool AttachDisk(const std::string &filename) {
+    disk_.reset();
+    disk_ = BlockDevice::Open(filename, memory_, &events_);
+    return disk_ != nullptr;
+  }
+
+  // Confines the file traps to paths below dir. Without a sandbox every
+  // FOPEN fails.
+  bool SetSandbox(const std::string &dir) {
+    int fd = open(dir.c_str(), O_DIRECTORY | O_PATH | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    if (sandbox_fd_ >= 0) {
+      close(sandbox_fd_);
+    }
+    sandbox_fd_ = fd;
+    return true;
+  }
+
+  // Selects how a trap vector is serviced. Vectors without a host
+  // implementation always go through the guest trap vector table; returns
+  // false if native mode was requested for one of them.
+  bool SetTrapMode(uint8_t vector, TrapMode mode) {
+    if (mode == TrapMode::kNative && native_traps_[vector]) {
+      trap_table_[vector] = native_traps_[vector];
+      return true;
+    }
+    trap_table_[vector] = &Simulator::TrapGuest;
+    return mode == TrapMode::kGuest;
+  }
+
+  void SetAllTrapModes(TrapMode mode) {
+    for (int vector = 0; vector < kTrapVectorCount; ++vector) {
+      SetTrapMode(vector, mode);
+    }
+  }
+
+  void UpdateFlags(uint16_t r) {
+    if (registers_[r] == 0) {
+      registers_[kCOND] = kZero;
+    } else if (registers_[r] >>
+               15)  // a 1 in the left-most bit indicates negative
+    {
+      registers_[kCOND] = kNegative;
+    } else {
+      registers_[kCOND] = kPositive;
+    }
+  }
+
+  bool ReadImage(const std::string &filename) {
+    return LoadImage(filename, memory_);
+  }
+
+  // Redirects the keyboard and display. The console's context must outlive
+  // its use by this Simulator.
+  void SetConsole(const Console &console) { console_ = console; }
+
+  // Latches a pending host character into KBDR and sets the KBSR ready bit.
+  // At end of input KBDR reads xFFFF, as it does for a closed pipe. Returns
+  // false if the console would block.
+  bool PollKeyboard() {
+    if (!(memory_[kKBSR] & kReady) && console_.ready(console_.context)) {
+      int c = console_.read(console_.context);
+      if (c == kConsoleWouldBlock) {
+        return false;
+      }
+      memory_[kKBDR] = static_cast<uint16_t>(c);
+      memory_[kKBSR] |= kReady;
+    }
+    return true;
+  }
+
+  void Write(const char *data, size_t size) {
+    console_.write(console_.context, data, size);
+  }
+
+  void Put(uint16_t c) {
+    char byte = static_cast<char>(c);
+    Write(&byte, 1);
+  }
+
+  void WriteMemory(uint16_t address, uint16_t x) {
+    if (address >= kMMIOBase) {
+      WriteDevice(address, x);
+      return;
+    }
+    memory_[address] = x;
+  }
+
+  uint16_t ReadMemory(uint16_t address) {
+    if (address >= kMMIOBase) {
+      return ReadDevice(address);
+    }
+    return memory_[address];
+  }
+
+  uint16_t ReadDevice(uint16_t address) {
+    switch (address) {
+      case kKBSR:
+        if (!PollKeyboard()) {
+          events_.fetch_or(kInputEvent, std::memory_order_relaxed);
+        }
+        break;
+      case kKBDR:
+        memory_[kKBSR] &= ~kReady;
+        break;
+      case kDKSR:
+        if (disk_) {
+          uint16_t status = disk_->Acknowledge();
+          return (memory_[kDKSR] & kInterruptEnable) | status;
+        }
+        break;
+    }
+    return memory_[address];
+  }
+
+  void WriteDevice(uint16_t address, uint16_t x) {
+    switch (address) {
+      case kKBSR:
+        // only the interrupt enable bit is writable
+        memory_[kKBSR] = (memory_[kKBSR] & ~kInterruptEnable) |
+                         (x & kInterruptEnable);
+        if (memory_[kKBSR] & kInterruptEnable) {
+          events_.fetch_or(kKeyboardEvent, std::memory_order_relaxed);
+        } else {
+          events_.fetch_and(~kKeyboardEvent, std::memory_order_relaxed);
+        }
+        poll_countdown_ = 1;
+        break;
+      case kDKSR:
+        memory_[kDKSR] = x & kInterruptEnable;
+        // a transfer may have finished while interrupts were disabled
+        events_.fetch_or(kDiskEvent, std::memory_order_relaxed);
+        break;
+      case kDKCR:
+        if (disk_) {
+          disk_->Acknowledge();
+          disk_->Start(x, memory_[kDKBR], memory_[kDKAR]);
+        }
+        break;
+      case kDDR:
+        Put(x);
+        break;
+      case kMCR:
+        memory_[kMCR] = x;
+        if (!(x & kClockEnable)) {
+          running_ = false;
+        }
+        break;
+      default:
+        memory_[address] = x;
+        break;
+    }
+  }
+
+  uint16_t PSR() const { return psr_ | registers_[kCOND]; }
+
+  uint16_t Priority() const {
+    return (psr_ & kPriorityMask) >> kPriorityShift;
+  }
+
+  // Stops the machine; Run() reports kFault from now on.
+  void Fault(const std::string &message) {
+    error_ = message;
+    stop_reason_ = StopReason::kFault;
+    running_ = false;
+  }
+
+  void Push(uint16_t x) { WriteMemory(--registers_[kR6], x); }
+
+  uint16_t Pop() { return ReadMemory(registers_[kR6]++); }
+
+  // Enters the handler at the given vector table entry, switching to the
+  // supervisor stack if the processor is in user mode. A negative priority
+  // keeps the current one, as exceptions do.
+  void Interrupt(uint16_t table, uint16_t vector, int priority) {
+    uint16_t psr = PSR();
+    uint16_t handler = memory_[table + vector];
+    if (handler == 0) {
+      char message[64];
+      std::snprintf(message, sizeof(message),
+                    "no %s handler for vector x%02X at x%04X",
+                    table == kTrapTable ? "trap" : "interrupt", vector,
+                    registers_[kPC]);
+      Fault(message);
+      return;
+    }
+    if (psr & kUserMode) {
+      saved_usp_ = registers_[kR6];
+      registers_[kR6] = saved_ssp_;
+    }
+    Push(psr);
+    Push(registers_[kPC]);
+    psr_ &= ~kUserMode;
+    if (priority >= 0) {
+      psr_ = (psr_ & ~kPriorityMask) | (priority << kPriorityShift);
+    }
+    registers_[kPC] = handler;
+  }
+
+  void ReturnFromInterrupt() {
+    registers_[kPC] = Pop();
+    uint16_t psr = Pop();
+    psr_ = psr & (kUserMode | kPriorityMask);
+    registers_[kCOND] = psr & (kNegative | kZero | kPositive);
+    if (psr_ & kUserMode) {
+      saved_ssp_ = registers_[kR6];
+      registers_[kR6] = saved_usp_;
+    }
+  }
+
+  // Called after every control transfer. Interrupts are only recognized at
+  // these block boundaries, so the common case is a single untaken branch.
+  void EndBlock() {
+    if (events_.load(std::memory_order_relaxed)) {
+      CheckInterrupts();
+    }
+    block_pc_.store(registers_[kPC], std::memory_order_relaxed);
+  }
+
+  // Takes the highest-priority pending interrupt that outranks the current
+  // priority level, then stops for input if a KBSR read found none.
+  void CheckInterrupts() {
+    uint32_t events = events_.load(std::memory_order_relaxed);
+    uint16_t pc = registers_[kPC];
+    if (events & kStopEvent) {
+      events_.fetch_and(~kStopEvent, std::memory_order_relaxed);
+      stop_reason_ = StopReason::kStopRequested;
+      running_ = false;
+      return;
+    }
+    if (events & kDiskEvent) {
+      // clear first so that a completion racing with this check re-arms it
+      events_.fetch_and(~kDiskEvent, std::memory_order_relaxed);
+      if (disk_ && (memory_[kDKSR] & kInterruptEnable)) {
+        if (Priority() < kDiskPriority) {
+          if (disk_->Acknowledge() & kDone) {
+            Interrupt(kInterruptTable, kDiskInterrupt, kDiskPriority);
+          }
+        } else if (disk_->Status() & kDone) {
+          events_.fetch_or(kDiskEvent, std::memory_order_relaxed);
+        }
+      }
+    }
+    if (events & kKeyboardEvent) {
+      if (--poll_countdown_ <= 0) {
+        poll_countdown_ = kInterruptPollInterval;
+        PollKeyboard();
+      }
+      uint16_t kbsr = memory_[kKBSR];
+      if ((kbsr & kReady) && Priority() < kKeyboardPriority) {
+        Interrupt(kInterruptTable, kKeyboardInterrupt, kKeyboardPriority);
+      }
+    }
+    if (events & kInputEvent) {
+      events_.fetch_and(~kInputEvent, std::memory_order_relaxed);
+      // a handler just entered runs first; the guest polls again later
+      if (running_ && registers_[kPC] == pc) {
+        stop_reason_ = StopReason::kWaitingForInput;
+        running_ = false;
+      }
+    }
+  }
+
+  void TrapGuest(uint8_t vector) { Interrupt(kTrapTable, vector, -1); }
+
+  // Backs up to the TRAP so that the next Run() retries it.
+  void WaitForInput() {
+    --registers_[kPC];
+    --instructions_;
+    --traps_[TrapVector(memory_[registers_[kPC]])];
+    stop_reason_ = StopReason::kWaitingForInput;
+    running_ = false;
+  }
+
+  void TrapGetc(uint8_t) {
+    int c = console_.read(console_.context);
+    if (c == kConsoleWouldBlock) {
+      WaitForInput();
+      return;
+    }
+    registers_[kR0] = static_cast<uint16_t>(c);
+  }
+
+  void TrapOut(uint8_t) { Put(registers_[kR0]); }
+
+  // The string trap outputs are collected so that each is a single write.
+  // A string that runs past xFFFF wraps to x0000, as addresses do; one with
+  // no terminator anywhere in memory faults rather than looping forever.
+  void TrapPuts(uint8_t) {
+    size_t length = StringLength(memory_, registers_[kR0]);
+    if (length == kMemorySize) {
+      UnterminatedString();
+      return;
+    }
+    std::string s;
+    for (uint16_t a = registers_[kR0]; length-- > 0; ++a) {
+      s.push_back(static_cast<char>(memory_[a]));
+    }
+    Write(s.data(), s.size());
+  }
+
+  void UnterminatedString() {
+    char message[64];
+    std::snprintf(message, sizeof(message),
+                  "no terminator for the string at x%04X", registers_[kR0]);
+    Fault(message);
+  }
+
+  void TrapIn(uint8_t) {
+    static constexpr char kPrompt[] = "Enter a character: ";
+    if (!prompted_) {
+      Write(kPrompt, sizeof(kPrompt) - 1);
+    }
+    int c = console_.read(console_.context);
+    prompted_ = c == kConsoleWouldBlock;
+    if (prompted_) {
+      WaitForInput();
+      return;
+    }
+    Put(c);
+    registers_[kR0] = static_cast<uint16_t>(c);
+  }
+
+  void TrapPutsp(uint8_t) {
+    size_t length = StringLength(memory_, registers_[kR0]);
+    if (length == kMemorySize) {
+      UnterminatedString();
+      return;
+    }
+    std::string s;
+    for (uint16_t a = registers_[kR0]; length-- > 0; ++a) {
+      s.push_back(static_cast<char>(memory_[a] & 0xFF));
+      if (memory_[a] >> 8) {
+        s.push_back(static_cast<char>(memory_[a] >> 8));
+      }
+    }
+    Write(s.data(), s.size());
+  }
+
+  void TrapHalt(uint8_t) {
+    Write("HALT\n", 5);
+    running_ = false;
+  }
+
+  // True if [address, address + count) neither wraps around the address
+  // space nor touches device registers, so it can be handled as one block of
+  // host memory.
+  static bool IsPlainRange(uint16_t address, uint16_t count) {
+    return address + count <= kMMIOBase;
+  }
+
+  void TrapMemmove(uint8_t) {
+    uint16_t dst = registers_[kR0];
+    uint16_t src = registers_[kR1];
+    uint16_t count = registers_[kR2];
+    if (IsPlainRange(dst, count) && IsPlainRange(src, count)) {
+      std::memmove(&memory_[dst], &memory_[src], count * sizeof(uint16_t));
+      return;
+    }
+    // copy backwards when the destination starts inside the source
+    if (static_cast<uint16_t>(dst - src) < count) {
+      for (uint16_t i = count; i-- > 0;) {
+        WriteMemory(dst + i, ReadMemory(src + i));
+      }
+    } else {
+      for (uint16_t i = 0; i < count; ++i) {
+        WriteMemory(dst + i, ReadMemory(src + i));
+      }
+    }
+  }
+
+  void TrapMemset(uint8_t) {
+    uint16_t dst = registers_[kR0];
+    uint16_t value = registers_[kR1];
+    uint16_t count = registers_[kR2];
+    if (IsPlainRange(dst, count)) {
+      std::fill_n(&memory_[dst], count, value);
+      return;
+    }
+    for (uint16_t i = 0; i < count; ++i) {
+      WriteMemory(dst + i, value);
+    }
+  }
+
+  void TrapMemcmp(uint8_t) {
+    uint16_t a = registers_[kR0];
+    uint16_t b = registers_[kR1];
+    uint16_t count = registers_[kR2];
+    uint16_t result = 0;
+    if (IsPlainRange(a, count) && IsPlainRange(b, count)) {
+      // skip equal chunks with the host's vectorized memcmp, then find the
+      // differing word
+      constexpr uint16_t kChunk = 32;
+      uint16_t i = 0;
+      while (count - i >= kChunk &&
+             std::memcmp(&memory_[a + i], &memory_[b + i],
+                         kChunk * sizeof(uint16_t)) == 0) {
+        i += kChunk;
+      }
+      while (i < count && memory_[a + i] == memory_[b + i]) ++i;
+      if (i < count) {
+        result = memory_[a + i] < memory_[b + i] ? 0xFFFF : 1;
+      }
+    } else {
+      for (uint16_t i = 0; i < count && result == 0; ++i) {
+        uint16_t x = ReadMemory(a + i);
+        uint16_t y = ReadMemory(b + i);
+        if (x != y) {
+          result = x < y ? 0xFFFF : 1;
+        }
+      }
+    }
+    registers_[kR0] = result;
+    UpdateFlags(kR0);
+  }
+
+  void SetResult(int result) {
+    registers_[kR0] = static_cast<uint16_t>(result);
+    UpdateFlags(kR0);
+  }
+
+  // Opens path relative to the sandbox without letting it escape through
+  // "..", absolute paths or symbolic links.
+  int OpenInSandbox(const std::string &path, int flags) {
+    struct open_how how = {};
+    how.flags = flags | O_CLOEXEC;
+    how.mode = (flags & O_CREAT) ? 0644 : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd =
+        syscall(SYS_openat2, sandbox_fd_, path.c_str(), &how, sizeof(how));
+    // kernels before 5.6 lack openat2, and seccomp filters may refuse it
+    if (fd >= 0 || (errno != ENOSYS && errno != EPERM)) {
+      return fd;
+    }
+    // walk the path one component at a time, following no symbolic links
+    if (path[0] == '/') {
+      errno = EACCES;
+      return -1;
+    }
+    int dir = sandbox_fd_;
+    size_t begin = 0;
+    while (true) {
+      size_t end = path.find('/', begin);
+      std::string name = path.substr(begin, end - begin);
+      if (name == "..") {
+        fd = -1;
+        errno = EACCES;
+      } else if (end == std::string::npos) {
+        fd = openat(dir, name.c_str(), flags | O_CLOEXEC | O_NOFOLLOW, 0644);
+      } else {
+        fd = openat(dir, name.empty() ? "." : name.c_str(),
+                    O_PATH | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+      }
+      int error = errno;
+      if (dir != sandbox_fd_) {
+        close(dir);
+      }
+      errno = error;
+      if (fd < 0 || end == std::string::npos) {
+        return fd;
+      }
+      dir = fd;
+      begin = end + 1;
+    }
+  }
+
+  struct OpenFile {
+    int fd = -1;
+    off_t offset = 0;  // in bytes
+  };
+
+  OpenFile *FileHandle(uint16_t handle) {
+    if (handle >= kMaxOpenFiles || files_[handle].fd < 0) {
+      return nullptr;
+    }
+    return &files_[handle];
+  }
+
+  // Clamps a transfer so it stays in plain memory below the device page,
+  // and so that its word count cannot be mistaken for the -1 of a failure.
+  static uint16_t TransferLength(uint16_t address, uint16_t count) {
+    constexpr int kMaxTransfer = 0x7FFF;
+    return address >= kMMIOBase
+               ? 0
+               : std::min({int{count}, kMMIOBase - address, kMaxTransfer});
+  }
+
+  void TrapFopen(uint8_t) {
+    static constexpr int kOpenFlags[] = {
+        O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_RDWR | O_CREAT};
+    uint16_t mode = registers_[kR1];
+    int slot = 0;
+    while (slot < kMaxOpenFiles && files_[slot].fd >= 0) ++slot;
+    if (sandbox_fd_ < 0 || mode > kFileReadWrite || slot == kMaxOpenFiles) {
+      SetResult(-1);
+      return;
+    }
+    std::string path;
+    for (uint16_t address = registers_[kR0]; memory_[address]; ++address) {
+      if (path.size() == kMaxPathLength) {
+        SetResult(-1);
+        return;
+      }
+      path.push_back(static_cast<char>(memory_[address]));
+    }
+    int fd = path.empty() ? -1 : OpenInSandbox(path, kOpenFlags[mode]);
+    if (fd < 0) {
+      SetResult(-1);
+      return;
+    }
+    files_[slot] = {fd, 0};
+    SetResult(slot);
+  }
+
+  void TrapFclose(uint8_t) {
+    OpenFile *file = FileHandle(registers_[kR0]);
+    if (!file) {
+      SetResult(-1);
+      return;
+    }
+    close(file->fd);
+    *file = {};
+    SetResult(0);
+  }
+
+  // Reads straight into guest memory, then converts the words in place.
+  void TrapFread(uint8_t) {
+    OpenFile *file = FileHandle(registers_[kR0]);
+    uint16_t address = registers_[kR1];
+    uint16_t count = TransferLength(address, registers_[kR2]);
+    if (!file) {
+      SetResult(-1);
+      return;
+    }
+    uint16_t *begin = memory_ + address;
+    struct iovec iov = {begin, count * sizeof(uint16_t)};
+    ssize_t nread = preadv(file->fd, &iov, 1, file->offset);
+    if (nread < 0) {
+      SetResult(-1);
+      return;
+    }
+    uint16_t words = (nread + 1) / sizeof(uint16_t);
+    file->offset += words * sizeof(uint16_t);
+    if (nread % sizeof(uint16_t)) {
+      // a trailing odd byte becomes the high byte of the last word
+      reinterpret_cast<uint8_t *>(begin + words)[-1] = 0;
+    }
+    std::transform(begin, begin + words, begin, Swap16);
+    SetResult(words);
+  }
+
+  // Converts the words to file order in place, writes them and converts
+  // them back.
+  void TrapFwrite(uint8_t) {
+    OpenFile *file = FileHandle(registers_[kR0]);
+    uint16_t address = registers_[kR1];
+    uint16_t count = TransferLength(address, registers_[kR2]);
+    if (!file) {
+      SetResult(-1);
+      return;
+    }
+    uint16_t *begin = memory_ + address;
+    std::transform(begin, begin + count, begin, Swap16);
+    struct iovec iov = {begin, count * sizeof(uint16_t)};
+    ssize_t nwritten = pwritev(file->fd, &iov, 1, file->offset);
+    std::transform(begin, begin + count, begin, Swap16);
+    if (nwritten < 0) {
+      SetResult(-1);
+      return;
+    }
+    // a partial write counts whole words, keeping the offset on a word
+    uint16_t words = nwritten / sizeof(uint16_t);
+    file->offset += words * sizeof(uint16_t);
+    SetResult(words);
+  }
+
+  void TrapFseek(uint8_t) {
+    OpenFile *file = FileHandle(registers_[kR0]);
+    if (!file) {
+      SetResult(-1);
+      return;
+    }
+    uint32_t words = (registers_[kR1] << 16) | registers_[kR2];
+    file->offset = static_cast<off_t>(words) * sizeof(uint16_t);
+    SetResult(0);
+  }
+
+  uint64_t instructions() const { return instructions_; }
+
+  // TRAPs executed with vector, like instructions().
+  uint64_t traps(uint8_t vector) const { return traps_[vector]; }
+
+  // Why the last Run() or Step() stopped, and for kFault, what went wrong.
+  StopReason stop_reason() const { return stop_reason_; }
+  const std::string &error() const { return error_; }
+
+  uint16_t ReadRegister(int r) const { return registers_[r]; }
+
+  // Where the block being run began. Unlike the PC, which the interpreter
+  // may keep in a host register, this is stored at every block boundary,
+  // so a signal handler interrupting Run() on the same thread can read it.
+  uint16_t block_pc() const {
+    return block_pc_.load(std::memory_order_relaxed);
+  }
+  void WriteRegister(int r, uint16_t x) { registers_[r] = x; }
+
+  // Memory access that bypasses the device registers.
+  uint16_t PeekMemory(uint16_t address) const { return memory_[address]; }
+  void PokeMemory(uint16_t address, uint16_t x) { memory_[address] = x; }
+
+  // Makes a running Run() return kStopRequested at the next block boundary.
+  // Safe to call from another thread or a signal handler.
+  void RequestStop() {
+    events_.fetch_or(kStopEvent, std::memory_order_relaxed);
+  }
+
+  // Runs until the machine stops or roughly max_instructions more
+  // instructions have retired; the budget is only checked at block
+  // boundaries, as LockstepEngine checks it. Calling Run() again resumes,
+  // except after a fault.
+  // observer sees every instruction; see observer.h.
+  template <typename Observer = NullObserver>
+  StopReason Run(uint64_t max_instructions = UINT64_MAX,
+                 Observer &&observer = Observer()) {
+    if (!error_.empty()) {
+      return StopReason::kFault;
+    }
+    running_ = true;
+    stop_reason_ = StopReason::kHalted;
+    block_pc_.store(registers_[kPC], std::memory_order_relaxed);
+    uint64_t stop_at = max_instructions > UINT64_MAX - instructions_
+                           ? UINT64_MAX
+                           : instructions_ + max_instructions;
+    while (running_) {
+      if (instructions_ >= stop_at) {
+        return stop_reason_ = StopReason::kBudgetExhausted;
+      }
+      RunBlock(observer);
+    }
+    return stop_reason_;
+  }
+
+  // Like Run(), but also stops with kBudgetExhausted once deadline has
+  // passed, which lets a scheduler give many machines fair time slices.
+  template <typename Observer = NullObserver>
+  StopReason RunUntil(std::chrono::steady_clock::time_point deadline,
+                      uint64_t max_instructions = UINT64_MAX,
+                      Observer &&observer = Observer()) {
+    while (true) {
+      uint64_t start = instructions_;
+      StopReason reason =
+          Run(std::min(max_instructions, kDeadlineCheckInterval), observer);
+      max_instructions -= std::min(max_instructions, instructions_ - start);
+      if (reason != StopReason::kBudgetExhausted || max_instructions == 0 ||
+          std::chrono::steady_clock::now() >= deadline) {
+        return reason;
+      }
+    }
+  }
+
+  // Executes one instruction; returns false once the machine has stopped.
+  template <typename Observer = NullObserver>
+  bool Step(Observer &&observer = Observer()) {
+    if (!error_.empty()) {
+      return false;
+    }
+    running_ = true;
+    stop_reason_ = StopReason::kHalted;
+    if (ExecuteInstruction(observer)) {
+      EndBlock();
+    }
+    return running_;
+  }
+
+  // Executes instructions up to and including the next control transfer.
+  template <typename Observer>
+  void RunBlock(Observer &observer) {
+    while (running_) {
+      if (ExecuteInstruction(observer)) {
+        EndBlock();
+        return;
+      }
+    }
+  }
+
+  // Executes the instruction at PC; returns true if it ended a block.
+  template <typename Observer>
+  __attribute__((always_inline)) bool ExecuteInstruction(Observer &observer) {
+    ++instructions_;
+    uint16_t pc = registers_[kPC]++;
+    uint16_t instr = ReadMemory(pc);
+    uint16_t op = instr >> 12;
+    observer.Execute(pc, instr);
+
+    switch (op) {
+      case kADD: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t r1 = BaseField(instr);
+        bool immediate = ImmediateFlag(instr);
+        if (immediate) {
+          uint16_t imm5 = Immediate5(instr);
+          registers_[r0] = registers_[r1] + imm5;
+        } else {
+          uint16_t r2 = SourceField(instr);
+          registers_[r0] = registers_[r1] + registers_[r2];
+        }
+        UpdateFlags(r0);
+        observer.Result(r0, registers_[r0]);
+      } break;
+
+      case kAND: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t r1 = BaseField(instr);
+        bool immediate = ImmediateFlag(instr);
+        if (immediate) {
+          uint16_t imm5 = Immediate5(instr);
+          registers_[r0] = registers_[r1] & imm5;
+        } else {
+          uint16_t r2 = SourceField(instr);
+          registers_[r0] = registers_[r1] & registers_[r2];
+        }
+        UpdateFlags(r0);
+        observer.Result(r0, registers_[r0]);
+      } break;
+
+      case kNOT: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t r1 = BaseField(instr);
+        registers_[r0] = ~registers_[r1];
+        UpdateFlags(r0);
+        observer.Result(r0, registers_[r0]);
+      } break;
+
+      case kBR: {
+        uint16_t pc_offset = PCOffset9(instr);
+        uint16_t condition = RegisterField(instr);
+        if (condition & registers_[kCOND]) {
+          registers_[kPC] += pc_offset;
+        }
+        return true;
+      }
+
+      case kJMP: {
+        uint16_t r1 = BaseField(instr);
+        registers_[kPC] = registers_[r1];
+        return true;
+      }
+
+      case kJSR: {
+        bool long_flag = LongFlag(instr);
+        uint16_t return_address = registers_[kPC];
+        if (long_flag) {  // JSR
+          uint16_t longpc_offset = PCOffset11(instr);
+          registers_[kPC] += longpc_offset;
+        } else {  // JSRR
+          uint16_t r1 = BaseField(instr);
+          registers_[kPC] = registers_[r1];
+        }
+        registers_[kR7] = return_address;
+        observer.Result(kR7, return_address);
+        return true;
+      }
+
+      case kLD: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t pc_offset = PCOffset9(instr);
+        uint16_t address = registers_[kPC] + pc_offset;
+        registers_[r0] = ReadMemory(address);
+        UpdateFlags(r0);
+        observer.Load(address, registers_[r0]);
+        observer.Result(r0, registers_[r0]);
+      } break;
+
+      case kLDI: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t pc_offset = PCOffset9(instr);
+        uint16_t pointer = registers_[kPC] + pc_offset;
+        uint16_t address = ReadMemory(pointer);
+        observer.Load(pointer, address);
+        registers_[r0] = ReadMemory(address);
+        UpdateFlags(r0);
+        observer.Load(address, registers_[r0]);
+        observer.Result(r0, registers_[r0]);
+      } break;
+
+      case kLDR: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t r1 = BaseField(instr);
+        uint16_t pc_offset = Offset6(instr);
+        uint16_t address = registers_[r1] + pc_offset;
+        registers_[r0] = ReadMemory(address);
+        UpdateFlags(r0);
+        observer.Load(address, registers_[r0]);
+        observer.Result(r0, registers_[r0]);
+      } break;
+
+      case kLEA: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t pc_offset = PCOffset9(instr);
+        registers_[r0] = registers_[kPC] + pc_offset;
+        UpdateFlags(r0);
+        observer.Result(r0, registers_[r0]);
+      } break;
+
+      case kST: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t pc_offset = PCOffset9(instr);
+        uint16_t address = registers_[kPC] + pc_offset;
+        observer.Store(address, registers_[r0]);
+        WriteMemory(address, registers_[r0]);
+      } break;
+
+      case kSTI: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t pc_offset = PCOffset9(instr);
+        uint16_t pointer = registers_[kPC] + pc_offset;
+        uint16_t address = ReadMemory(pointer);
+        observer.Load(pointer, address);
+        observer.Store(address, registers_[r0]);
+        WriteMemory(address, registers_[r0]);
+      } break;
+
+      case kSTR: {
+        uint16_t r0 = RegisterField(instr);
+        uint16_t r1 = BaseField(instr);
+        uint16_t offset = Offset6(instr);
+        uint16_t address = registers_[r1] + offset;
+        observer.Store(address, registers_[r0]);
+        WriteMemory(address, registers_[r0]);
+      } break;
+
+      case kTRAP: {
+        uint8_t vector = TrapVector(instr);
+        ++traps_[vector];
+        (this->*trap_table_[vector])(vector);
+        if (stop_reason_ == StopReason::kWaitingForInput) {
+          observer.Retry(pc, instr);
+        }
+        return true;
+      }
+
+      case kRTI: {
+        if (psr_ & kUserMode) {
+          Interrupt(kInterruptTable, kPrivilegeViolation, -1);
+        } else {
+          ReturnFromInterrupt();
+        }
+        return true;
+      }
+
+      case kRES:
+      default:
+        Interrupt(kInterruptTable, kIllegalOpcode, -1);
+        return true;
+    }
+    return false;
+  }
+
+ private:
+  uint16_t *memory_ = nullptr;  // kMemorySize words
+  MemoryPool *pool_;            // guest memory comes from this pool if set
+  bool mapped_ = false;         // memory_ is a mapping of an image
+  std::array<uint16_t, Register::kRegisterCount> registers_{};
+  uint16_t psr_ = kUserMode;  // privilege and priority; NZP lives in kCOND
+  uint16_t saved_ssp_ = kSSPStart;
+  uint16_t saved_usp_ = 0;
+  bool running_ = false;
+  uint64_t instructions_ = 0;  // retired so far
+  std::array<uint64_t, 256> traps_{};  // by vector
+  StopReason stop_reason_ = StopReason::kHalted;
+  std::string error_;  // set by Fault()
+  Console console_ = NullConsole();
+  bool prompted_ = false;  // IN is waiting for input after its prompt
+  std::atomic<uint32_t> events_{0};  // Event bits; nonzero is rare
+  std::atomic<uint16_t> block_pc_{kPCStart};  // see block_pc()
+  int poll_countdown_ = 1;
+
+  using TrapHandler = void (Simulator::*)(uint8_t vector);
+  static constexpr int kTrapVectorCount = 256;
+  std::array<TrapHandler, kTrapVectorCount> native_traps_;
+  std::array<TrapHandler, kTrapVectorCount> trap_table_;
+
+  int sandbox_fd_ = -1;
+  std::array<OpenFile, kMaxOpenFiles> files_;
+
+  std::unique_ptr<BlockDevice> disk_;
+};
+
+#endif  // LC3_SIMULATOR_H_
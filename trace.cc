@@ -0,0 +1,265 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+uint8_t *PutVarint(uint32_t x, uint8_t *out) {
+  while (x >= 0x80) {
+    *out++ = static_cast<uint8_t>(x | 0x80);
+    x >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(x);
+  return out;
+}
+
+// Reads a varint of at most 16 bits.
+bool GetVarint(const uint8_t **in, const uint8_t *end, uint16_t *x) {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 21; shift += 7) {
+    if (*in == end) {
+      return false;
+    }
+    uint8_t byte = *(*in)++;
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      *x = static_cast<uint16_t>(value);
+      return value <= 0xFFFF;
+    }
+  }
+  return false;
+}
+
+// Maps small differences of either sign to small numbers.
+uint16_t ZigZag(uint16_t difference) {
+  int16_t d = static_cast<int16_t>(difference);
+  return static_cast<uint16_t>((d << 1) ^ (d >> 15));
+}
+
+uint16_t UnZigZag(uint16_t x) { return (x >> 1) ^ -(x & 1); }
+
+}  // namespace
+
+void TraceCodec::Reset() {
+  pc_ = 0xFFFF;
+  address_ = 0;
+  if (++generation_ > 0xFFFF) {
+    std::fill(shadow_.begin(), shadow_.end(), 0);
+    generation_ = 1;
+  }
+}
+
+uint8_t *TraceCodec::Encode(const TraceRecord &record, uint8_t *out) {
+  uint8_t tag = 0;
+  uint16_t expected = pc_ + 1;
+  if (record.pc != expected) {
+    tag |= kTagJump;
+  }
+  uint32_t known = generation_ << 16 | record.instr;
+  if (shadow_[record.pc] != known) {
+    shadow_[record.pc] = known;
+    tag |= kTagInstruction;
+  }
+  *out++ = tag;
+  if (tag & kTagJump) {
+    out = PutVarint(ZigZag(record.pc - expected), out);
+  }
+  if (tag & kTagInstruction) {
+    *out++ = static_cast<uint8_t>(record.instr);
+    *out++ = static_cast<uint8_t>(record.instr >> 8);
+  }
+  pc_ = record.pc;
+
+  switch (record.instr >> 12) {
+    case kADD:
+    case kAND:
+    case kNOT:
+      return PutVarint(record.result, out);
+
+    case kLD:
+    case kST:  // the address is PC-relative
+      return PutVarint(record.value, out);
+
+    case kLDR:
+    case kLDI:
+    case kSTR:
+    case kSTI:
+      out = PutVarint(ZigZag(record.address - address_), out);
+      address_ = record.address;
+      return PutVarint(record.value, out);
+
+    default:
+      return out;
+  }
+}
+
+bool TraceCodec::Decode(const uint8_t **in, const uint8_t *end,
+                        TraceRecord *record) {
+  uint8_t tag = *(*in)++;
+  uint16_t pc = pc_ + 1;
+  if (tag & kTagJump) {
+    uint16_t difference;
+    if (!GetVarint(in, end, &difference)) {
+      return false;
+    }
+    pc += UnZigZag(difference);
+  }
+  uint16_t instr;
+  if (tag & kTagInstruction) {
+    if (end - *in < 2) {
+      return false;
+    }
+    instr = (*in)[0] | (*in)[1] << 8;
+    *in += 2;
+    shadow_[pc] = generation_ << 16 | instr;
+  } else if (shadow_[pc] >> 16 == generation_) {
+    instr = static_cast<uint16_t>(shadow_[pc]);
+  } else {
+    return false;
+  }
+  pc_ = pc;
+
+  *record = {pc, instr, 0, 0, 0};
+  uint16_t pc_relative = pc + 1 + PCOffset9(instr);
+  switch (instr >> 12) {
+    case kADD:
+    case kAND:
+    case kNOT:
+      return GetVarint(in, end, &record->result);
+
+    case kLEA:
+      record->result = pc_relative;
+      return true;
+
+    case kJSR:
+      record->result = pc + 1;
+      return true;
+
+    case kLD:
+    case kST:
+      record->address = pc_relative;
+      if (!GetVarint(in, end, &record->value)) {
+        return false;
+      }
+      break;
+
+    case kLDR:
+    case kLDI:
+    case kSTR:
+    case kSTI: {
+      uint16_t difference;
+      if (!GetVarint(in, end, &difference) ||
+          !GetVarint(in, end, &record->value)) {
+        return false;
+      }
+      address_ += UnZigZag(difference);
+      record->address = address_;
+    } break;
+
+    default:
+      return true;
+  }
+  if (TraceFields(instr) & kTraceResult) {
+    record->result = record->value;  // a load
+  }
+  return true;
+}
+
+bool TraceRecorder::Open(const std::string &filename) {
+  file_ = std::fopen(filename.c_str(), "wb");
+  if (!file_) {
+    return false;
+  }
+  TraceFileHeader header = {};
+  std::copy(kTraceMagic, kTraceMagic + sizeof(kTraceMagic), header.magic);
+  header.chunk_records = kChunkRecords;
+  failed_ = std::fwrite(&header, sizeof(header), 1, file_) != 1;
+  ring_.reset(new TraceRecord[kRingSize]);
+  chunk_.reset(new uint8_t[kChunkRecords * TraceCodec::kMaxRecordSize]);
+  chunk_end_ = chunk_.get();
+  codec_.Reset();
+  compressor_ = std::thread(&TraceRecorder::Compress, this);
+  return true;
+}
+
+bool TraceRecorder::Finish() {
+  if (!compressor_.joinable()) {
+    return !failed_;
+  }
+  if (pending_) {
+    Push();
+    pending_ = false;
+  }
+  published_.store(head_);
+  done_.store(true);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wakeup_.notify_one();
+  }
+  compressor_.join();
+  if (std::fclose(file_) != 0) {
+    failed_ = true;
+  }
+  file_ = nullptr;
+  return !failed_;
+}
+
+void TraceRecorder::Reserve() {
+  while (head_ + kBatchSize - tail_.load(std::memory_order_acquire) >
+         kRingSize) {
+    std::this_thread::yield();
+  }
+}
+
+void TraceRecorder::Publish() {
+  published_.store(head_);
+  if (idle_.load()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wakeup_.notify_one();
+  }
+}
+
+void TraceRecorder::Compress() {
+  uint64_t tail = 0;
+  while (true) {
+    uint64_t published = published_.load();
+    if (tail == published) {
+      if (done_.load() && published_.load() == tail) {
+        break;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_.store(true);
+      if (published_.load() == tail && !done_.load()) {
+        wakeup_.wait_for(lock, std::chrono::milliseconds(10));
+      }
+      idle_.store(false);
+      continue;
+    }
+    while (tail < published) {
+      chunk_end_ = codec_.Encode(ring_[tail % kRingSize], chunk_end_);
+      if (++chunk_records_ == kChunkRecords) {
+        WriteChunk();
+      }
+      if (++tail % kBatchSize == 0) {
+        tail_.store(tail, std::memory_order_release);
+      }
+    }
+    tail_.store(tail, std::memory_order_release);
+  }
+  if (chunk_records_) {
+    WriteChunk();
+  }
+}
+
+void TraceRecorder::WriteChunk() {
+  size_t size = chunk_end_ - chunk_.get();
+  TraceChunkHeader header = {chunk_records_, static_cast<uint32_t>(size)};
+  if (std::fwrite(&header, sizeof(header), 1, file_) != 1 ||
+      std::fwrite(chunk_.get(), 1, size, file_) != size) {
+    failed_ = true;
+  }
+  chunk_end_ = chunk_.get();
+  chunk_records_ = 0;
+  codec_.Reset();
+}
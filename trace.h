@@ -0,0 +1,190 @@
+#ifndef LC3_TRACE_H_
+#define LC3_TRACE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "isa.h"
+#include "observer.h"
+
+// Execution traces record every retired instruction. A trace file is a
+// TraceFileHeader followed by chunks, each a TraceChunkHeader and its
+// encoded records. Chunks are encoded independently, so that readers can
+// decode them in parallel.
+//
+// Each record starts with a tag byte. Unless the PC is the previous one
+// plus one, the tag has kTagJump set and a zigzag varint of the difference
+// follows. Unless the instruction word is the one last seen at that PC in
+// this chunk, the tag has kTagInstruction set and the word follows, little
+// endian. Then come the fields of TraceFields(instr) that cannot be worked
+// out from the PC and the instruction: see TraceCodec.
+
+struct TraceRecord {
+  uint16_t pc;
+  uint16_t instr;
+  uint16_t result;   // the destination register's new value
+  uint16_t address;  // the memory access's address; for LDI and STI, the
+                     // pointer's target
+  uint16_t value;    // the value read or written there
+};
+
+enum TraceField {
+  kTraceResult = 1 << 0,
+  kTraceAddress = 1 << 1,
+  kTraceValue = 1 << 2
+};
+
+// The fields of a record that instr sets; the others are zero.
+inline int TraceFields(uint16_t instr) {
+  switch (instr >> 12) {
+    case kADD:
+    case kAND:
+    case kNOT:
+    case kLEA:
+    case kJSR:
+      return kTraceResult;
+    case kLD:
+    case kLDR:
+    case kLDI:
+      return kTraceResult | kTraceAddress | kTraceValue;
+    case kST:
+    case kSTR:
+    case kSTI:
+      return kTraceAddress | kTraceValue;
+    default:
+      return 0;
+  }
+}
+
+struct TraceFileHeader {
+  char magic[8];  // kTraceMagic
+  uint32_t chunk_records;  // the most records in a chunk
+  uint32_t reserved;
+};
+
+struct TraceChunkHeader {
+  uint32_t records;
+  uint32_t size;  // bytes of encoded records that follow
+};
+
+constexpr char kTraceMagic[8] = "LC3TRC1";
+
+// The state shared by a chunk's encoder and decoder. Both start a chunk
+// with Reset() and then see the same records, so they always agree.
+class TraceCodec {
+ public:
+  TraceCodec() : shadow_(kMemorySize) {}
+
+  void Reset();
+
+  // The most bytes that one record takes.
+  static constexpr size_t kMaxRecordSize = 12;
+
+  // Writes record at out and returns the end of what it wrote.
+  uint8_t *Encode(const TraceRecord &record, uint8_t *out);
+
+  // Decodes the record at *in, which must be before end, and advances *in
+  // past it. Returns false if the data is corrupt.
+  bool Decode(const uint8_t **in, const uint8_t *end, TraceRecord *record);
+
+ private:
+  enum Tag { kTagJump = 1 << 0, kTagInstruction = 1 << 1 };
+
+  uint16_t pc_;
+  uint16_t address_;
+  // each entry is generation_ << 16 | the last instruction word seen at its
+  // address; older generations are unknown
+  std::vector<uint32_t> shadow_;
+  uint32_t generation_ = 0;
+};
+
+// An observer (see observer.h) that writes a trace file. The interpreter
+// thread only copies each record into a ring buffer; a background thread
+// encodes and writes them. If that thread falls behind by the ring's size,
+// the interpreter waits for it, so memory stays bounded.
+class TraceRecorder : public NullObserver {
+ public:
+  TraceRecorder() = default;
+  ~TraceRecorder() { Finish(); }
+
+  TraceRecorder(const TraceRecorder &) = delete;
+  TraceRecorder &operator=(TraceRecorder &) = delete;
+
+  // Creates filename and starts the background thread.
+  bool Open(const std::string &filename);
+
+  // Writes what is left and closes the file. Returns false if any write
+  // failed.
+  bool Finish();
+
+  void Execute(uint16_t pc, uint16_t instr) {
+    if (pending_) {
+      Push();
+    }
+    current_ = {pc, instr, 0, 0, 0};
+    pending_ = true;
+  }
+
+  void Load(uint16_t address, uint16_t value) {
+    current_.address = address;
+    current_.value = value;
+  }
+
+  void Store(uint16_t address, uint16_t value) {
+    current_.address = address;
+    current_.value = value;
+  }
+
+  void Result(uint16_t, uint16_t value) { current_.result = value; }
+
+  void Retry(uint16_t, uint16_t) { pending_ = false; }
+
+ private:
+  static constexpr size_t kRingSize = 1 << 20;  // records
+  static constexpr size_t kBatchSize = 1 << 12;  // records published at once
+  static constexpr uint32_t kChunkRecords = 1 << 16;
+
+  void Push() {
+    if (head_ % kBatchSize == 0) {
+      Reserve();
+    }
+    ring_[head_ % kRingSize] = current_;
+    if (++head_ % kBatchSize == 0) {
+      Publish();
+    }
+  }
+
+  void Reserve();
+  void Publish();
+  void Compress();
+  void WriteChunk();
+
+  TraceRecord current_;
+  bool pending_ = false;  // current_ is an instruction yet to be pushed
+  uint64_t head_ = 0;     // records pushed; used only by the interpreter
+
+  std::unique_ptr<TraceRecord[]> ring_;
+  std::atomic<uint64_t> published_{0};  // records the compressor may read
+  std::atomic<uint64_t> tail_{0};       // records the compressor has read
+  std::atomic<bool> done_{false};
+  std::atomic<bool> idle_{false};  // the compressor waits for records
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::thread compressor_;
+
+  std::FILE *file_ = nullptr;
+  bool failed_ = false;
+  TraceCodec codec_;
+  std::unique_ptr<uint8_t[]> chunk_;  // room for kChunkRecords records
+  uint8_t *chunk_end_;
+  uint32_t chunk_records_ = 0;
+};
+
+#endif  // LC3_TRACE_H_